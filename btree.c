@@ -0,0 +1,410 @@
+/*
+ * btree.c - Ordered set of address ranges, kept in a pooled B+-tree
+ *
+ * Inner nodes hold up to BTREE_ORDER children; child i covers the keys
+ * from keys[i] up to, but not including, keys[i + 1], and keys[0] is only
+ * used when the node is split.  Leaves hold up to BTREE_ORDER ranges in
+ * address order and are linked to their neighbours.
+ *
+ * Full nodes are split on insertion as usual.  Removal does not borrow
+ * from or merge with siblings; a node is only unlinked once it is empty.
+ * Separators then stay valid, merely becoming looser, and the height is
+ * bounded by the peak number of ranges, which for a trace replay is the
+ * peak number of live blocks.  Every leaf but an empty root holds at least
+ * one range, so the leaf walk never skips over long runs of empty leaves.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+
+/* Nodes carved from each slab */
+#define SLAB_NODES 64
+
+/* Deep enough for any tree of BTREE_ORDER >= 4 that fits in memory */
+#define MAX_DEPTH 48
+
+typedef struct node
+{
+    bool leaf;
+    int n; /* ranges in a leaf, children in an inner node */
+    union
+    {
+        struct
+        {
+            range_t ranges[BTREE_ORDER];
+            struct node *prev, *next;
+        } l;
+        struct
+        {
+            const char *keys[BTREE_ORDER];
+            struct node *child[BTREE_ORDER];
+        } in;
+    };
+} node_t;
+
+typedef struct slab
+{
+    struct slab *next;
+    node_t nodes[SLAB_NODES];
+} slab_t;
+
+struct btree
+{
+    node_t *root;
+    size_t size;
+    node_t *free_nodes; /* recycled nodes, linked through child[0] */
+    slab_t *slabs;
+    int used;           /* nodes handed out from the newest slab */
+};
+
+/* Path from the root to a leaf: nodes[d] is child pos[d - 1] of nodes[d-1] */
+typedef struct
+{
+    node_t *nodes[MAX_DEPTH];
+    int pos[MAX_DEPTH];
+    int depth;
+} path_t;
+
+static node_t *node_new(btree_t *tree, bool leaf)
+{
+    node_t *node;
+
+    if (tree->free_nodes != NULL)
+    {
+        node = tree->free_nodes;
+        tree->free_nodes = node->in.child[0];
+    }
+    else
+    {
+        if (tree->slabs == NULL || tree->used == SLAB_NODES)
+        {
+            slab_t *slab = malloc(sizeof(slab_t));
+            if (slab == NULL)
+            {
+                fprintf(stderr, "ERROR: out of memory in btree\n");
+                exit(1);
+            }
+            slab->next = tree->slabs;
+            tree->slabs = slab;
+            tree->used = 0;
+        }
+        node = &tree->slabs->nodes[tree->used++];
+    }
+    node->leaf = leaf;
+    node->n = 0;
+    if (leaf)
+        node->l.prev = node->l.next = NULL;
+    return node;
+}
+
+static void node_release(btree_t *tree, node_t *node)
+{
+    node->in.child[0] = tree->free_nodes;
+    tree->free_nodes = node;
+}
+
+/* Child of inner node whose key range holds lo */
+static int child_index(const node_t *node, const char *lo)
+{
+    int a = 1, b = node->n;
+
+    /* Find the first separator > lo; the child before it holds lo */
+    while (a < b)
+    {
+        int m = (a + b) / 2;
+        if (node->in.keys[m] <= lo)
+            a = m + 1;
+        else
+            b = m;
+    }
+    return a - 1;
+}
+
+/* Number of ranges in leaf with low address <= lo */
+static int leaf_rank(const node_t *leaf, const char *lo)
+{
+    int a = 0, b = leaf->n;
+
+    while (a < b)
+    {
+        int m = (a + b) / 2;
+        if (leaf->l.ranges[m].lo <= lo)
+            a = m + 1;
+        else
+            b = m;
+    }
+    return a;
+}
+
+/* Descend to the leaf whose key range holds lo, recording the way down */
+static node_t *descend(const btree_t *tree, const char *lo, path_t *path)
+{
+    node_t *node = tree->root;
+
+    path->depth = 0;
+    while (!node->leaf)
+    {
+        int i = child_index(node, lo);
+        path->nodes[path->depth] = node;
+        path->pos[path->depth] = i;
+        path->depth++;
+        node = node->in.child[i];
+    }
+    return node;
+}
+
+btree_t *btree_new(void)
+{
+    btree_t *tree = calloc(1, sizeof(btree_t));
+    if (tree == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in btree\n");
+        exit(1);
+    }
+    tree->root = node_new(tree, true);
+    return tree;
+}
+
+void btree_free(btree_t *tree)
+{
+    while (tree->slabs != NULL)
+    {
+        slab_t *next = tree->slabs->next;
+        free(tree->slabs);
+        tree->slabs = next;
+    }
+    free(tree);
+}
+
+size_t btree_size(const btree_t *tree)
+{
+    return tree->size;
+}
+
+/*
+ * insert_child - put child, whose keys start at key, at position pos of
+ *     the inner node at depth d of path, splitting full nodes on the way up
+ */
+static void insert_child(btree_t *tree, path_t *path, int d, int pos,
+                         const char *key, node_t *child)
+{
+    while (d >= 0)
+    {
+        node_t *node = path->nodes[d];
+        node_t *right;
+        int half = BTREE_ORDER / 2;
+
+        if (node->n < BTREE_ORDER)
+        {
+            memmove(&node->in.keys[pos + 1], &node->in.keys[pos],
+                    (node->n - pos) * sizeof(node->in.keys[0]));
+            memmove(&node->in.child[pos + 1], &node->in.child[pos],
+                    (node->n - pos) * sizeof(node->in.child[0]));
+            node->in.keys[pos] = key;
+            node->in.child[pos] = child;
+            node->n++;
+            return;
+        }
+
+        /* Split: the upper half moves to a new right sibling */
+        right = node_new(tree, false);
+        memcpy(right->in.keys, &node->in.keys[half],
+               half * sizeof(node->in.keys[0]));
+        memcpy(right->in.child, &node->in.child[half],
+               half * sizeof(node->in.child[0]));
+        right->n = half;
+        node->n = half;
+        if (pos <= half)
+            insert_child(tree, path, d, pos, key, child);
+        else
+        {
+            node_t *target = right;
+            int p = pos - half;
+            memmove(&target->in.keys[p + 1], &target->in.keys[p],
+                    (target->n - p) * sizeof(target->in.keys[0]));
+            memmove(&target->in.child[p + 1], &target->in.child[p],
+                    (target->n - p) * sizeof(target->in.child[0]));
+            target->in.keys[p] = key;
+            target->in.child[p] = child;
+            target->n++;
+        }
+
+        /* Hand the new sibling to the parent */
+        key = right->in.keys[0];
+        child = right;
+        pos = d > 0 ? path->pos[d - 1] + 1 : 1;
+        d--;
+    }
+
+    /* The root was split: grow the tree by one level */
+    node_t *root = node_new(tree, false);
+    root->in.keys[0] = tree->root->leaf ? tree->root->l.ranges[0].lo
+                                        : tree->root->in.keys[0];
+    root->in.child[0] = tree->root;
+    root->in.keys[1] = key;
+    root->in.child[1] = child;
+    root->n = 2;
+    tree->root = root;
+}
+
+bool btree_insert(btree_t *tree, const range_t *range)
+{
+    path_t path;
+    node_t *leaf = descend(tree, range->lo, &path);
+    int pos = leaf_rank(leaf, range->lo);
+    int half = BTREE_ORDER / 2;
+    node_t *right;
+
+    if (pos > 0 && leaf->l.ranges[pos - 1].lo == range->lo)
+        return false;
+    tree->size++;
+
+    if (leaf->n < BTREE_ORDER)
+    {
+        memmove(&leaf->l.ranges[pos + 1], &leaf->l.ranges[pos],
+                (leaf->n - pos) * sizeof(range_t));
+        leaf->l.ranges[pos] = *range;
+        leaf->n++;
+        return true;
+    }
+
+    /* Split the leaf, link the new right half, and insert into one side */
+    right = node_new(tree, true);
+    memcpy(right->l.ranges, &leaf->l.ranges[half], half * sizeof(range_t));
+    right->n = half;
+    leaf->n = half;
+    right->l.next = leaf->l.next;
+    right->l.prev = leaf;
+    if (leaf->l.next != NULL)
+        leaf->l.next->l.prev = right;
+    leaf->l.next = right;
+    {
+        node_t *target = pos <= half ? leaf : right;
+        int p = pos <= half ? pos : pos - half;
+        memmove(&target->l.ranges[p + 1], &target->l.ranges[p],
+                (target->n - p) * sizeof(range_t));
+        target->l.ranges[p] = *range;
+        target->n++;
+    }
+
+    if (path.depth == 0)
+    {
+        /* The root was a leaf */
+        node_t *root = node_new(tree, false);
+        root->in.keys[0] = leaf->l.ranges[0].lo;
+        root->in.child[0] = leaf;
+        root->in.keys[1] = right->l.ranges[0].lo;
+        root->in.child[1] = right;
+        root->n = 2;
+        tree->root = root;
+        return true;
+    }
+    insert_child(tree, &path, path.depth - 1, path.pos[path.depth - 1] + 1,
+                 right->l.ranges[0].lo, right);
+    return true;
+}
+
+bool btree_remove(btree_t *tree, const char *lo, range_t *range)
+{
+    path_t path;
+    node_t *node = descend(tree, lo, &path);
+    int pos = leaf_rank(node, lo) - 1;
+    int d;
+
+    if (pos < 0 || node->l.ranges[pos].lo != lo)
+        return false;
+    if (range != NULL)
+        *range = node->l.ranges[pos];
+    tree->size--;
+    memmove(&node->l.ranges[pos], &node->l.ranges[pos + 1],
+            (node->n - pos - 1) * sizeof(range_t));
+    node->n--;
+    if (node->n > 0 || path.depth == 0)
+        return true;
+
+    /* Unlink the empty leaf, then any inner nodes it leaves empty */
+    if (node->l.prev != NULL)
+        node->l.prev->l.next = node->l.next;
+    if (node->l.next != NULL)
+        node->l.next->l.prev = node->l.prev;
+    for (d = path.depth - 1; d >= 0; d--)
+    {
+        node_t *parent = path.nodes[d];
+        int i = path.pos[d];
+
+        node_release(tree, node);
+        memmove(&parent->in.keys[i], &parent->in.keys[i + 1],
+                (parent->n - i - 1) * sizeof(parent->in.keys[0]));
+        memmove(&parent->in.child[i], &parent->in.child[i + 1],
+                (parent->n - i - 1) * sizeof(parent->in.child[0]));
+        parent->n--;
+        if (parent->n > 0)
+            break;
+        node = parent;
+    }
+    if (d < 0)
+    {
+        /* Everything is gone: start over with an empty leaf */
+        node_release(tree, node);
+        tree->root = node_new(tree, true);
+        return true;
+    }
+
+    /* Drop roots that are left with a single child */
+    while (!tree->root->leaf && tree->root->n == 1)
+    {
+        node_t *old = tree->root;
+        tree->root = old->in.child[0];
+        node_release(tree, old);
+    }
+    return true;
+}
+
+void btree_neighbors(const btree_t *tree, const char *lo,
+                     const range_t **prev, const range_t **next)
+{
+    path_t path;
+    const node_t *leaf = descend(tree, lo, &path);
+    int rank = leaf_rank(leaf, lo);
+
+    /* Removals loosen separators, so the leaf may hold only keys above lo */
+    if (rank > 0)
+        *prev = &leaf->l.ranges[rank - 1];
+    else if (leaf->l.prev != NULL)
+        *prev = &leaf->l.prev->l.ranges[leaf->l.prev->n - 1];
+    else
+        *prev = NULL;
+
+    if (rank < leaf->n)
+        *next = &leaf->l.ranges[rank];
+    else if (leaf->l.next != NULL)
+        *next = &leaf->l.next->l.ranges[0];
+    else
+        *next = NULL;
+}
+
+const range_t *btree_first(const btree_t *tree, btree_iter_t *it)
+{
+    const node_t *node = tree->root;
+
+    while (!node->leaf)
+        node = node->in.child[0];
+    it->leaf = node;
+    it->pos = 0;
+    return node->n > 0 ? &node->l.ranges[0] : NULL;
+}
+
+const range_t *btree_next(btree_iter_t *it)
+{
+    const node_t *leaf = it->leaf;
+
+    if (++it->pos < leaf->n)
+        return &leaf->l.ranges[it->pos];
+    leaf = leaf->l.next;
+    it->leaf = leaf;
+    it->pos = 0;
+    return leaf != NULL ? &leaf->l.ranges[0] : NULL;
+}
@@ -0,0 +1,75 @@
+/**
+ * @file btree.h
+ * @brief Ordered set of address ranges, kept in a pooled B+-tree
+ *
+ * The driver records the extent of every allocated payload here, keyed by
+ * its low address, to detect overlapping blocks.  Ranges are stored inline
+ * in the leaves, which are linked in address order, so finding the
+ * neighbours of an address costs O(log n) and visiting every range is a
+ * walk over a few contiguous arrays.  Nodes come from slabs owned by the
+ * tree and are recycled through a free list, so inserting and removing
+ * ranges does not call malloc once the tree has reached its peak size.
+ */
+
+#ifndef __BTREE_H_
+#define __BTREE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* Ranges per leaf and children per inner node */
+#define BTREE_ORDER 32
+
+/* Extent of one allocated payload */
+typedef struct
+{
+    char *lo;  /* low payload address (the key) */
+    char *hi;  /* high payload address */
+    int index; /* trace block id */
+} range_t;
+
+typedef struct btree btree_t;
+
+/* Position in a walk over all ranges; see btree_first() */
+typedef struct
+{
+    const void *leaf;
+    int pos;
+} btree_iter_t;
+
+/* Creates an empty tree */
+btree_t *btree_new(void);
+
+/* Frees a tree and all of its nodes */
+void btree_free(btree_t *tree);
+
+/* Number of ranges in the tree */
+size_t btree_size(const btree_t *tree);
+
+/* Adds a range.  Returns false if one with the same lo is present */
+bool btree_insert(btree_t *tree, const range_t *range);
+
+/*
+ * Removes the range starting at lo, copying it to *range if range is not
+ * NULL.  Returns false if there is no such range.
+ */
+bool btree_remove(btree_t *tree, const char *lo, range_t *range);
+
+/*
+ * Finds the ranges on either side of address lo: *prev is set to the
+ * range with the largest low address <= lo and *next to the one with the
+ * smallest low address > lo, or to NULL where there is none.  The
+ * pointers are valid until the tree is next modified.
+ */
+void btree_neighbors(const btree_t *tree, const char *lo,
+                     const range_t **prev, const range_t **next);
+
+/*
+ * Walks the ranges in address order: btree_first() returns the first, or
+ * NULL if the tree is empty, and btree_next() each following one.  The
+ * tree must not be modified during a walk.
+ */
+const range_t *btree_first(const btree_t *tree, btree_iter_t *it);
+const range_t *btree_next(btree_iter_t *it);
+
+#endif /* __BTREE_H_ */
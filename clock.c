@@ -19,6 +19,10 @@
 #else
 #include <time.h>
 #endif
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
 #include "clock.h"
 
 int gverbose = 1;
@@ -52,7 +56,6 @@ double core_mhz(int verbose)
     {
         if (strstr(buf, "cpu MHz"))
         {
-            double cpu_mhz = 0.0;
             sscanf(buf, "cpu MHz\t: %lf", &cpu_mhz);
             break;
         }
@@ -72,10 +75,20 @@ double core_mhz(int verbose)
     return cpu_mhz;
 }
 
+/* With an invariant TSC, the clock rate is that of the TSC, measured
+   against CLOCK_MONOTONIC, and cycles are TSC ticks.  Otherwise it is read
+   from /proc/cpuinfo and cycles are derived from the thread CPU time */
 double mhz(int verbose)
 {
-    double val = core_mhz(verbose);
-    return val;
+    if (!tsc_invariant())
+        return core_mhz(verbose);
+    cpu_mhz = ticks_per_sec() * 1e-6;
+    if (verbose)
+    {
+        printf("Processor Clock Rate ~= %.4f GHz (invariant TSC)\n",
+               cpu_mhz * 0.001);
+    }
+    return cpu_mhz;
 }
 
 #ifdef USE_TOD
@@ -138,15 +151,146 @@ double get_timer()
     return delta_secs;
 }
 
+static unsigned long long counter_start;
+
 void start_counter()
 {
     if (cpu_mhz == 0.0)
         mhz(gverbose);
-    start_timer();
+    if (tsc_invariant())
+        counter_start = read_ticks();
+    else
+        start_timer();
 }
 
 double get_counter()
 {
+    if (tsc_invariant())
+        return (double)(read_ticks() - counter_start);
     double delta_secs = get_timer();
     return delta_secs * cpu_mhz * 1e6;
 }
+
+/* Tick counter */
+
+unsigned long long read_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    /* rdtscp waits for earlier instructions to finish before reading */
+    unsigned int aux;
+    return __rdtscp(&aux);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static double tick_rate = 0.0;
+static double tick_overhead = -1.0;
+static int tsc_state = -1;
+
+/* CPUID leaf 0x80000007 reports in EDX bit 8 whether the TSC runs at a
+   constant rate through frequency changes and sleep states */
+int tsc_invariant()
+{
+    if (tsc_state >= 0)
+        return tsc_state;
+    tsc_state = 0;
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        tsc_state = (edx >> 8) & 1;
+#endif
+    return tsc_state;
+}
+
+static double mono_secs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+/* Read the ticks between two readings of the monotonic clock, taking the
+   tightest of a few tries, and return the time midway between them */
+#define CAL_TRIES 5
+static double ticks_at(unsigned long long *ticks)
+{
+    double best = 1e20, when = 0.0;
+    int i;
+
+    for (i = 0; i < CAL_TRIES; i++)
+    {
+        double t0 = mono_secs();
+        unsigned long long c = read_ticks();
+        double t1 = mono_secs();
+        if (t1 - t0 < best)
+        {
+            best = t1 - t0;
+            when = 0.5 * (t0 + t1);
+            *ticks = c;
+        }
+    }
+    return when;
+}
+
+/* Time ticks against the monotonic clock for at least 20 ms */
+double ticks_per_sec()
+{
+    unsigned long long c0 = 0, c1 = 0;
+    double t0, t1;
+
+    if (tick_rate > 0.0)
+        return tick_rate;
+#if !defined(__x86_64__) && !defined(__i386__)
+    tick_rate = 1e9;
+    return tick_rate;
+#endif
+    t0 = ticks_at(&c0);
+    while (mono_secs() < t0 + 0.02)
+        ;
+    t1 = ticks_at(&c1);
+    tick_rate = (c1 - c0) / (t1 - t0);
+    return tick_rate;
+}
+
+#define OVH_K 3
+#define OVH_EPSILON 0.01
+#define OVH_MAXSAMPLES 1000
+
+/* Keep the OVH_K smallest empty intervals, until they agree within
+   OVH_EPSILON or OVH_MAXSAMPLES have been taken */
+double ticks_overhead()
+{
+    double best[OVH_K];
+    int n;
+
+    if (tick_overhead >= 0.0)
+        return tick_overhead;
+    for (n = 0; n < OVH_MAXSAMPLES; n++)
+    {
+        unsigned long long c0 = read_ticks();
+        unsigned long long c1 = read_ticks();
+        double val = (double)(c1 - c0);
+        int pos;
+        if (n < OVH_K)
+            pos = n;
+        else if (val < best[OVH_K - 1])
+            pos = OVH_K - 1;
+        else
+            continue;
+        best[pos] = val;
+        while (pos > 0 && best[pos - 1] > best[pos])
+        {
+            double temp = best[pos - 1];
+            best[pos - 1] = best[pos];
+            best[pos] = temp;
+            pos--;
+        }
+        if (n >= OVH_K && (1 + OVH_EPSILON) * best[0] >= best[OVH_K - 1])
+            break;
+    }
+    tick_overhead = best[0];
+    return tick_overhead;
+}
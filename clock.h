@@ -14,9 +14,28 @@ double get_timer();
 /* Determine clock rate of processor (using a default sleeptime) */
 double mhz(int verbose);
 
-/* Counter: measures in clock cycles */
+/* Counter: measures in clock cycles.  With an invariant TSC these are TSC
+   ticks of wall-clock time, which include time the thread spends
+   descheduled; otherwise they are derived from the thread's CPU time */
 /* Start the counter */
 void start_counter();
 
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter();
+
+/* Ticks: a raw cycle counter, cheap enough to time a single call */
+
+/* Read the tick counter (the TSC on x86, else a nanosecond clock) */
+unsigned long long read_ticks();
+
+/* Nonzero if the tick counter is a TSC that runs at a constant rate, in
+   which case the counter above counts ticks rather than converting time */
+int tsc_invariant();
+
+/* Number of ticks per second, measured against CLOCK_MONOTONIC on the
+   first call */
+double ticks_per_sec();
+
+/* Cost in ticks of an empty read_ticks() interval, measured on the first
+   call as the K-best minimum in the manner of fcyc */
+double ticks_overhead();
@@ -120,6 +120,12 @@
  */
 #define ALIGNMENT 16
 
+/*
+ * Number of times a multithreaded trace is replayed when timing it; the
+ * fastest run counts
+ */
+#define MT_REPLAY_RUNS 5
+
 /*********** Parameters controlling dense memory version of heap ***********/
 /*
  * Maximum heap size in bytes
@@ -131,6 +137,55 @@
  */
 #define TRY_DENSE_HEAP_START (void *)0x800000000
 
+/*
+ * Size of the pages used when the dense heap is backed by huge pages.
+ * MAX_DENSE_HEAP and TRY_DENSE_HEAP_START should both be multiples of it.
+ */
+#define HUGE_PAGE_SIZE (2 * (1 << 20)) /* 2 MB */
+
+/*
+ * Fixed address of a persistent (file-backed) heap.  Block pointers stored
+ * inside the heap are only meaningful if it is always mapped here.  The
+ * default lies in the high user range that ASan and MSan both leave to
+ * the program, so the sanitizer builds can map it too.
+ */
+#ifndef PERSISTENT_HEAP_START
+#define PERSISTENT_HEAP_START (void *)0x700000000000
+#endif
+
+/*
+ * Identifies a heap file written by mem_init_persistent
+ */
+#define PERSISTENT_HEAP_MAGIC 0x4d4c414248454150UL /* "MLABHEAP" */
+
+/*********** Parameters controlling the passthrough (mm.so) heap ***********/
+
+/*
+ * Bytes of address space reserved (PROT_NONE) for the heap up front.
+ * Only the part below the break is ever committed.
+ */
+#define PASSTHROUGH_RESERVE (1UL << 36) /* 64 GB */
+
+/*
+ * Granularity with which the heap is committed and decommitted, so that
+ * small mem_sbrk calls do not each cost an mprotect.
+ */
+#define PASSTHROUGH_COMMIT_CHUNK (1 << 16) /* 64 KB */
+
+/*********** Parameters controlling the trace recorder (mmtrace.so) ********/
+
+/*
+ * Records buffered per thread before the thread has to wait for the
+ * writer thread to catch up
+ */
+#define MMTRACE_RING_SIZE (1 << 14)
+
+/*
+ * Output file used when MMTRACE_OUT is not set.  Names ending in .rep get
+ * the text format, anything else the binary format.
+ */
+#define MMTRACE_DEFAULT_OUT "mmtrace.trc"
+
 /*********** Parameters controlling sparse memory version of heap ***********/
 
 /*
@@ -175,4 +230,24 @@
 #define BENCH_KEY "regular"
 #define BENCH_KEY_CHECKPOINT "checkpoint"
 
+/******** Parameters for estimating it from the machine score (mscore.c) ****/
+/*
+ * Cache of machine scores, one line per host and CPU model
+ */
+#define MSCORE_FILE "./mscores.txt"
+
+/*
+ * Best time of each kernel on the reference machine, in seconds
+ */
+#define MSCORE_CHASE_SECS 0.042
+#define MSCORE_COPY_SECS 0.011
+#define MSCORE_WALK_SECS 0.012
+
+/*
+ * Throughput of the reference allocators on the reference machine, in
+ * Kops/s; scaled by the machine score on CPUs missing from THROUGHPUT_FILE
+ */
+#define MSCORE_KOPS 6420.0
+#define MSCORE_KOPS_CHECKPOINT 9930.0
+
 #endif /* __CONFIG_H */
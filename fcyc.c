@@ -1,6 +1,8 @@
 /* Compute time used by function f */
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/times.h>
 
 #include "clock.h"
@@ -14,6 +16,9 @@
 #define CACHE_BLOCK 32
 #define MIN_TICKS 1000
 #define MIN_REPS 8
+#define WARMUP 2
+#define ROBUST_MIN 10
+#define ROBUST_MAX 200
 
 static long int kbest = K;
 static int clear_cache = CLEAR_CACHE;
@@ -24,6 +29,8 @@ static long int cache_block = CACHE_BLOCK;
 static long int min_reps = MIN_REPS;
 static long int min_ticks = MIN_TICKS;
 static double min_time = 0;
+static long int robust_samples = -1; /* < 0: K-best; 0: adaptive */
+static long int warmup = WARMUP;
 
 static long int *cache_buf = NULL;
 
@@ -37,6 +44,10 @@ static long int samplecount = 0;
 static double *samples = NULL;
 #endif
 
+/* All samples of the last robust measurement, and their summary */
+static double *rsamples = NULL;
+static fcyc_summary_t summary;
+
 /* Initialize the minimum time threshold */
 static void init_min_time()
 {
@@ -123,10 +134,101 @@ static void clear()
     sink = x;
 }
 
+/* Robust measurement */
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/* Median of the n sorted values in v */
+static double sorted_median(const double *v, long int n)
+{
+    return n % 2 ? v[n / 2] : 0.5 * (v[n / 2 - 1] + v[n / 2]);
+}
+
+/*
+ * Summarize the n samples in rsamples.  The confidence interval of the
+ * median is distribution-free: the number of samples below the median is
+ * binomial(n, 1/2), so the order statistics of rank n/2 -+ 1.96 sqrt(n)/2
+ * bracket it with about 95% confidence, whatever the shape of the noise.
+ */
+static void summarize(long int n)
+{
+    double *v = malloc(n * sizeof(double));
+    long int j, k, i;
+    if (!v)
+    {
+        fprintf(stderr, "Fatal error.  Malloc returned null in fcyc\n");
+        exit(1);
+    }
+    memcpy(v, rsamples, n * sizeof(double));
+    qsort(v, n, sizeof(double), cmp_double);
+    summary.n = n;
+    summary.samples = rsamples;
+    summary.median = sorted_median(v, n);
+    j = (long int)floor(0.5 * n - 0.98 * sqrt((double)n));
+    k = (long int)ceil(0.5 * n + 0.98 * sqrt((double)n)) + 1;
+    summary.ci_lo = v[j < 1 ? 0 : j - 1];
+    summary.ci_hi = v[k > n ? n - 1 : k - 1];
+    for (i = 0; i < n; i++)
+        v[i] = fabs(v[i] - summary.median);
+    qsort(v, n, sizeof(double), cmp_double);
+    summary.mad = sorted_median(v, n);
+    free(v);
+}
+
+/*
+ * After warmup discarded samples, take robust_samples samples of reps
+ * calls each (reps starts at 1 here rather than min_reps, since more
+ * samples of one call say more about the spread than fewer of several),
+ * or with robust_samples = 0, take samples until the 95% confidence
+ * interval of the median is within epsilon of it on either side, at least
+ * ROBUST_MIN and at most ROBUST_MAX.  Returns the median.
+ */
+static double robust_measure(test_funct f, void *args, long reps, int cycles)
+{
+    long int want = robust_samples > 0 ? robust_samples : ROBUST_MAX;
+    long int n = 0, i, r;
+
+    free(rsamples);
+    rsamples = malloc(want * sizeof(double));
+    if (!rsamples)
+    {
+        fprintf(stderr, "Fatal error.  Malloc returned null in fcyc\n");
+        exit(1);
+    }
+    for (i = -warmup; n < want; i++)
+    {
+        double val;
+        if (clear_cache)
+            clear();
+        if (cycles)
+            start_counter();
+        else
+            start_timer();
+        for (r = 0; r < reps; r++)
+            f(args);
+        val = (cycles ? get_counter() : get_timer()) / reps;
+        if (i < 0 || val <= 0.0)
+            continue;
+        rsamples[n++] = val;
+        if (robust_samples == 0 && n >= ROBUST_MIN)
+        {
+            summarize(n);
+            if (summary.ci_hi - summary.ci_lo <= 2 * epsilon * summary.median)
+                return summary.median;
+        }
+    }
+    summarize(n);
+    return summary.median;
+}
+
 double fcyc(test_funct f, void *args)
 {
     double result;
-    long reps = min_reps;
+    long reps = robust_samples >= 0 ? 1 : min_reps;
     long r;
     double cyc;
     /* Increase reps until get meaningful times */
@@ -145,6 +247,8 @@ double fcyc(test_funct f, void *args)
         if (sec < min_time)
             reps += reps;
     }
+    if (robust_samples >= 0)
+        return robust_measure(f, args, reps, 1);
     init_sampler();
     do
     {
@@ -171,7 +275,7 @@ double fsec(test_funct f, void *args)
 {
     double result;
     /* Increase reps until get meaningful times */
-    long reps = min_reps;
+    long reps = robust_samples >= 0 ? 1 : min_reps;
     long r;
     double sec = 0.0;
     init_min_time();
@@ -189,6 +293,8 @@ double fsec(test_funct f, void *args)
             reps += reps;
         //        printf("uSecs = %.3f, reps = %ld\n", sec * 1e6, reps);
     }
+    if (robust_samples >= 0)
+        return robust_measure(f, args, reps, 0);
     init_sampler();
     //    printf("\nuSecs (reps=%ld):", reps);
     do
@@ -285,3 +391,26 @@ void set_fcyc_epsilon(double epsilon_arg)
 {
     epsilon = epsilon_arg;
 }
+
+/* Number of samples in robust mode: 0 for as many as it takes, -1 to go
+   back to K-best
+   Default = -1
+*/
+void set_fcyc_samples(long int n)
+{
+    robust_samples = n;
+}
+
+/* Number of samples discarded before measuring in robust mode
+   Default = 2
+*/
+void set_fcyc_warmup(long int runs)
+{
+    warmup = runs;
+}
+
+/* Summary of the last measurement made in robust mode */
+const fcyc_summary_t *fcyc_summary()
+{
+    return &summary;
+}
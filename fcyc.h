@@ -7,6 +7,16 @@
 
 typedef void (*test_funct)(void *);
 
+/* Outcome of a measurement in robust mode, in the units of the call */
+typedef struct
+{
+    long int n;            /* number of samples kept */
+    double median;         /* median sample (the value returned) */
+    double mad;            /* median absolute deviation from the median */
+    double ci_lo, ci_hi;   /* 95% confidence interval of the median */
+    const double *samples; /* the samples, in the order taken */
+} fcyc_summary_t;
+
 /* Compute number of cycles used by function f on given set of parameters */
 double fcyc(test_funct f, void *args);
 
@@ -57,3 +67,23 @@ void set_fcyc_maxsamples(long int maxsamples);
    Default = 0.01
 */
 void set_fcyc_epsilon(double epsilon);
+
+/* Robust mode: rather than the K-best minimum, fcyc and fsec return the
+   median of a number of samples taken after some warm-up runs, and
+   fcyc_summary() describes their spread.
+
+   Number of samples: n > 0 for exactly n, 0 for as many as it takes
+   (10 to 200) for the confidence interval of the median to come within
+   epsilon of it, -1 for K-best.
+   Default = -1
+*/
+void set_fcyc_samples(long int n);
+
+/* Number of samples discarded before measuring in robust mode
+   Default = 2
+*/
+void set_fcyc_warmup(long int runs);
+
+/* Summary of the last measurement made in robust mode.  The samples stay
+   valid until the next one */
+const fcyc_summary_t *fcyc_summary();
@@ -0,0 +1,57 @@
+/**
+ * @file heapmap.h
+ * @brief Binary format of the heap snapshots written by mdriver -M
+ *
+ * A heap map file is a heapmap_header_t followed by snapshots, each a
+ * heapmap_snap_t and then snap.num_blocks records of one heapmap_block_t
+ * per block of the heap, in address order.  Block sizes are multiples of
+ * 16, so the low four bits of a record hold the alloc bit and the size
+ * class instead; use the macros below to take a record apart.  All fields
+ * are in the byte order of the machine that wrote the file.
+ *
+ * heapview renders a heap map as an image, one row per snapshot.
+ */
+
+#ifndef __HEAPMAP_H_
+#define __HEAPMAP_H_
+
+#include <stdint.h>
+
+/* First bytes of every heap map file */
+#define HEAPMAP_MAGIC "MLHEAP1"
+
+typedef struct
+{
+    char magic[8];       /* HEAPMAP_MAGIC, null-terminated */
+    uint32_t num_classes; /* size classes of the allocator */
+    uint32_t reserved;
+} heapmap_header_t;
+
+/* One snapshot, taken after op number op of the trace */
+typedef struct
+{
+    uint64_t op;         /* ops replayed so far */
+    uint64_t heap_size;  /* mem_heapsize() */
+    uint64_t num_blocks; /* block records that follow */
+} heapmap_snap_t;
+
+/* One block: offset of its header from the heap start, and size | bits */
+typedef struct
+{
+    uint64_t offset;
+    uint64_t size_bits;
+} heapmap_block_t;
+
+#define HEAPMAP_ALLOC 0x1ULL
+#define HEAPMAP_CLASS_SHIFT 1
+#define HEAPMAP_CLASS_MASK 0x7ULL
+
+#define HEAPMAP_PACK(size, alloc, cls)                                       \
+    ((uint64_t)(size) | ((alloc) ? HEAPMAP_ALLOC : 0) |                      \
+     (((uint64_t)(cls) & HEAPMAP_CLASS_MASK) << HEAPMAP_CLASS_SHIFT))
+#define HEAPMAP_SIZE(bits) ((bits) & ~0xfULL)
+#define HEAPMAP_IS_ALLOC(bits) (((bits) & HEAPMAP_ALLOC) != 0)
+#define HEAPMAP_CLASS(bits)                                                  \
+    ((int)(((bits) >> HEAPMAP_CLASS_SHIFT) & HEAPMAP_CLASS_MASK))
+
+#endif /* __HEAPMAP_H_ */
@@ -0,0 +1,271 @@
+/*
+ * heapview - draw the heap maps written by mdriver -M
+ *
+ * usage: heapview [-h] [-w width] [-r rows] [-o outfile] heapmap
+ *
+ * The image has one band of rows per snapshot, from the first at the top
+ * to the last at the bottom, and spans the largest heap of the file from
+ * left to right, so each pixel stands for the same range of addresses in
+ * every band.  Allocated blocks are coloured by size class, free blocks
+ * are black, bytes that are in the heap but in no block (the allocator's
+ * own data) are grey, and addresses above the heap at that point are
+ * white.  Where a pixel covers several blocks its colour is the mix of
+ * theirs, weighted by bytes, so the picture stays faithful however many
+ * blocks the heap holds.  Holes that persist show up as dark columns, and
+ * a heap that keeps growing past them as a band that widens to the right.
+ *
+ * The image is written as a binary PPM, which most image tools read.
+ */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "heapmap.h"
+
+#define MAXLINE 1024
+
+/* Largest image accepted, in pixels */
+#define MAX_PIXELS (1L << 28)
+
+typedef struct
+{
+    double r, g, b;
+} rgb_t;
+
+static const rgb_t class_colour[8] = {
+    {78, 121, 167},  {242, 142, 43}, {225, 87, 89},   {118, 183, 178},
+    {89, 161, 79},   {237, 201, 72}, {176, 122, 161}, {255, 157, 167}};
+static const rgb_t free_colour = {0, 0, 0};
+static const rgb_t other_colour = {128, 128, 128};
+static const rgb_t above_colour = {255, 255, 255};
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h] [-w width] [-r rows] [-o outfile] "
+                    "heapmap\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-w <n>     Width of the image in pixels "
+                    "(default 1024).\n");
+    fprintf(stderr, "\t-r <n>     Rows per snapshot (default: enough for "
+                    "about 512 rows).\n");
+    fprintf(stderr, "\t-o <file>  Output image (default: heapmap with .ppm "
+                    "for its suffix).\n");
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in heapview\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void read_error(const char *path)
+{
+    fprintf(stderr, "ERROR: %s: truncated or not a heap map\n", path);
+    exit(1);
+}
+
+/*
+ * paint - adds len bytes of colour c, starting at heap offset lo, to the
+ *     pixels of a row that they fall in
+ */
+static void paint(rgb_t *row, double *bytes, int width, double scale,
+                  uint64_t lo, uint64_t len, rgb_t c)
+{
+    double x = lo * scale, end = (double)(lo + len) * scale;
+
+    while (x < end)
+    {
+        int px = (int)x;
+        double next = px + 1.0 < end ? px + 1.0 : end;
+        double w = (next - x) / scale;
+        if (px >= width)
+            break;
+        row[px].r += c.r * w;
+        row[px].g += c.g * w;
+        row[px].b += c.b * w;
+        bytes[px] += w;
+        x = next;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *outfile = NULL;
+    char outbuf[MAXLINE];
+    int width = 1024, rows = 0, c, x, k;
+    heapmap_header_t hdr;
+    heapmap_snap_t snap;
+    heapmap_block_t *blocks = NULL;
+    size_t cap = 0;
+    uint64_t max_heap = 0, num_snaps = 0, max_blocks = 0, s;
+    rgb_t *row;
+    double *bytes, scale;
+    unsigned char *pixels;
+    FILE *in, *out;
+
+    while ((c = getopt(argc, argv, "hw:r:o:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'w':
+            width = atoi(optarg);
+            break;
+        case 'r':
+            rows = atoi(optarg);
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (argc - optind != 1 || width <= 0 || rows < 0)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+    if ((in = fopen(argv[optind], "rb")) == NULL)
+    {
+        perror(argv[optind]);
+        exit(1);
+    }
+    if (fread(&hdr, sizeof(hdr), 1, in) != 1 ||
+        memcmp(hdr.magic, HEAPMAP_MAGIC, sizeof(HEAPMAP_MAGIC)) != 0)
+        read_error(argv[optind]);
+
+    /* First pass: how many snapshots, and how large the heap gets */
+    while (fread(&snap, sizeof(snap), 1, in) == 1)
+    {
+        if (snap.heap_size > max_heap)
+            max_heap = snap.heap_size;
+        if (snap.num_blocks > max_blocks)
+            max_blocks = snap.num_blocks;
+        if (fseek(in, (long)(snap.num_blocks * sizeof(heapmap_block_t)),
+                  SEEK_CUR) != 0)
+            read_error(argv[optind]);
+        num_snaps++;
+    }
+    if (num_snaps == 0 || max_heap == 0)
+        read_error(argv[optind]);
+    if (rows == 0)
+        rows = num_snaps >= 512 ? 1 : (int)(512 / num_snaps);
+    if ((double)width * rows * num_snaps > MAX_PIXELS)
+    {
+        fprintf(stderr, "ERROR: image of %d x %llu pixels is too large\n",
+                width, (unsigned long long)(rows * num_snaps));
+        exit(1);
+    }
+
+    if (outfile == NULL)
+    {
+        char *dot;
+        snprintf(outbuf, sizeof(outbuf) - 4, "%s", argv[optind]);
+        if ((dot = strrchr(outbuf, '.')) != NULL && strchr(dot, '/') == NULL)
+            *dot = '\0';
+        strcat(outbuf, ".ppm");
+        outfile = outbuf;
+    }
+    if ((out = fopen(outfile, "wb")) == NULL)
+    {
+        perror(outfile);
+        exit(1);
+    }
+    fprintf(out, "P6\n%d %llu\n255\n", width,
+            (unsigned long long)(rows * num_snaps));
+
+    /* Second pass: draw each snapshot */
+    row = xrealloc(NULL, width * sizeof(rgb_t));
+    bytes = xrealloc(NULL, width * sizeof(double));
+    pixels = xrealloc(NULL, (size_t)width * 3);
+    scale = (double)width / max_heap;
+    fseek(in, sizeof(hdr), SEEK_SET);
+    for (s = 0; s < num_snaps; s++)
+    {
+        uint64_t i;
+        if (fread(&snap, sizeof(snap), 1, in) != 1)
+            read_error(argv[optind]);
+        if (snap.num_blocks > cap)
+        {
+            cap = snap.num_blocks;
+            blocks = xrealloc(blocks, cap * sizeof(heapmap_block_t));
+        }
+        if (fread(blocks, sizeof(heapmap_block_t), snap.num_blocks, in) !=
+            snap.num_blocks)
+            read_error(argv[optind]);
+
+        memset(row, 0, width * sizeof(rgb_t));
+        memset(bytes, 0, width * sizeof(double));
+        for (i = 0; i < snap.num_blocks; i++)
+        {
+            uint64_t bits = blocks[i].size_bits;
+            paint(row, bytes, width, scale, blocks[i].offset,
+                  HEAPMAP_SIZE(bits),
+                  HEAPMAP_IS_ALLOC(bits) ? class_colour[HEAPMAP_CLASS(bits)]
+                                         : free_colour);
+        }
+
+        /* What the blocks leave uncovered is allocator data or no heap */
+        for (x = 0; x < width; x++)
+        {
+            double lo = x / scale, hi = (x + 1) / scale;
+            double in_heap = (snap.heap_size < hi ? snap.heap_size : hi) - lo;
+            double other, above;
+            if (in_heap < 0)
+                in_heap = 0;
+            other = in_heap - bytes[x];
+            above = (hi - lo) - in_heap;
+            if (other < 0)
+                other = 0;
+            row[x].r += other * other_colour.r + above * above_colour.r;
+            row[x].g += other * other_colour.g + above * above_colour.g;
+            row[x].b += other * other_colour.b + above * above_colour.b;
+            bytes[x] += other + above;
+            pixels[3 * x] = (unsigned char)(row[x].r / bytes[x] + 0.5);
+            pixels[3 * x + 1] = (unsigned char)(row[x].g / bytes[x] + 0.5);
+            pixels[3 * x + 2] = (unsigned char)(row[x].b / bytes[x] + 0.5);
+        }
+        for (k = 0; k < rows; k++)
+            if (fwrite(pixels, 3, width, out) != (size_t)width)
+            {
+                perror(outfile);
+                exit(1);
+            }
+    }
+    if (fclose(out) != 0)
+    {
+        perror(outfile);
+        exit(1);
+    }
+    fclose(in);
+
+    printf("%s: %llu snapshots, heap up to %llu KB, up to %llu blocks, "
+           "%.0f bytes per pixel\n",
+           outfile, (unsigned long long)num_snaps,
+           (unsigned long long)(max_heap / 1024),
+           (unsigned long long)max_blocks, 1.0 / scale);
+    printf("Colours: black free, grey allocator data, white above the heap; "
+           "allocated by size class:\n");
+    for (k = 0; k < (int)hdr.num_classes && k < 8; k++)
+        printf("  class %d  #%02x%02x%02x\n", k + 1,
+               (unsigned)class_colour[k].r, (unsigned)class_colour[k].g,
+               (unsigned)class_colour[k].b);
+    free(row);
+    free(bytes);
+    free(pixels);
+    free(blocks);
+    return 0;
+}
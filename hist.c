@@ -0,0 +1,82 @@
+/*
+ * hist.c - Log-bucketed latency histograms
+ *
+ * Bucket i < 2 * HIST_SUB_BUCKETS holds exactly the value i.  Above that,
+ * a value v with its top bit at position b lands in power-of-two range
+ * b - HIST_SUB_BITS, and within it in sub-bucket (v >> shift) - SUB, where
+ * shift = b - HIST_SUB_BITS; the top HIST_SUB_BITS + 1 bits of v pick the
+ * bucket and the bits below are dropped.
+ */
+#include <string.h>
+
+#include "hist.h"
+
+/* Bucket that holds value */
+static int bucket_of(uint64_t value)
+{
+    if (value < 2 * HIST_SUB_BUCKETS)
+        return (int)value;
+    int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return (shift + 1) * HIST_SUB_BUCKETS +
+           (int)((value >> shift) - HIST_SUB_BUCKETS);
+}
+
+/* Largest value that falls in bucket i */
+static uint64_t bucket_top(int i)
+{
+    if (i < 2 * HIST_SUB_BUCKETS)
+        return (uint64_t)i;
+    int shift = i / HIST_SUB_BUCKETS - 1;
+    uint64_t base = (uint64_t)(i % HIST_SUB_BUCKETS + HIST_SUB_BUCKETS);
+    return ((base + 1) << shift) - 1;
+}
+
+void hist_reset(hist_t *h)
+{
+    memset(h, 0, sizeof(*h));
+}
+
+void hist_record(hist_t *h, uint64_t value)
+{
+    h->buckets[bucket_of(value)]++;
+    h->count++;
+    if (value > h->max)
+        h->max = value;
+}
+
+void hist_merge(hist_t *dst, const hist_t *src)
+{
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+    dst->count += src->count;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+uint64_t hist_quantile(const hist_t *h, double q)
+{
+    uint64_t rank, seen = 0;
+    int i;
+
+    if (h->count == 0)
+        return 0;
+
+    /* The rank-th smallest value, counting from 1 */
+    rank = (uint64_t)(q * (double)h->count + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > h->count)
+        rank = h->count;
+
+    for (i = 0; i < HIST_BUCKETS; i++)
+    {
+        seen += h->buckets[i];
+        if (seen >= rank)
+        {
+            uint64_t top = bucket_top(i);
+            return top < h->max ? top : h->max;
+        }
+    }
+    return h->max;
+}
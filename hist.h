@@ -0,0 +1,48 @@
+/**
+ * @file hist.h
+ * @brief Log-bucketed latency histograms
+ *
+ * A hist_t counts values in the manner of an HDR histogram: values below
+ * 2 * HIST_SUB_BUCKETS get a bucket each, and each power-of-two range
+ * above that is split into HIST_SUB_BUCKETS equal buckets.  Every bucket
+ * is therefore narrower than 1/HIST_SUB_BUCKETS of the values it holds,
+ * so any percentile is reported within about 3% at a fixed size of a few
+ * kilobytes, however many values are recorded and however long the tail.
+ */
+
+#ifndef __HIST_H_
+#define __HIST_H_
+
+#include <stdint.h>
+
+/* log2 of the number of buckets per power of two */
+#define HIST_SUB_BITS 5
+#define HIST_SUB_BUCKETS (1 << HIST_SUB_BITS)
+
+/* Enough buckets for any 64-bit value */
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_BUCKETS)
+
+typedef struct
+{
+    uint64_t count;              /* number of values recorded */
+    uint64_t max;                /* largest value recorded */
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+/* Empties a histogram */
+void hist_reset(hist_t *h);
+
+/* Records one value */
+void hist_record(hist_t *h, uint64_t value);
+
+/* Adds the counts of src into dst */
+void hist_merge(hist_t *dst, const hist_t *src);
+
+/*
+ * Returns the value below or at which a fraction q (0 < q <= 1) of the
+ * recorded values lie, rounded up to the top of its bucket and capped at
+ * the maximum.  Returns 0 for an empty histogram.
+ */
+uint64_t hist_quantile(const hist_t *h, double q);
+
+#endif /* __HIST_H_ */
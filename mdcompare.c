@@ -0,0 +1,296 @@
+/*
+ * mdcompare - compare the throughput of two mdriver builds, trace by trace
+ *
+ * usage: mdcompare [-a alpha] [-t percent] base.csv new.csv
+ *
+ * The inputs are timing samples saved by mdriver -B, one line per sample
+ * of some trace.  For every trace in both files, the medians are compared
+ * and a Mann-Whitney U test decides whether the new build differs from
+ * the base: the test looks only at the ranks of the samples, so it does
+ * not assume that timing noise is normal, and a few slow outliers do not
+ * sway it.  Many traces are tested at once, so the p-values are corrected
+ * with the Holm-Bonferroni method, keeping the chance of calling any
+ * difference that is only noise below alpha (default 0.05).
+ *
+ * The test treats the samples as independent, but samples from one run
+ * share its conditions (frequency, other load, heap placement), so a
+ * second run of the same build can differ by more than the test expects.
+ * Changes smaller than a threshold (default 2%) are therefore never
+ * called, and it is best to run each build a few times, alternating, and
+ * concatenate the files of each build; header lines are skipped anywhere.
+ *
+ * Exits with status 1 if some trace got significantly slower, 0 if none
+ * did, and 2 on errors.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAXLINE 1024
+
+/* Fewer samples per side make the normal approximation of U unreliable */
+#define MIN_SAMPLES 8
+
+typedef struct
+{
+    char name[MAXLINE];
+    int n, cap;
+    double *kops;
+} series_t;
+
+typedef struct
+{
+    int num;
+    series_t *series;
+} samples_t;
+
+/* One trace found in both files */
+typedef struct
+{
+    const series_t *base, *next;
+    double p;        /* two-sided p-value of the U test */
+    bool significant; /* after the Holm correction */
+} result_t;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-a alpha] [-t percent] base.csv new.csv\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-a <p>     Significance level (default 0.05).\n");
+    fprintf(stderr, "\t-t <pct>   Smallest change reported (default 2).\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+    {
+        fprintf(stderr, "mdcompare: out of memory\n");
+        exit(2);
+    }
+    return p;
+}
+
+/*
+ * find_series - the series of samples for a trace, added if new
+ */
+static series_t *find_series(samples_t *s, const char *name)
+{
+    int i;
+
+    for (i = 0; i < s->num; i++)
+        if (strcmp(s->series[i].name, name) == 0)
+            return &s->series[i];
+    s->series = xrealloc(s->series, (s->num + 1) * sizeof(series_t));
+    memset(&s->series[s->num], 0, sizeof(series_t));
+    snprintf(s->series[s->num].name, MAXLINE, "%s", name);
+    return &s->series[s->num++];
+}
+
+/*
+ * read_samples - read a file written by mdriver -B
+ */
+static void read_samples(const char *path, samples_t *s)
+{
+    char buf[MAXLINE];
+    FILE *fp;
+    int line = 0;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        perror(path);
+        exit(2);
+    }
+    while (fgets(buf, MAXLINE, fp) != NULL)
+    {
+        char *comma = strrchr(buf, ',');
+        series_t *ser;
+        double val;
+
+        line++;
+        if (strcmp(buf, "trace,kops\n") == 0)
+            continue;
+        if (comma == NULL || sscanf(comma + 1, "%lf", &val) != 1)
+        {
+            fprintf(stderr, "%s:%d: malformed sample\n", path, line);
+            exit(2);
+        }
+        *comma = '\0';
+        ser = find_series(s, buf);
+        if (ser->n == ser->cap)
+        {
+            ser->cap = ser->cap ? 2 * ser->cap : 32;
+            ser->kops = xrealloc(ser->kops, ser->cap * sizeof(double));
+        }
+        ser->kops[ser->n++] = val;
+    }
+    fclose(fp);
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double median(const series_t *ser)
+{
+    double *v = xrealloc(NULL, ser->n * sizeof(double));
+    double m;
+
+    memcpy(v, ser->kops, ser->n * sizeof(double));
+    qsort(v, ser->n, sizeof(double), cmp_double);
+    m = ser->n % 2 ? v[ser->n / 2] : 0.5 * (v[ser->n / 2 - 1] + v[ser->n / 2]);
+    free(v);
+    return m;
+}
+
+/*
+ * mann_whitney - two-sided p-value of the Mann-Whitney U test of a against
+ *     b, from the normal approximation with continuity and tie corrections
+ */
+static double mann_whitney(const series_t *a, const series_t *b)
+{
+    int n = a->n + b->n, i, j;
+    double (*v)[2] = xrealloc(NULL, n * sizeof(*v)); /* value, from a? */
+    double rank_a = 0.0, ties = 0.0, u, mean, var, z;
+
+    for (i = 0; i < a->n; i++)
+        v[i][0] = a->kops[i], v[i][1] = 1.0;
+    for (i = 0; i < b->n; i++)
+        v[a->n + i][0] = b->kops[i], v[a->n + i][1] = 0.0;
+    qsort(v, n, sizeof(*v), cmp_double);
+
+    /* Tied values share the mean of their ranks */
+    for (i = 0; i < n; i = j)
+    {
+        double t, mid;
+        for (j = i + 1; j < n && v[j][0] == v[i][0]; j++)
+            ;
+        t = j - i;
+        mid = 0.5 * (i + 1 + j);
+        for (; i < j; i++)
+            rank_a += v[i][1] * mid;
+        ties += t * t * t - t;
+    }
+    free(v);
+
+    u = rank_a - 0.5 * a->n * (a->n + 1.0);
+    mean = 0.5 * a->n * b->n;
+    var = a->n * (double)b->n / 12.0 * ((n + 1.0) - ties / (n * (n - 1.0)));
+    if (var <= 0.0)
+        return 1.0;
+    z = (fabs(u - mean) - 0.5) / sqrt(var);
+    if (z < 0.0)
+        z = 0.0;
+    return erfc(z / sqrt(2.0));
+}
+
+static int cmp_p(const void *a, const void *b)
+{
+    double x = (*(result_t *const *)a)->p, y = (*(result_t *const *)b)->p;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char **argv)
+{
+    samples_t base = {0, NULL}, next = {0, NULL};
+    result_t *res, **order;
+    double alpha = 0.05;
+    double threshold = 2.0;
+    int c, i, m = 0, slower = 0, faster = 0;
+    bool few = false;
+
+    while ((c = getopt(argc, argv, "a:t:h")) != -1)
+    {
+        switch (c)
+        {
+        case 'a':
+            alpha = atof(optarg);
+            if (alpha <= 0.0 || alpha >= 1.0)
+            {
+                usage(argv[0]);
+                exit(2);
+            }
+            break;
+        case 't':
+            threshold = atof(optarg);
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(2);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argv[0]);
+        exit(2);
+    }
+    read_samples(argv[optind], &base);
+    read_samples(argv[optind + 1], &next);
+
+    res = xrealloc(NULL, (base.num + 1) * sizeof(result_t));
+    order = xrealloc(NULL, (base.num + 1) * sizeof(result_t *));
+    for (i = 0; i < base.num; i++)
+    {
+        int k;
+        for (k = 0; k < next.num; k++)
+            if (strcmp(base.series[i].name, next.series[k].name) == 0)
+                break;
+        if (k == next.num)
+            continue;
+        res[m].base = &base.series[i];
+        res[m].next = &next.series[k];
+        res[m].p = mann_whitney(res[m].base, res[m].next);
+        res[m].significant = false;
+        if (res[m].base->n < MIN_SAMPLES || res[m].next->n < MIN_SAMPLES)
+            few = true;
+        order[m] = &res[m];
+        m++;
+    }
+    if (m == 0)
+    {
+        fprintf(stderr, "mdcompare: no trace appears in both files\n");
+        exit(2);
+    }
+
+    /* Holm: reject in order of p while p_(k) <= alpha / (m - k) */
+    qsort(order, m, sizeof(result_t *), cmp_p);
+    for (i = 0; i < m && order[i]->p <= alpha / (m - i); i++)
+        order[i]->significant = true;
+
+    printf("  %9s %9s %8s %9s  %-8s %s\n", "base", "new", "change", "p",
+           "verdict", "trace");
+    for (i = 0; i < m; i++)
+    {
+        double mb = median(res[i].base), mn = median(res[i].next);
+        const char *verdict = "same";
+        if (res[i].significant &&
+            fabs(100.0 * (mn / mb - 1.0)) >= threshold)
+        {
+            verdict = mn > mb ? "faster" : "slower";
+            if (mn > mb)
+                faster++;
+            else
+                slower++;
+        }
+        printf("  %9.0f %9.0f %+7.2f%% %9.2g  %-8s %s\n", mb, mn,
+               100.0 * (mn / mb - 1.0), res[i].p, verdict,
+               res[i].base->name);
+    }
+    printf("Median Kops/s of each build; %d faster, %d slower, %d "
+           "unchanged at alpha = %g (Holm-corrected over %d traces) and "
+           "a change of at least %g%%.\n",
+           faster, slower, m - faster - slower, alpha, m, threshold);
+    if (few)
+        printf("Warning: some traces have fewer than %d samples; "
+               "p-values are approximate.\n", MIN_SAMPLES);
+    return slower > 0 ? 1 : 0;
+}
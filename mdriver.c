@@ -7,17 +7,23 @@
  * Copyright (c) 2004-2016, R. Bryant and D. O'Hallaron, All rights
  * reserved.  May not be used, modified, or copied without permission.
  */
+#define _GNU_SOURCE /* for sched_setaffinity */
 #include <assert.h>
 #include <errno.h>
 #include <float.h>
 #include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -25,11 +31,18 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#include "btree.h"
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
+#include "heapmap.h"
+#include "hist.h"
 #include "memlib.h"
 #include "mm.h"
-#include "stree.h"
+#include "mscore.h"
+#include "oracle.h"
+#include "perfctr.h"
+#include "trace.h"
 
 /**********************
  * Constants and macros
@@ -69,41 +82,14 @@ typedef enum
  */
 
 /*
- * Records the extent of each block's payload.
- * Organized as doubly linked list
- */
-typedef struct range_t
-{
-    char *lo;   /* low payload address */
-    char *hi;   /* high payload address */
-    int index;  /* same index as free; for debugging */
-    struct range_t *next;
-    struct range_t *prev;
-} range_t;
-
-/*
- * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * All information about the set of ranges (the extent of each block's
+ * payload, see btree.h), in a B+-tree keyed by lo addresses
  */
 typedef struct
 {
-    range_t *list;
-    tree_t *lo_tree;
+    btree_t *tree;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
-typedef struct
-{
-    enum
-    {
-        ALLOC,
-        FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
-} traceop_t;
-
 /* Holds the information for one trace file */
 typedef struct
 {
@@ -113,9 +99,19 @@ typedef struct
     int num_ops;          /* number of distinct requests */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
+    trace_file_t file;    /* holds ops; mapped for binary traces */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
-    size_t *block_rand_base; /* index into random_data, if debug is on */
+    uint64_t *block_seeds; /* seed of each block's fill pattern, if debug */
+
+    /* Multithreaded traces only (num_threads > 1) */
+    int num_threads;         /* number of replay threads */
+    int **thread_ops;        /* op numbers replayed by each thread, in order */
+    int *thread_num_ops;     /* ... and how many there are */
+    int *op_turn;            /* position of each op among the ops on its id */
+    atomic_int *id_turn;     /* number of ops done on each id during replay */
+    double *thread_secs;     /* time each thread took in the last replay */
+    double replay_secs;      /* wall-clock time of the last replay */
 } trace_t;
 
 /*
@@ -144,6 +140,20 @@ typedef struct
 
     /* defined only for the student malloc package */
     double util; /* space utilization for this trace (always 0 for libc) */
+    double secs_huge; /* secs to run the trace on a huge-page heap (-H) */
+    double tput_huge; /* throughput on a huge-page heap in Kops/s (-H) */
+    int threads;         /* replay threads, for multithreaded traces */
+    double *thread_tput; /* throughput of each replay thread in Kops/s */
+    hist_t *latency; /* per-call latency in ticks by op type (-L), or NULL */
+    perf_counts_t perf; /* hardware events over the timed replays (-e) */
+    long perf_runs;     /* ... and the number of replays they cover */
+    int samples;           /* timing samples taken in robust mode (-R) */
+    double *sample_secs;   /* ... each in secs per replay, or NULL */
+    double secs_mad;       /* median absolute deviation of the samples */
+    double secs_lo, secs_hi; /* 95% confidence interval of the median */
+    mm_stats_t heap; /* allocator statistics at the end of the util run */
+    size_t heap_bytes; /* heap size after the util run (-u) */
+    oracle_t oracle;   /* achievable heap sizes for the trace (-u) */
 
     /* Note: secs and util are only defined if valid is true */
 } stats_t;
@@ -158,18 +168,17 @@ typedef struct
 } sum_stats_t;
 
 /********************
- * For debugging.  If debug-mode is on, then we have each block start
- * at a "random" place (a hash of the index), and copy random data
- * into it.  With DBG_CHEAP, we check that the data survived when we
- * realloc and when we free.  With DBG_EXPENSIVE, we check every block
- * every operation.
- * randint_t should be a byte, in case students return unaligned memory.
+ * For debugging.  If debug-mode is on, then we fill the first and the
+ * last maxfill bytes of each block with a pseudo-random pattern.  Byte k
+ * of a block comes from word k / 8 of a generator seeded per block, so
+ * any part of the pattern can be produced on its own, and whole words
+ * are written and compared at a time.  With DBG_CHEAP, we check that the
+ * data survived when we realloc and when we free.  With DBG_EXPENSIVE,
+ * we check every block every operation.
+ * Garbled data is still reported in bytes (randint_t).
  *******************/
-#define RANDOM_DATA_LEN (1 << 16)
-
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
-static randint_t random_data[RANDOM_DATA_LEN];
 
 /********************
  * Global variables
@@ -191,6 +200,24 @@ static bool tab_mode = false; /* Print output as tab-separated fields */
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
+/* If set, also time each trace with the heap backed by 2 MB pages */
+static bool hugepage_mode = false;
+static bool stream_mode = false; /* Stream traces instead of loading them */
+static bool latency_mode = false; /* Time each call into histograms (-L) */
+static int timeline_every = 0; /* Sample the heap every this many ops (-F) */
+static int heapmap_every = 0;  /* Snapshot the blocks every this many (-M) */
+static int jobs = 1; /* Number of worker processes evaluating traces (-j) */
+static bool perf_mode = false; /* Count hardware events while timing (-e) */
+static long speed_runs = 0;    /* Replays done by eval_mm_speed so far */
+static int robust_samples = -1; /* Timing samples per trace (-R), or K-best */
+static const char *samples_file = NULL; /* Where to save them (-B) */
+static const char *persist_file = NULL; /* Reopen a heap kept here (-P) */
+static bool ref_driver_mode = false; /* Benchmark with mdriver-ref (-r) */
+static bool oracle_mode = false; /* Compare utilization to an oracle (-u) */
+static const char *hugepage_backing = NULL;
+
+/* Defined by an mm package that needs no lock around its calls (mm.h) */
+extern const bool mm_thread_safe __attribute__((weak));
 
 #ifdef SPARSE_MODE
 size_t queryGlobalSpaceUsage(void);
@@ -238,13 +265,14 @@ static void remove_range(range_set_t *ranges, char *lo);
 static void free_range_set(range_set_t *ranges);
 
 /* These functions implement the debugging code */
-static void init_random_data(void);
-static bool check_index(const trace_t *trace, int opnum, int index);
+static bool check_index(const trace_t *trace, int opnum, int index,
+                        size_t valid);
 static void randomize_block(trace_t *trace, int index);
 
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void split_trace(trace_t *trace);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
 
@@ -256,10 +284,27 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+#if !REF_ONLY
+static bool eval_mm_persist(trace_t *trace);
+static void eval_mm_timeline(trace_t *trace, int tracenum);
+#endif
 static void eval_mm_speed(void *ptr);
+static void eval_mm_speed_mt(void *ptr);
+static double time_mm_speed(speed_t *speed_params, stats_t *stats);
+static void eval_mm_latency(trace_t *trace, hist_t *latency);
+static void eval_mm_stream(stats_t *stats, const char *tracedir,
+                           const char *filename);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
+static void print_hugepage_results(int n, stats_t *stats);
+static void print_thread_results(int n, stats_t *stats);
+static void print_latency_results(int n, stats_t *stats);
+static void print_mm_stats(int n, stats_t *stats);
+static void print_perf_results(int n, stats_t *stats);
+static void print_robust_results(int n, stats_t *stats);
+static void print_oracle_results(int n, stats_t *stats);
+static void save_samples(int n, stats_t *stats, const char *filename);
 static void usage(char *prog);
 static void malloc_error(const trace_t *trace, int opnum, const char *fmt, ...)
     __attribute__((format(printf, 3, 4)));
@@ -269,6 +314,10 @@ static void app_error(const char *fmt, ...)
     __attribute__((format(printf, 1, 2), noreturn));
 static double compute_scaled_score(double value, double min, double max);
 
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *results,
+                               speed_t *speed_params);
+
 static sigjmp_buf timeout_jmpbuf;
 
 /* Timeout signal handler */
@@ -288,7 +337,7 @@ static double measure_ref_throughput(bool checkpoint);
  * num_tracefiles, if there's a timeout)
  */
 static void run_tests(int num_tracefiles, const char *tracedir,
-                      char **tracefiles, stats_t *mm_stats,
+                      char **tracefiles, stats_t *results,
                       speed_t *speed_params)
 {
     volatile int i;
@@ -298,32 +347,45 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         /* initialize simulated memory system in memlib.c *
          * start each trace with a clean system */
         mem_init(sparse_mode);
+
+        /* Streamed traces get a single combined pass */
+        if (stream_mode)
+        {
+            eval_mm_stream(&results[i], tracedir, tracefiles[i]);
+            mem_deinit();
+            continue;
+        }
+
         range_set_t *ranges = new_range_set();
 
         // NOTE: If times out, then it will reread the trace file
 
         trace_t *trace;
-        trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
-        strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+        trace = read_trace(&results[i], tracedir, tracefiles[i]);
+        strcpy(results[i].filename, trace->filename);
+        results[i].ops = trace->num_ops;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0)
         {
-            mm_stats[i].valid = false;
+            results[i].valid = false;
         }
         else
         {
             if (verbose > 1)
                 printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid =
+            results[i].valid =
                 /* Do 2 tests, since may fail to reinitialize properly */
                 eval_mm_valid(trace, ranges);
 
 			free_range_set(ranges);
 			ranges = new_range_set();
-			mm_stats[i].valid = mm_stats[i].valid &&
+			results[i].valid = results[i].valid &&
 				eval_mm_valid(trace, ranges);
+#if !REF_ONLY
+            if (persist_file != NULL)
+                results[i].valid = results[i].valid && eval_mm_persist(trace);
+#endif
 
             if (onetime_flag)
             {
@@ -332,25 +394,53 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                 return;
             }
         }
-        if (mm_stats[i].valid)
+        if (results[i].valid)
         {
             if (verbose > 1)
                 printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
+            results[i].util = eval_mm_util(trace, i);
+            if (oracle_mode)
+            {
+                results[i].heap_bytes = mem_heapsize();
+                oracle_run(trace->ops, trace->num_ops, trace->num_ids,
+                           &results[i].oracle);
+            }
+#if !REF_ONLY
+            mm_stats(&results[i].heap);
+            if (timeline_every > 0 || heapmap_every > 0)
+                eval_mm_timeline(trace, i);
+#endif
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
-            mm_stats[i].secs =
-                sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
-            mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
+            results[i].secs =
+                sparse_mode ? 1.0 : time_mm_speed(speed_params, &results[i]);
+            results[i].tput = results[i].ops / (results[i].secs * 1000.0);
+
+            /* Replay once more, timing each call on its own */
+            if (latency_mode && !sparse_mode)
+            {
+                results[i].latency = calloc(3, sizeof(hist_t));
+                if (results[i].latency == NULL)
+                    unix_error("calloc failed in run_tests");
+                eval_mm_latency(trace, results[i].latency);
+            }
+
+            /* Time the same trace again with the heap on 2 MB pages */
+            if (hugepage_mode && !sparse_mode)
+            {
+                mem_deinit();
+                mem_set_hugepages(true);
+                mem_init(sparse_mode);
+                hugepage_backing = mem_backing();
+                results[i].secs_huge = time_mm_speed(speed_params, NULL);
+                results[i].tput_huge =
+                    results[i].ops / (results[i].secs_huge * 1000.0);
+                mem_set_hugepages(false);
+            }
         }
 
-#if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
-#endif
         free_trace(trace);
         free_range_set(ranges);
 
@@ -359,6 +449,278 @@ static void run_tests(int num_tracefiles, const char *tracedir,
     }
 }
 
+/*
+ * Parallel evaluation (-j).  mm.c and memlib.c keep their state in globals,
+ * so parallelism comes from processes: worker w runs run_tests on traces
+ * w, w + jobs, ... in a heap of its own, and sends each stats_t back over
+ * a pipe as a result_msg_t, followed by the arrays its pointers refer to.
+ */
+typedef struct
+{
+    int index;               /* trace number */
+    int errors;              /* errors counted while running it */
+    const char *backing;     /* hugepage_backing; static, so valid here */
+    stats_t stats;           /* with pointers to be replaced */
+} result_msg_t;
+
+/*
+ * pick_cpus - list the CPUs that workers are pinned to: isolated CPUs
+ *     first (they see the least interference, which matters for timing),
+ *     then the rest of the CPUs this process may run on.  Returns how
+ *     many were found.
+ */
+static int pick_cpus(int *cpus, int max)
+{
+    cpu_set_t allowed;
+    char buf[MAXLINE];
+    int n = 0, cpu;
+    FILE *fp;
+
+    if ((fp = fopen("/sys/devices/system/cpu/isolated", "r")) != NULL)
+    {
+        if (fgets(buf, sizeof(buf), fp) != NULL)
+        {
+            char *tok = strtok(buf, ",\n");
+            for (; tok != NULL; tok = strtok(NULL, ",\n"))
+            {
+                int lo, hi;
+                if (sscanf(tok, "%d-%d", &lo, &hi) != 2)
+                    hi = lo = atoi(tok);
+                for (cpu = lo; cpu <= hi && n < max; cpu++)
+                    cpus[n++] = cpu;
+            }
+        }
+        fclose(fp);
+    }
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        for (cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++)
+        {
+            int k;
+            for (k = 0; k < n && cpus[k] != cpu; k++)
+                ;
+            if (k == n && CPU_ISSET(cpu, &allowed))
+                cpus[n++] = cpu;
+        }
+    return n;
+}
+
+/* write_all - write len bytes to fd, or exit */
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            unix_error("write failed in run_tests_parallel");
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+/*
+ * run_worker - the body of worker w: run its share of the traces pinned
+ *     to one CPU and send back the results.  Never returns.
+ */
+static void run_worker(int w, int cpu, int fd, int num_tracefiles,
+                       const char *tracedir, char **tracefiles,
+                       stats_t *results, speed_t *speed_params)
+{
+    cpu_set_t set;
+    int i;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        fprintf(stderr, "Warning: could not pin worker %d to CPU %d\n", w,
+                cpu);
+    if (set_timeout > 0)
+        alarm(set_timeout);
+
+    for (i = w; i < num_tracefiles; i += jobs)
+    {
+        result_msg_t msg;
+        int before = errors;
+
+        run_tests(1, tracedir, &tracefiles[i], &results[i], speed_params);
+        msg.index = i;
+        msg.errors = errors - before;
+        msg.backing = hugepage_backing;
+        msg.stats = results[i];
+        write_all(fd, &msg, sizeof(msg));
+        if (msg.stats.thread_tput != NULL)
+            write_all(fd, msg.stats.thread_tput,
+                      msg.stats.threads * sizeof(double));
+        if (msg.stats.latency != NULL)
+            write_all(fd, msg.stats.latency, 3 * sizeof(hist_t));
+        if (msg.stats.sample_secs != NULL)
+            write_all(fd, msg.stats.sample_secs,
+                      msg.stats.samples * sizeof(double));
+    }
+    close(fd);
+    _exit(0);
+}
+
+/*
+ * run_tests_parallel - run_tests spread over jobs worker processes.  The
+ *     workers' pipes are drained as data arrives, so none stalls on a
+ *     full pipe, and the messages are decoded once all are finished.  A
+ *     worker that fails ends the driver, as the error would have done
+ *     without -j.
+ */
+static void run_tests_parallel(int num_tracefiles, const char *tracedir,
+                               char **tracefiles, stats_t *results,
+                               speed_t *speed_params)
+{
+    int ncpus, w, open_fds;
+    int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+    pid_t *pids;
+    struct pollfd *fds;
+    char **bufs;
+    size_t *lens, *caps;
+
+    if (cpus == NULL)
+        unix_error("malloc failed in run_tests_parallel");
+    ncpus = pick_cpus(cpus, CPU_SETSIZE);
+    if (ncpus == 0)
+        cpus[ncpus++] = 0;
+    if (jobs > ncpus)
+    {
+        fprintf(stderr, "Only %d CPUs available; using -j %d\n", ncpus,
+                ncpus);
+        jobs = ncpus;
+    }
+    if (jobs > num_tracefiles)
+        jobs = num_tracefiles;
+
+    pids = calloc(jobs, sizeof(pid_t));
+    fds = calloc(jobs, sizeof(struct pollfd));
+    bufs = calloc(jobs, sizeof(char *));
+    lens = calloc(jobs, sizeof(size_t));
+    caps = calloc(jobs, sizeof(size_t));
+    if (!pids || !fds || !bufs || !lens || !caps)
+        unix_error("calloc failed in run_tests_parallel");
+
+    /* The workers keep their own timeout; this one must not fire here */
+    alarm(0);
+    for (w = 0; w < jobs; w++)
+    {
+        int pipefd[2];
+        if (pipe(pipefd) != 0)
+            unix_error("pipe failed in run_tests_parallel");
+        if ((pids[w] = fork()) < 0)
+            unix_error("fork failed in run_tests_parallel");
+        if (pids[w] == 0)
+        {
+            int k;
+            close(pipefd[0]);
+            for (k = 0; k < w; k++)
+                close(fds[k].fd);
+            run_worker(w, cpus[w], pipefd[1], num_tracefiles, tracedir,
+                       tracefiles, results, speed_params);
+        }
+        close(pipefd[1]);
+        fds[w].fd = pipefd[0];
+        fds[w].events = POLLIN;
+    }
+
+    for (open_fds = jobs; open_fds > 0;)
+    {
+        if (poll(fds, jobs, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll failed in run_tests_parallel");
+        }
+        for (w = 0; w < jobs; w++)
+        {
+            ssize_t n;
+            if (fds[w].fd < 0 || fds[w].revents == 0)
+                continue;
+            if (caps[w] - lens[w] < 65536)
+            {
+                caps[w] = 2 * caps[w] + 65536;
+                if ((bufs[w] = realloc(bufs[w], caps[w])) == NULL)
+                    unix_error("realloc failed in run_tests_parallel");
+            }
+            n = read(fds[w].fd, bufs[w] + lens[w], caps[w] - lens[w]);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                close(fds[w].fd);
+                fds[w].fd = -1;
+                open_fds--;
+                continue;
+            }
+            lens[w] += (size_t)n;
+        }
+    }
+
+    for (w = 0; w < jobs; w++)
+    {
+        int status;
+        size_t off = 0;
+
+        if (waitpid(pids[w], &status, 0) < 0)
+            unix_error("waitpid failed in run_tests_parallel");
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            if (WIFSIGNALED(status))
+                printf("Worker %d was killed by signal %d\n", w,
+                       WTERMSIG(status));
+            exit(1);
+        }
+        while (off + sizeof(result_msg_t) <= lens[w])
+        {
+            result_msg_t msg;
+            stats_t *st;
+
+            memcpy(&msg, bufs[w] + off, sizeof(msg));
+            off += sizeof(msg);
+            st = &results[msg.index];
+            *st = msg.stats;
+            errors += msg.errors;
+            if (msg.backing != NULL)
+                hugepage_backing = msg.backing;
+            if (st->thread_tput != NULL)
+            {
+                size_t len = st->threads * sizeof(double);
+                if ((st->thread_tput = malloc(len)) == NULL)
+                    unix_error("malloc failed in run_tests_parallel");
+                memcpy(st->thread_tput, bufs[w] + off, len);
+                off += len;
+            }
+            if (st->latency != NULL)
+            {
+                if ((st->latency = malloc(3 * sizeof(hist_t))) == NULL)
+                    unix_error("malloc failed in run_tests_parallel");
+                memcpy(st->latency, bufs[w] + off, 3 * sizeof(hist_t));
+                off += 3 * sizeof(hist_t);
+            }
+            if (st->sample_secs != NULL)
+            {
+                size_t len = st->samples * sizeof(double);
+                if ((st->sample_secs = malloc(len)) == NULL)
+                    unix_error("malloc failed in run_tests_parallel");
+                memcpy(st->sample_secs, bufs[w] + off, len);
+                off += len;
+            }
+        }
+        if (off != lens[w])
+            app_error("Worker %d sent a truncated result\n", w);
+        free(bufs[w]);
+    }
+    free(cpus);
+    free(pids);
+    free(fds);
+    free(bufs);
+    free(lens);
+    free(caps);
+}
+
 /**************
  * Main routine
  **************/
@@ -388,7 +750,8 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv,
+                       "d:f:c:s:t:v:hpCOVAlDTHSLeruF:M:j:R:B:P:")) != EOF)
     {
         switch (c)
         {
@@ -449,6 +812,74 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'H':
+            hugepage_mode = true;
+            break;
+
+        case 'S':
+            stream_mode = true;
+            break;
+
+        case 'L':
+            latency_mode = true;
+            break;
+
+        case 'e':
+            perf_mode = true;
+            break;
+
+        case 'R':
+            robust_samples = atoi(optarg);
+            if (robust_samples < 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'B':
+            samples_file = optarg;
+            break;
+
+        case 'P':
+            persist_file = optarg;
+            break;
+
+        case 'r':
+            ref_driver_mode = true;
+            break;
+
+        case 'u':
+            oracle_mode = true;
+            break;
+
+        case 'j':
+            jobs = atoi(optarg);
+            if (jobs <= 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'F':
+            timeline_every = atoi(optarg);
+            if (timeline_every <= 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
+        case 'M':
+            heapmap_every = atoi(optarg);
+            if (heapmap_every <= 0)
+            {
+                usage(argv[0]);
+                exit(1);
+            }
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -458,6 +889,16 @@ int main(int argc, char **argv)
             exit(1);
         }
     }
+    if (samples_file != NULL && robust_samples < 0)
+        robust_samples = 0;
+    if (persist_file != NULL && (sparse_mode || jobs > 1))
+    {
+        fprintf(stderr, "-P needs a dense heap and a single process\n");
+        exit(1);
+    }
+    if (robust_samples >= 0)
+        set_fcyc_samples(robust_samples);
+
 #endif /* !REF_ONLY */
 
     if (num_global_tracefiles == 0)
@@ -472,11 +913,6 @@ int main(int argc, char **argv)
             add_tracefile(default_tracefiles[i]);
     }
 
-    if (debug_mode != DBG_NONE)
-    {
-        init_random_data();
-    }
-
     /* Initialize the timeout */
     if (set_timeout > 0)
     {
@@ -556,8 +992,12 @@ int main(int argc, char **argv)
     if (mm_stats == NULL)
         unix_error("mm_stats calloc in main failed");
 
-    run_tests(num_global_tracefiles, tracedir, global_tracefiles, mm_stats,
-              &speed_params);
+    if (jobs > 1 && !onetime_flag)
+        run_tests_parallel(num_global_tracefiles, tracedir, global_tracefiles,
+                           mm_stats, &speed_params);
+    else
+        run_tests(num_global_tracefiles, tracedir, global_tracefiles,
+                  mm_stats, &speed_params);
 
     /* Display the mm results in a compact table */
     if (verbose)
@@ -582,9 +1022,29 @@ int main(int argc, char **argv)
             printf("\nResults for mm malloc:\n");
             printresults(num_global_tracefiles, mm_stats, &global_mm_sum_stats);
             printf("\n");
+            if (hugepage_mode && !sparse_mode)
+            {
+                print_hugepage_results(num_global_tracefiles, mm_stats);
+                printf("\n");
+            }
+            print_thread_results(num_global_tracefiles, mm_stats);
+            if (latency_mode && !sparse_mode && !stream_mode)
+                print_latency_results(num_global_tracefiles, mm_stats);
+            if (perf_mode && !sparse_mode && !stream_mode)
+                print_perf_results(num_global_tracefiles, mm_stats);
+            if (robust_samples >= 0 && !sparse_mode && !stream_mode)
+                print_robust_results(num_global_tracefiles, mm_stats);
+            if (oracle_mode && !stream_mode)
+                print_oracle_results(num_global_tracefiles, mm_stats);
+            if (verbose > 1 && !stream_mode)
+                print_mm_stats(num_global_tracefiles, mm_stats);
         }
     }
 
+    /* Optionally save the timing samples for mdcompare */
+    if (samples_file != NULL && !onetime_flag)
+        save_samples(num_global_tracefiles, mm_stats, samples_file);
+
     /* Optionally compare the performance of mm and libc */
     if (run_libc)
     {
@@ -768,9 +1228,9 @@ static void add_tracefile(char *trace)
 }
 
 /*****************************************************************
- * The following routines manipulate the range list, which keeps
+ * The following routines manipulate the range set, which keeps
  * track of the extent of every allocated block payload. We use the
- * range list to detect any overlapping allocated blocks.
+ * range set to detect any overlapping allocated blocks.
  ****************************************************************/
 
 /*
@@ -779,8 +1239,9 @@ static void add_tracefile(char *trace)
 static range_set_t *new_range_set()
 {
     range_set_t *ranges = (range_set_t *)malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    if (ranges == NULL)
+        unix_error("malloc error in new_range_set");
+    ranges->tree = btree_new();
     return ranges;
 }
 
@@ -788,7 +1249,7 @@ static range_set_t *new_range_set()
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
  *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     we add the range of this block to the range set.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
                       const trace_t *trace, int opnum, int index)
@@ -820,9 +1281,9 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE)
         return 1;
 
-    /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned)lo);
-    range_t *next = prev ? prev->next : NULL;
+    /* Look in the tree for the blocks on either side */
+    const range_t *prev, *next;
+    btree_neighbors(ranges->tree, lo, &prev, &next);
     /* See if it overlaps previous or next blocks */
     if (prev && lo <= prev->hi)
     {
@@ -839,44 +1300,19 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
         return false;
     }
     /*
-     * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
+     * Everything looks OK, so remember the extent of this block.
      */
-    range_t *p;
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->prev = prev;
-    if (prev)
-        prev->next = p;
-    else
-        ranges->list = p;
-    p->next = next;
-    if (next)
-        next->prev = p;
-    p->lo = lo;
-    p->hi = hi;
-    p->index = index;
-    tree_insert(ranges->lo_tree, (long unsigned)lo, (void *)p);
+    range_t r = {lo, hi, index};
+    btree_insert(ranges->tree, &r);
     return true;
 }
 
 /*
- * remove_range - Free the range record of block whose payload starts at lo
+ * remove_range - Forget the range of the block whose payload starts at lo
  */
 static void remove_range(range_set_t *ranges, char *lo)
 {
-    range_t *p = (range_t *)tree_remove(ranges->lo_tree, (long unsigned)lo);
-    if (!p)
-        return;
-    range_t *prev = p->prev;
-    range_t *next = p->next;
-    if (prev)
-        prev->next = next;
-    else
-        ranges->list = next;
-    if (next)
-        next->prev = prev;
-    free(p);
+    btree_remove(ranges->tree, lo, NULL);
 }
 
 /*
@@ -884,7 +1320,7 @@ static void remove_range(range_set_t *ranges, char *lo)
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    btree_free(ranges->tree);
     free(ranges);
 }
 
@@ -893,50 +1329,124 @@ static void free_range_set(range_set_t *ranges)
  * checking memory access.
  *********************************************/
 
-static void init_random_data(void)
+/*
+ * fill_word - word w of the fill pattern with the given seed: the
+ *     splitmix64 finalizer applied to the seed plus w steps
+ */
+static inline uint64_t fill_word(uint64_t seed, size_t w)
 {
-    int len;
+    uint64_t z = seed + (w + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
 
-    if (debug_mode == DBG_NONE)
-        return;
+/* fill_byte - byte k of the fill pattern (byte k % 8 of word k / 8) */
+static inline randint_t fill_byte(uint64_t seed, size_t k)
+{
+    return (randint_t)(fill_word(seed, k / 8) >> (8 * (k % 8)));
+}
+
+/*
+ * fill_extents - the parts of a block of size bytes that get a pattern:
+ *     [0, *head) and [*tail, size).  Each is at most maxfill bytes; they
+ *     meet when the block is no larger than 2 * maxfill.
+ */
+static void fill_extents(size_t size, size_t *head, size_t *tail)
+{
+    *head = size < maxfill ? size : maxfill;
+    *tail = size - *head < maxfill ? *head : size - maxfill;
+}
+
+/*
+ * fill_range - write the pattern over bytes [lo, hi) of block.  Whole
+ *     words go through mem_write only when the heap is emulated, and are
+ *     stored directly otherwise.  Words are stored little-endian, the
+ *     byte order fill_byte assumes.
+ */
+static void fill_range(unsigned char *block, uint64_t seed, size_t lo,
+                       size_t hi)
+{
+    size_t k = lo;
+
+    for (; k < hi && k % 8 != 0; k++)
+        mem_write(&block[k], fill_byte(seed, k), 1);
+    for (; k + 8 <= hi; k += 8)
+    {
+        uint64_t w = fill_word(seed, k / 8);
+        if (sparse_mode)
+            mem_write(&block[k], w, 8);
+        else
+            memcpy(&block[k], &w, 8);
+    }
+    for (; k < hi; k++)
+        mem_write(&block[k], fill_byte(seed, k), 1);
+}
 
-    for (len = 0; len < RANDOM_DATA_LEN; ++len)
+/*
+ * check_range - compare bytes [lo, hi) of block with the pattern, a word
+ *     at a time, adding the number of wrong bytes to *ngarbled and
+ *     recording the offset of the first in *firstgarbled
+ */
+static void check_range(const unsigned char *block, uint64_t seed, size_t lo,
+                        size_t hi, int *ngarbled, size_t *firstgarbled)
+{
+    size_t k = lo;
+
+    while (k < hi)
     {
-        random_data[len] = random();
+        size_t j, n = 1;
+        uint64_t got, want;
+
+        if (k % 8 == 0 && k + 8 <= hi)
+        {
+            n = 8;
+            want = fill_word(seed, k / 8);
+            if (sparse_mode)
+                got = mem_read(&block[k], 8);
+            else
+                memcpy(&got, &block[k], 8);
+        }
+        else
+        {
+            want = fill_byte(seed, k);
+            got = mem_read(&block[k], 1);
+        }
+        if (got != want)
+            for (j = 0; j < n; j++)
+                if ((uint8_t)(got >> (8 * j)) != (uint8_t)(want >> (8 * j)))
+                {
+                    if (*firstgarbled == (size_t)-1)
+                        *firstgarbled = k + j;
+                    (*ngarbled)++;
+                }
+        k += n;
     }
 }
 
+/*
+ * randomize_block - give block index a fresh seed and fill its head and
+ *     tail with the pattern
+ */
 static void randomize_block(trace_t *traces, int index)
 {
-    size_t size, fsize;
-    size_t i;
-    randint_t *block;
-    size_t base;
+    size_t size, head, tail;
+    unsigned char *block;
+    uint64_t seed;
 
     if (debug_mode == DBG_NONE)
         return;
 
-    traces->block_rand_base[index] = (size_t)random();
+    seed = ((uint64_t)random() << 31) ^ (uint64_t)random();
+    traces->block_seeds[index] = seed;
 
-    block = (randint_t *)traces->blocks[index];
-    size = traces->block_sizes[index] / sizeof(*block);
+    block = (unsigned char *)traces->blocks[index];
+    size = traces->block_sizes[index];
     if (size == 0)
         return;
-    fsize = size;
-    if (fsize > maxfill)
-        fsize = maxfill;
-    base = traces->block_rand_base[index];
-
-    // NOTE: It's expensive to do this one byte at a time.
-
-    // NOTE: It would be nice to also fill in at end of block, but
-    // this gets messy with REALLOC
-
-    for (i = 0; i < fsize; i++)
-    {
-        mem_write(&block[i], random_data[(base + i) % RANDOM_DATA_LEN],
-                  sizeof(randint_t));
-    }
+    fill_extents(size, &head, &tail);
+    fill_range(block, seed, 0, head);
+    fill_range(block, seed, tail, size);
 
 #ifdef USE_MSAN
     /* Mark payload data as uninitialized */
@@ -944,12 +1454,18 @@ static void randomize_block(trace_t *traces, int index)
 #endif
 }
 
-static bool check_index(const trace_t *trace, int opnum, int index)
+/*
+ * check_index - verify the pattern that randomize_block wrote into block
+ *     index, as far as it lies within the first valid bytes.  valid is
+ *     the block size, except after a realloc, where only the bytes that
+ *     both the old and the new block hold must have been copied.
+ */
+static bool check_index(const trace_t *trace, int opnum, int index,
+                        size_t valid)
 {
-    size_t size, fsize;
-    size_t i;
-    randint_t *block;
-    size_t base;
+    size_t size, head, tail;
+    const unsigned char *block;
+    uint64_t seed;
     int ngarbled = 0;
     size_t firstgarbled = (size_t)-1;
 
@@ -958,35 +1474,25 @@ static bool check_index(const trace_t *trace, int opnum, int index)
     if (debug_mode == DBG_NONE)
         return true;
 
-    block = (randint_t *)trace->blocks[index];
-    size = trace->block_sizes[index] / sizeof(*block);
-    if (size == 0)
+    block = (const unsigned char *)trace->blocks[index];
+    size = trace->block_sizes[index];
+    if (size == 0 || valid == 0)
         return true;
-    fsize = size;
-
-    size_t thresh = maxfill;
-    if (fsize > thresh)
-        fsize = thresh;
-
-    base = trace->block_rand_base[index];
+    if (valid > size)
+        valid = size;
+    fill_extents(size, &head, &tail);
+    seed = trace->block_seeds[index];
 
 #ifdef USE_MSAN
     /* Mark memory as initialized so the following won't cause an error */
-    __msan_unpoison(trace->blocks[index], trace->block_sizes[index]);
+    __msan_unpoison(trace->blocks[index], valid);
 #endif
 
-    // NOTE: It's expensive to do this one byte at a time.
     setUBCheck(false);
-    for (i = 0; i < fsize; i++)
-    {
-        if (mem_read(&block[i], sizeof(randint_t)) !=
-            random_data[(base + i) % RANDOM_DATA_LEN])
-        {
-            if (firstgarbled == (size_t)-1)
-                firstgarbled = i;
-            ngarbled++;
-        }
-    }
+    check_range(block, seed, 0, head < valid ? head : valid, &ngarbled,
+                &firstgarbled);
+    if (tail < valid)
+        check_range(block, seed, tail, valid, &ngarbled, &firstgarbled);
     setUBCheck(true);
     if (ngarbled != 0)
     {
@@ -994,8 +1500,7 @@ static bool check_index(const trace_t *trace, int opnum, int index)
                      "block %d (at %p) has %d garbled %s%s, "
                      "starting at byte %zu",
                      index, &block[firstgarbled], ngarbled, randint_t_name,
-                     (ngarbled > 1 ? "s" : ""),
-                     sizeof(randint_t) * firstgarbled);
+                     (ngarbled > 1 ? "s" : ""), firstgarbled);
         return false;
     }
     return true;
@@ -1006,19 +1511,13 @@ static bool check_index(const trace_t *trace, int opnum, int index)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * read_trace - read a trace file and store it in memory.  Binary (.trc)
+ *              traces are mapped rather than parsed; see trace.h.
  */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename)
 {
-    FILE *tracefile;
     trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
-    int ignore = 0;
 
     if (verbose > 1)
         printf("Reading tracefile: %s\n", filename);
@@ -1027,29 +1526,15 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
         unix_error("malloc 1 failed in read_trace");
 
-    /* Read the trace file header */
+    /* Read the header and requests, text or binary */
     strcpy(trace->filename, tracedir);
     strcat(trace->filename, filename);
-    if ((tracefile = fopen(trace->filename, "r")) == NULL)
-    {
-        unix_error("Could not open %s in read_trace", trace->filename);
-    }
-    int iweight;
-    ignore += fscanf(tracefile, "%d", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%d", &trace->num_ids);
-    ignore += fscanf(tracefile, "%d", &trace->num_ops);
-    ignore += fscanf(tracefile, "%zd", &trace->data_bytes);
-
-    if (trace->weight > 3)
-    {
-        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
-    }
-
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
+    trace_load(&trace->file, trace->filename);
+    trace->weight = trace->file.header.weight;
+    trace->num_ids = trace->file.header.num_ids;
+    trace->num_ops = trace->file.header.num_ops;
+    trace->data_bytes = trace->file.header.data_bytes;
+    trace->ops = trace->file.ops;
 
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
@@ -1062,47 +1547,14 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
         unix_error("malloc 4 failed in read_trace");
 
     /* and, if we're debugging, the offset into the random data */
-    if ((trace->block_rand_base =
-             calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
+    if ((trace->block_seeds =
+             calloc(trace->num_ids, sizeof(*trace->block_seeds))) == NULL)
         unix_error("malloc 5 failed in read_trace");
 
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF)
-    {
-        switch (type[0])
-        {
-        case 'a':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = ALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'r':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = REALLOC;
-            trace->ops[op_index].index = index;
-            trace->ops[op_index].size = size;
-            max_index = (index > max_index) ? index : max_index;
-            break;
-        case 'f':
-            ignore += fscanf(tracefile, "%u", &index);
-            trace->ops[op_index].type = FREE;
-            trace->ops[op_index].index = index;
-            break;
-        default:
-            app_error("Bogus type character (%c) in tracefile %s\n", type[0],
-                      trace->filename);
-        }
-        op_index++;
-        if (op_index == trace->num_ops)
-            break;
-    }
-    fclose(tracefile);
-    assert(max_index == trace->num_ids - 1);
-    assert(trace->num_ops == op_index);
+    /* Split a multithreaded trace into per-thread op lists */
+    trace->num_threads = trace->file.tids ? trace->file.header.num_threads : 0;
+    if (trace->num_threads > 1)
+        split_trace(trace);
 
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
@@ -1112,6 +1564,53 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     return trace;
 }
 
+/*
+ * split_trace - prepare a multithreaded trace for replay: give each thread
+ *     the list of its ops, and number the ops on each id in trace order so
+ *     that the replay threads can run them in that order.  The loader has
+ *     checked the ops already, but the indices below are checked again,
+ *     since a bad one would write out of bounds.
+ */
+static void split_trace(trace_t *trace)
+{
+    int i, t;
+    int *id_count;
+    const uint16_t *tids = trace->file.tids;
+
+    trace->thread_ops = calloc(trace->num_threads, sizeof(int *));
+    trace->thread_num_ops = calloc(trace->num_threads, sizeof(int));
+    trace->thread_secs = calloc(trace->num_threads, sizeof(double));
+    trace->op_turn = malloc(trace->num_ops * sizeof(int));
+    trace->id_turn = calloc(trace->num_ids, sizeof(atomic_int));
+    id_count = calloc(trace->num_ids, sizeof(int));
+    if (!trace->thread_ops || !trace->thread_num_ops || !trace->thread_secs ||
+        !trace->op_turn || !trace->id_turn || !id_count)
+        unix_error("malloc failed in split_trace");
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        int index = trace->ops[i].index;
+        if (tids[i] >= trace->num_threads)
+            app_error("%s: request %d: thread %u of %d", trace->filename, i,
+                      tids[i], trace->num_threads);
+        if (index < -1 || index >= trace->num_ids)
+            app_error("%s: request %d: block id %d of %d", trace->filename, i,
+                      index, trace->num_ids);
+        trace->thread_num_ops[tids[i]]++;
+        trace->op_turn[i] = index >= 0 ? id_count[index]++ : -1;
+    }
+    for (t = 0; t < trace->num_threads; t++)
+    {
+        trace->thread_ops[t] = malloc(trace->thread_num_ops[t] * sizeof(int));
+        if (trace->thread_ops[t] == NULL && trace->thread_num_ops[t] > 0)
+            unix_error("malloc failed in split_trace");
+        trace->thread_num_ops[t] = 0;
+    }
+    for (i = 0; i < trace->num_ops; i++)
+        trace->thread_ops[tids[i]][trace->thread_num_ops[tids[i]]++] = i;
+    free(id_count);
+}
+
 /*
  * reinit_trace - get the trace ready for another run.
  */
@@ -1119,19 +1618,30 @@ static void reinit_trace(trace_t *trace)
 {
     memset(trace->blocks, 0, trace->num_ids * sizeof(*trace->blocks));
     memset(trace->block_sizes, 0, trace->num_ids * sizeof(*trace->block_sizes));
-    /* block_rand_base is unused if size is zero */
+    /* block_seeds is unused if size is zero */
 }
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were set up in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
-    free(trace->blocks);
+    trace_unload(&trace->file); /* release the ops... */
+    free(trace->blocks);        /* ... free the three arrays... */
     free(trace->block_sizes);
-    free(trace->block_rand_base);
+    free(trace->block_seeds);
+    if (trace->num_threads > 1)
+    {
+        int t;
+        for (t = 0; t < trace->num_threads; t++)
+            free(trace->thread_ops[t]);
+        free(trace->thread_ops);
+        free(trace->thread_num_ops);
+        free(trace->thread_secs);
+        free(trace->op_turn);
+        free(trace->id_turn);
+    }
     free(trace); /* and the trace record itself... */
 }
 
@@ -1153,7 +1663,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
     char *p;
     bool allCheck = true;
 
-    /* Reset the heap and free any records in the range list */
+    /* Reset the heap and free any records in the range set */
     mem_reset_brk();
     reinit_trace(trace);
 
@@ -1172,7 +1682,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
         if (debug_mode == DBG_EXPENSIVE)
         {
-            range_t *r;
+            const range_t *r;
+            btree_iter_t it;
 
             /* Let the students check their own heap */
             if (!mm_checkheap(0))
@@ -1182,14 +1693,14 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             };
 
             /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r)
+            for (r = btree_first(ranges->tree, &it); r != NULL;
+                 r = btree_next(&it))
             {
-                if (!check_index(trace, i, r->index))
+                if (!check_index(trace, i, r->index,
+                                 trace->block_sizes[r->index]))
                 {
                     allCheck = false;
                 }
-                r = r->next;
             }
         }
 
@@ -1207,7 +1718,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
             /*
              * Test the range of the new block for correctness and add it
-             * to the range list if OK. The block must be  be aligned properly,
+             * to the range set if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
             if (add_range(ranges, p, size, trace, i, index) == 0)
@@ -1222,7 +1733,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             break;
 
         case REALLOC: /* mm_realloc */
-            if (!check_index(trace, i, index))
+            if (!check_index(trace, i, index, trace->block_sizes[index]))
             {
                 allCheck = false;
             }
@@ -1245,10 +1756,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
                 return false;
             }
 
-            /* Remove the old region from the range list */
+            /* Remove the old region from the range set */
             remove_range(ranges, oldp);
 
-            /* Check new block for correctness and add it to range list */
+            /* Check new block for correctness and add it to range set */
             if (size > 0)
             {
                 if (add_range(ranges, newp, size, trace, i, index) == 0)
@@ -1256,16 +1767,10 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             }
 
             /* Move the region from where it was.
-             * Check up to min(size, oldsize) for correct copying. */
+             * Check up to min(size, oldsize) for correct copying, which
+             * covers the tail of the old block when it still fits. */
             trace->blocks[index] = newp;
-            if (size < trace->block_sizes[index])
-            {
-                trace->block_sizes[index] = size;
-            }
-            // NOTE: Might help to pass old size here to check bytes at each end
-            // of allocation
-
-            if (!check_index(trace, i, index))
+            if (!check_index(trace, i, index, size))
             {
                 allCheck = false;
             }
@@ -1276,7 +1781,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             break;
 
         case FREE: /* mm_free */
-            if (!check_index(trace, i, index))
+            if (!check_index(trace, i, index,
+                             index < 0 ? 0 : trace->block_sizes[index]))
             {
                 allCheck = false;
             }
@@ -1409,24 +1915,363 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     return ((double)max_total_size / (double)mem_heapsize());
 }
 
+#if !REF_ONLY
 /*
- * eval_mm_speed - This is the function that is used by fcyc()
- *    to measure the running time of the mm malloc package.
+ * count_alloc - mm_heap_walk visitor that counts the allocated blocks
  */
-static void eval_mm_speed(void *ptr)
+static void count_alloc(const mm_block_info_t *info, void *arg)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
-    trace_t *trace = ((speed_t *)ptr)->trace;
-    reinit_trace(trace);
-
-    /* Reset the heap and initialize the mm package */
-    mem_reset_brk();
-    if (!mm_init())
-        app_error("mm_init failed in eval_mm_speed");
+    if (info->alloc)
+        (*(size_t *)arg)++;
+}
+
+/*
+ * reopen_heap - unmap the persistent heap, map it back in from its file and
+ *    let mm_reattach take it up.  Every block must still be where it was,
+ *    with the pattern randomize_block wrote into it.
+ */
+static bool reopen_heap(trace_t *trace, int opnum)
+{
+    size_t heap_size = mem_heapsize();
+    size_t before = 0, after = 0;
+    bool ok = true;
+    int index;
+
+    mm_heap_walk(count_alloc, &before);
+    mem_deinit();
+    if (!mem_init_persistent(persist_file) || mem_heapsize() != heap_size)
+    {
+        malloc_error(trace, opnum, "heap file %s did not reopen as written.",
+                     persist_file);
+        return false;
+    }
+    if (!mm_reattach())
+    {
+        malloc_error(trace, opnum, "mm_reattach failed.");
+        return false;
+    }
+    if (!mm_checkheap(0))
+    {
+        malloc_error(trace, opnum, "mm_checkheap returned false\n");
+        return false;
+    }
+    mm_heap_walk(count_alloc, &after);
+    if (after != before)
+    {
+        malloc_error(trace, opnum,
+                     "%zu allocated blocks before reopening, %zu after.",
+                     before, after);
+        return false;
+    }
+    for (index = 0; index < trace->num_ids; index++)
+        if (!check_index(trace, opnum, index, trace->block_sizes[index]))
+            ok = false;
+    return ok;
+}
+
+/*
+ * eval_mm_persist - Check that a heap can be reopened from a file (-P).
+ *    The first half of the trace is replayed on a new persistent heap in
+ *    persist_file, which is then closed, reopened and reattached (see
+ *    reopen_heap), and the rest of the trace is replayed on top of it.
+ *    The file is removed again, and the memory system left as mem_init
+ *    leaves it.
+ */
+static bool eval_mm_persist(trace_t *trace)
+{
+    bool ok = true;
+    int i, index;
+    size_t size;
+    char *p;
+
+    reinit_trace(trace);
+    mem_deinit();
+    unlink(persist_file);
+    if (mem_init_persistent(persist_file))
+        app_error("%s: heap file reattached after it was removed",
+                  persist_file);
+    if (!mm_init())
+    {
+        malloc_error(trace, 0, "mm_init failed on a persistent heap.");
+        ok = false;
+    }
+
+    for (i = 0; ok && i < trace->num_ops; i++)
+    {
+        if (i == trace->num_ops / 2 && !reopen_heap(trace, i))
+        {
+            ok = false;
+            break;
+        }
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type)
+        {
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(size)) == NULL)
+            {
+                malloc_error(trace, i, "mm_malloc failed.");
+                ok = false;
+                break;
+            }
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
+        case REALLOC: /* mm_realloc */
+            ok = check_index(trace, i, index, trace->block_sizes[index]);
+            setUBCheck(false);
+            p = mm_realloc(trace->blocks[index], size);
+            setUBCheck(true);
+            if (p == NULL && size != 0)
+            {
+                malloc_error(trace, i, "mm_realloc failed.");
+                ok = false;
+                break;
+            }
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
+        case FREE: /* mm_free */
+            if (index < 0)
+            {
+                mm_free(NULL);
+                break;
+            }
+            ok = check_index(trace, i, index, trace->block_sizes[index]);
+            mm_free(trace->blocks[index]);
+            trace->block_sizes[index] = 0;
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_persist");
+        }
+    }
+
+    mem_deinit();
+    unlink(persist_file);
+    mem_init(sparse_mode);
+    return ok;
+}
+#endif
+
+#if !REF_ONLY
+/*
+ * open_trace_output - Open a file named after a trace, in the current
+ *    directory: ./traces/syn-mix.rep with suffix .x gives syn-mix.x
+ */
+static FILE *open_trace_output(const trace_t *trace, int tracenum,
+                               const char *suffix, const char *mode)
+{
+    char path[MAXLINE];
+    const char *base = strrchr(trace->filename, '/');
+    char *dot;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s", base != NULL ? base + 1
+                                                    : trace->filename);
+    if ((dot = strrchr(path, '.')) != NULL)
+        *dot = '\0';
+    if (strlen(path) + strlen(suffix) >= sizeof(path))
+        app_error("trace %d: output file name too long", tracenum);
+    strcat(path, suffix);
+    if ((fp = fopen(path, mode)) == NULL)
+        unix_error("Could not open %s", path);
+    return fp;
+}
+
+/* Blocks of the heap collected by mm_heap_walk for a heap map */
+typedef struct
+{
+    heapmap_block_t *blocks;
+    size_t n, cap;
+} heapmap_buf_t;
+
+static void collect_block(const mm_block_info_t *info, void *arg)
+{
+    heapmap_buf_t *buf = arg;
+
+    if (buf->n == buf->cap)
+    {
+        buf->cap = buf->cap ? 2 * buf->cap : 4096;
+        buf->blocks = realloc(buf->blocks, buf->cap * sizeof(heapmap_block_t));
+        if (buf->blocks == NULL)
+            unix_error("realloc failed in collect_block");
+    }
+    buf->blocks[buf->n].offset = info->offset;
+    buf->blocks[buf->n].size_bits =
+        HEAPMAP_PACK(info->size, info->alloc, info->size_class);
+    buf->n++;
+}
+
+/*
+ * write_heapmap - Append a snapshot of every block in the heap to a heap
+ *    map file (see heapmap.h)
+ */
+static void write_heapmap(FILE *fp, heapmap_buf_t *buf, int op)
+{
+    heapmap_snap_t snap;
+
+    buf->n = 0;
+    mm_heap_walk(collect_block, buf);
+    snap.op = (uint64_t)op;
+    snap.heap_size = mem_heapsize();
+    snap.num_blocks = buf->n;
+    if (fwrite(&snap, sizeof(snap), 1, fp) != 1 ||
+        fwrite(buf->blocks, sizeof(heapmap_block_t), buf->n, fp) != buf->n)
+        unix_error("Could not write heap map");
+}
+
+/*
+ * eval_mm_timeline - Replay a trace, sampling the heap as it goes.  With
+ *    -F, every timeline_every ops and after the last one, write a line of
+ *    heap statistics to a CSV file named after the trace, in the current
+ *    directory.  Each line gives:
+ *
+ *    live      bytes requested by the live blocks (what util divides)
+ *    heap      mem_heapsize()
+ *    blocks    bytes taken by the live blocks, headers and padding included
+ *    free      bytes in free blocks, with their count and the largest one
+ *    internal  (blocks - live) / blocks: space lost inside allocated blocks
+ *    external  1 - largest / free: how badly the free space is split up
+ *    util      live / heap
+ *
+ *    This uses the mm_block_size and mm_free_summary hooks, so the figures
+ *    are exact for mm.c, but the free-list walk makes small sampling
+ *    intervals slow on traces with many free blocks.
+ *
+ *    With -M, every heapmap_every ops and after the last one, write the
+ *    address, size, state and size class of every block, found with the
+ *    mm_heap_walk hook, to <trace>.heapmap for heapview to draw.
+ */
+static void eval_mm_timeline(trace_t *trace, int tracenum)
+{
+    FILE *fp = NULL, *map = NULL;
+    heapmap_buf_t buf = {NULL, 0, 0};
+    size_t live = 0, blocks = 0;
+    size_t free_bytes, free_count, largest, heap;
+    int i, index;
+    char *p;
+
+    if (timeline_every > 0)
+    {
+        fp = open_trace_output(trace, tracenum, ".timeline.csv", "w");
+        fprintf(fp, "op,live,heap,blocks,free,free_blocks,largest_free,"
+                    "internal,external,util\n");
+    }
+    if (heapmap_every > 0)
+    {
+        heapmap_header_t hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        strcpy(hdr.magic, HEAPMAP_MAGIC);
+        hdr.num_classes = MM_SIZE_CLASSES;
+        map = open_trace_output(trace, tracenum, ".heapmap", "wb");
+        if (fwrite(&hdr, sizeof(hdr), 1, map) != 1)
+            unix_error("Could not write heap map");
+    }
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("trace %d: mm_init failed in eval_mm_timeline", tracenum);
 
-    /* Interpret each trace request */
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = trace->ops[i].index;
+        switch (trace->ops[i].type)
+        {
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(trace->ops[i].size)) == NULL)
+                app_error("trace %d: mm_malloc failed in eval_mm_timeline",
+                          tracenum);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = trace->ops[i].size;
+            live += trace->ops[i].size;
+            blocks += mm_block_size(p);
+            break;
+
+        case REALLOC: /* mm_realloc */
+            p = trace->blocks[index];
+            if (p != NULL)
+            {
+                live -= trace->block_sizes[index];
+                blocks -= mm_block_size(p);
+            }
+            setUBCheck(false);
+            p = mm_realloc(p, trace->ops[i].size);
+            setUBCheck(true);
+            if (p == NULL && trace->ops[i].size != 0)
+                app_error("trace %d: mm_realloc failed in eval_mm_timeline",
+                          tracenum);
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = trace->ops[i].size;
+            if (p != NULL)
+            {
+                live += trace->ops[i].size;
+                blocks += mm_block_size(p);
+            }
+            break;
+
+        case FREE: /* mm_free */
+            p = index < 0 ? NULL : trace->blocks[index];
+            if (p != NULL)
+            {
+                live -= trace->block_sizes[index];
+                blocks -= mm_block_size(p);
+            }
+            mm_free(p);
+            break;
+
+        default:
+            app_error("trace %d: Nonexistent request type in "
+                      "eval_mm_timeline",
+                      tracenum);
+        }
+
+        if (map != NULL &&
+            ((i + 1) % heapmap_every == 0 || i + 1 == trace->num_ops))
+            write_heapmap(map, &buf, i + 1);
+        if (fp == NULL ||
+            ((i + 1) % timeline_every != 0 && i + 1 != trace->num_ops))
+            continue;
+        free_bytes = mm_free_summary(&free_count, &largest);
+        heap = mem_heapsize();
+        fprintf(fp, "%d,%zu,%zu,%zu,%zu,%zu,%zu,%.4f,%.4f,%.4f\n", i + 1,
+                live, heap, blocks, free_bytes, free_count, largest,
+                blocks ? (double)(blocks - live) / blocks : 0.0,
+                free_bytes ? 1.0 - (double)largest / free_bytes : 0.0,
+                heap ? (double)live / heap : 0.0);
+    }
+    if (fp != NULL)
+        fclose(fp);
+    if (map != NULL && fclose(map) != 0)
+        unix_error("Could not write heap map");
+    free(buf.blocks);
+}
+#endif /* !REF_ONLY */
+
+/*
+ * eval_mm_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package.
+ */
+static void eval_mm_speed(void *ptr)
+{
+    int i, index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    reinit_trace(trace);
+    speed_runs++;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_speed");
+
+    /* Interpret each trace request */
     for (i = 0; i < trace->num_ops; i++)
         switch (trace->ops[i].type)
         {
@@ -1468,6 +2313,396 @@ static void eval_mm_speed(void *ptr)
         }
 }
 
+/* Arguments of one replay thread of eval_mm_speed_mt */
+typedef struct
+{
+    trace_t *trace;
+    int thread;
+    pthread_barrier_t *start;
+    pthread_mutex_t *lock;
+} replay_arg_t;
+
+/*
+ * replay_thread - run one thread's ops of a multithreaded trace.  Before
+ *    each op on a block, wait until every earlier op on that block (in
+ *    trace order, from any thread) is done; this is what makes cross-thread
+ *    frees safe.  Unless the mm package says it is thread-safe, each call
+ *    is made under a lock shared by all replay threads; lock is then NULL.
+ */
+static void *replay_thread(void *ptr)
+{
+    replay_arg_t *arg = ptr;
+    trace_t *trace = arg->trace;
+    const int *ops = trace->thread_ops[arg->thread];
+    int n = trace->thread_num_ops[arg->thread];
+    struct timespec t0, t1;
+    int j;
+
+    pthread_barrier_wait(arg->start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (j = 0; j < n; j++)
+    {
+        int i = ops[j];
+        int index = trace->ops[i].index;
+        size_t size = trace->ops[i].size;
+        int turn = trace->op_turn[i];
+        int spins = 0;
+        char *p;
+
+        if (turn >= 0)
+            while (atomic_load_explicit(&trace->id_turn[index],
+                                        memory_order_acquire) != turn)
+                if (++spins % 64 == 0)
+                    sched_yield();
+
+        if (arg->lock != NULL)
+            pthread_mutex_lock(arg->lock);
+        switch (trace->ops[i].type)
+        {
+        case ALLOC: /* mm_malloc */
+            if ((p = mm_malloc(size)) == NULL)
+                app_error("mm_malloc error in eval_mm_speed_mt");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            setUBCheck(false);
+            p = mm_realloc(trace->blocks[index], size);
+            setUBCheck(true);
+            if (p == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_speed_mt");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            mm_free(index < 0 ? NULL : trace->blocks[index]);
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_speed_mt");
+        }
+        if (arg->lock != NULL)
+            pthread_mutex_unlock(arg->lock);
+
+        if (turn >= 0)
+            atomic_store_explicit(&trace->id_turn[index], turn + 1,
+                                  memory_order_release);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    trace->thread_secs[arg->thread] =
+        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    return NULL;
+}
+
+/*
+ * replay_locked - whether the calls of the replay threads must be serialized
+ */
+static bool replay_locked(void)
+{
+    return &mm_thread_safe == NULL || !mm_thread_safe;
+}
+
+/*
+ * eval_mm_speed_mt - The counterpart of eval_mm_speed for multithreaded
+ *    traces: replays each thread's ops on a thread of its own.
+ */
+static void eval_mm_speed_mt(void *ptr)
+{
+    trace_t *trace = ((speed_t *)ptr)->trace;
+    int nthreads = trace->num_threads;
+    pthread_t *threads = malloc(nthreads * sizeof(pthread_t));
+    replay_arg_t *args = malloc(nthreads * sizeof(replay_arg_t));
+    pthread_barrier_t start;
+    pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+    struct timespec t0, t1;
+    int t;
+
+    if (threads == NULL || args == NULL)
+        unix_error("malloc failed in eval_mm_speed_mt");
+    reinit_trace(trace);
+    for (t = 0; t < trace->num_ids; t++)
+        atomic_init(&trace->id_turn[t], 0);
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_speed_mt");
+
+    /* Start all threads at once, and time from then until the last ends */
+    pthread_barrier_init(&start, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++)
+    {
+        args[t] = (replay_arg_t){trace, t, &start,
+                                 replay_locked() ? &lock : NULL};
+        if (pthread_create(&threads[t], NULL, replay_thread, &args[t]) != 0)
+            unix_error("pthread_create failed in eval_mm_speed_mt");
+    }
+    pthread_barrier_wait(&start);
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    for (t = 0; t < nthreads; t++)
+        pthread_join(threads[t], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    pthread_barrier_destroy(&start);
+    trace->replay_secs =
+        (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    free(threads);
+    free(args);
+}
+
+/*
+ * time_mm_speed - Time the mm package on a trace.  fsec measures the CPU
+ *    time of the calling thread, which says nothing about a replay spread
+ *    over several threads, so multithreaded traces are instead replayed
+ *    MT_REPLAY_RUNS times and the best wall-clock time is kept.  If stats
+ *    is not NULL, the per-thread throughputs of that run are stored in it.
+ *    For a single-threaded trace, it gets the hardware events counted over
+ *    all the replays fsec made (-e) and the spread of the samples (-R).
+ */
+static double time_mm_speed(speed_t *speed_params, stats_t *stats)
+{
+    trace_t *trace = speed_params->trace;
+    double best = DBL_MAX;
+    int r, t;
+
+    if (trace->num_threads < 2)
+    {
+        bool counting = perf_mode && stats != NULL && perf_open();
+        if (counting)
+        {
+            speed_runs = 0;
+            perf_start();
+        }
+        best = fsec(eval_mm_speed, speed_params);
+        if (counting)
+        {
+            perf_stop(&stats->perf);
+            stats->perf_runs = speed_runs;
+        }
+        if (robust_samples >= 0 && stats != NULL)
+        {
+            const fcyc_summary_t *sum = fcyc_summary();
+            size_t len = sum->n * sizeof(double);
+            stats->samples = (int)sum->n;
+            stats->secs_mad = sum->mad;
+            stats->secs_lo = sum->ci_lo;
+            stats->secs_hi = sum->ci_hi;
+            if ((stats->sample_secs = malloc(len)) == NULL)
+                unix_error("malloc failed in time_mm_speed");
+            memcpy(stats->sample_secs, sum->samples, len);
+        }
+        return best;
+    }
+
+    if (stats != NULL)
+    {
+        stats->threads = trace->num_threads;
+        stats->thread_tput = calloc(trace->num_threads, sizeof(double));
+        if (stats->thread_tput == NULL)
+            unix_error("calloc failed in time_mm_speed");
+    }
+    for (r = 0; r < MT_REPLAY_RUNS; r++)
+    {
+        eval_mm_speed_mt(speed_params);
+        if (trace->replay_secs >= best)
+            continue;
+        best = trace->replay_secs;
+        if (stats != NULL)
+            for (t = 0; t < trace->num_threads; t++)
+                stats->thread_tput[t] =
+                    trace->thread_num_ops[t] /
+                    (trace->thread_secs[t] * 1000.0);
+    }
+    return best;
+}
+
+/*
+ * eval_mm_latency - Replay a trace once in trace order, timing every call
+ *    with the tick counter and recording it, less the cost of reading the
+ *    counter, in the histogram for its op type.  Multithreaded traces are
+ *    replayed on one thread here, so contention is not part of the figure.
+ */
+static void eval_mm_latency(trace_t *trace, hist_t *latency)
+{
+    unsigned long long overhead = (unsigned long long)ticks_overhead();
+    unsigned long long t0, t1;
+    int i, index;
+    size_t size;
+    char *p;
+
+    reinit_trace(trace);
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_latency");
+
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        index = trace->ops[i].index;
+        size = trace->ops[i].size;
+        switch (trace->ops[i].type)
+        {
+        case ALLOC: /* mm_malloc */
+            t0 = read_ticks();
+            p = mm_malloc(size);
+            t1 = read_ticks();
+            if (p == NULL)
+                app_error("mm_malloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case REALLOC: /* mm_realloc */
+            setUBCheck(false);
+            t0 = read_ticks();
+            p = mm_realloc(trace->blocks[index], size);
+            t1 = read_ticks();
+            setUBCheck(true);
+            if (p == NULL && size != 0)
+                app_error("mm_realloc error in eval_mm_latency");
+            trace->blocks[index] = p;
+            break;
+
+        case FREE: /* mm_free */
+            p = index < 0 ? NULL : trace->blocks[index];
+            t0 = read_ticks();
+            mm_free(p);
+            t1 = read_ticks();
+            break;
+
+        default:
+            app_error("Nonexistent request type in eval_mm_latency");
+        }
+        t1 -= t0;
+        hist_record(&latency[trace->ops[i].type],
+                    t1 > overhead ? t1 - overhead : 0);
+    }
+}
+
+/*
+ * eval_mm_stream - Replay a trace that is streamed from disk rather than
+ *    loaded, measuring utilization and speed in one pass.  Only the time
+ *    spent in the mm package is counted; the reader thread parses the
+ *    next chunk meanwhile.  Correctness checking is limited to the
+ *    alignment and heap bounds of each returned pointer, since the range
+ *    set and payload checks need the whole trace in memory.
+ */
+static void eval_mm_stream(stats_t *stats, const char *tracedir,
+                           const char *filename)
+{
+    char path[MAXLINE];
+    trace_header_t hdr;
+    trace_stream_t *ts;
+    const traceop_t *ops;
+    char **blocks = NULL;
+    size_t *block_sizes = NULL;
+    int num_slots, max_slots = 0;
+    size_t n, i, opnum = 0;
+    size_t total_size = 0, max_total_size = 0;
+    double secs = 0;
+    char *p;
+
+    strcpy(path, tracedir);
+    strcat(path, filename);
+    if (verbose > 1)
+        printf("Streaming tracefile: %s\n", path);
+    ts = trace_stream_open(path, &hdr);
+    strcpy(stats->filename, path);
+    stats->weight = hdr.weight;
+    stats->ops = hdr.num_ops;
+    stats->valid = false;
+
+    if (!mm_init())
+    {
+        printf("ERROR [trace %s]: mm_init failed.\n", path);
+        errors++;
+        trace_stream_close(ts);
+        return;
+    }
+
+    while ((n = trace_stream_next(ts, &ops, &num_slots)) > 0)
+    {
+        /* Slots are only ever added, so grow the block arrays to match */
+        if (num_slots > max_slots)
+        {
+            size_t new_max = 2 * (size_t)num_slots;
+            blocks = realloc(blocks, new_max * sizeof(*blocks));
+            block_sizes = realloc(block_sizes, new_max * sizeof(*block_sizes));
+            if (blocks == NULL || block_sizes == NULL)
+                unix_error("realloc failed in eval_mm_stream");
+            memset(blocks + max_slots, 0,
+                   (new_max - (size_t)max_slots) * sizeof(*blocks));
+            memset(block_sizes + max_slots, 0,
+                   (new_max - (size_t)max_slots) * sizeof(*block_sizes));
+            max_slots = (int)new_max;
+        }
+
+        start_timer();
+        for (i = 0; i < n; i++, opnum++)
+        {
+            int index = ops[i].index;
+            size_t size = ops[i].size;
+
+            switch (ops[i].type)
+            {
+            case ALLOC:
+                p = mm_malloc(size);
+                blocks[index] = p;
+                block_sizes[index] = size;
+                total_size += size;
+                break;
+
+            case REALLOC:
+                setUBCheck(false);
+                p = mm_realloc(blocks[index], size);
+                setUBCheck(true);
+                if (p == NULL && size == 0)
+                    p = (char *)mem_heap_lo(); /* freed, nothing to check */
+                blocks[index] = (size == 0) ? NULL : p;
+                total_size += size - block_sizes[index];
+                block_sizes[index] = size;
+                break;
+
+            case FREE:
+                p = (char *)mem_heap_lo();
+                if (index >= 0)
+                {
+                    mm_free(blocks[index]);
+                    total_size -= block_sizes[index];
+                    blocks[index] = NULL;
+                    block_sizes[index] = 0;
+                }
+                else
+                    mm_free(NULL);
+                break;
+
+            default:
+                app_error("Nonexistent request type in eval_mm_stream");
+            }
+
+            if (p == NULL || !IS_ALIGNED(p) || p < (char *)mem_heap_lo() ||
+                p > (char *)mem_heap_hi())
+            {
+                printf("ERROR [trace %s, op %zu]: bad pointer %p returned.\n",
+                       path, opnum, (void *)p);
+                errors++;
+                free(blocks);
+                free(block_sizes);
+                trace_stream_close(ts);
+                return;
+            }
+            if (total_size > max_total_size)
+                max_total_size = total_size;
+        }
+        secs += get_timer();
+    }
+    trace_stream_close(ts);
+    free(blocks);
+    free(block_sizes);
+
+    stats->valid = true;
+    stats->util = (double)max_total_size / (double)mem_heapsize();
+    stats->secs = sparse_mode ? 1.0 : secs;
+    stats->tput = stats->ops / (stats->secs * 1000.0);
+}
+
 /*
  * eval_libc_valid - We run this function to make sure that the
  *    libc malloc can run to completion on the set of traces.
@@ -1761,6 +2996,364 @@ static void printresults(int n, stats_t *stats, sum_stats_t *sumstats)
     }
 }
 
+/*
+ * print_thread_results - lists the throughput of each replay thread of the
+ *     multithreaded traces, next to the aggregate figure
+ */
+static void print_thread_results(int n, stats_t *stats)
+{
+    int i, t;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid || stats[i].threads < 2)
+            continue;
+        if (!header)
+        {
+            printf("Multithreaded traces (%s):\n",
+                   replay_locked() ? "calls serialized by a lock"
+                                   : "calls not serialized");
+            if (tab_mode)
+                printf("threads\tKops/s\tper-thread Kops/s\ttrace\n");
+            else
+                printf("  %7s %7s  %s\n", "threads", "Kops/s",
+                       "per-thread Kops/s / trace");
+            header = true;
+        }
+        if (tab_mode)
+            printf("%d\t%.0f\t", stats[i].threads, stats[i].tput);
+        else
+            printf("  %7d %7.0f  ", stats[i].threads, stats[i].tput);
+        for (t = 0; t < stats[i].threads; t++)
+            printf("%.0f%c", stats[i].thread_tput[t],
+                   t + 1 < stats[i].threads ? ' ' : '\t');
+        printf("%s\n", stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_latency_row - one line of the latency table, in nanoseconds
+ */
+static void print_latency_row(const char *op, const hist_t *h,
+                              const char *name)
+{
+    double ns = 1e9 / ticks_per_sec();
+    static const double q[] = {0.5, 0.99, 0.999};
+    int k;
+
+    if (tab_mode)
+        printf("%s\t%llu\t", op, (unsigned long long)h->count);
+    else
+        printf("  %-7s %9llu", op, (unsigned long long)h->count);
+    for (k = 0; k < 3; k++)
+        printf(tab_mode ? "%.0f\t" : " %7.0f", hist_quantile(h, q[k]) * ns);
+    printf(tab_mode ? "%.0f\t%s\n" : " %9.0f  %s\n", h->max * ns, name);
+}
+
+/*
+ * print_latency_results - prints the p50, p99, p99.9 and maximum latency
+ *     of each kind of call for each trace (-L), followed by the same
+ *     figures over all valid traces
+ */
+static void print_latency_results(int n, stats_t *stats)
+{
+    static const char *op_names[] = {"malloc", "free", "realloc"};
+    hist_t *total = calloc(3, sizeof(hist_t));
+    int i, t;
+
+    if (total == NULL)
+        unix_error("calloc failed in print_latency_results");
+    printf("Latency in ns (timer overhead of %.0f ticks subtracted):\n",
+           ticks_overhead());
+    if (tab_mode)
+        printf("op\tcalls\tp50\tp99\tp99.9\tmax\ttrace\n");
+    else
+        printf("  %-7s %9s %7s %7s %7s %9s  %s\n", "op", "calls", "p50",
+               "p99", "p99.9", "max", "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid || stats[i].latency == NULL)
+            continue;
+        for (t = 0; t < 3; t++)
+        {
+            if (stats[i].latency[t].count == 0)
+                continue;
+            print_latency_row(op_names[t], &stats[i].latency[t],
+                              stats[i].filename);
+            hist_merge(&total[t], &stats[i].latency[t]);
+        }
+    }
+    for (t = 0; t < 3; t++)
+        if (total[t].count > 0)
+            print_latency_row(op_names[t], &total[t], "(all traces)");
+    printf("\n");
+    free(total);
+}
+
+/*
+ * print_mm_stats - prints the counters reported by mm_stats() at the end
+ *     of the utilization run of each trace (-V): heap growth, splits,
+ *     coalesces, the average number of free blocks examined per fit
+ *     search, and the free blocks left over in each size class.  The
+ *     event counters are shown as "-" unless mm.c was built with MM_STATS.
+ */
+static void print_mm_stats(int n, stats_t *stats)
+{
+    int i, c, e;
+
+    printf("Allocator statistics:\n");
+    if (tab_mode)
+        printf("heapKB\tsbrk\tsplits\tcoalesce\tsearches\tprobes/search\t"
+               "allocated\tfree\tfree by class\ttrace\n");
+    else
+        printf("  %7s %6s %7s %8s %8s %6s %6s %6s  %s\n", "heapKB", "sbrk",
+               "splits", "coalesce", "searches", "probes", "alloc", "free",
+               "free by class / trace");
+    for (i = 0; i < n; i++)
+    {
+        const mm_stats_t *h = &stats[i].heap;
+        double probes = h->fit_searches
+                            ? (double)h->fit_probes / h->fit_searches
+                            : 0.0;
+        char ev[5][24];
+        if (!stats[i].valid)
+            continue;
+        snprintf(ev[0], sizeof(ev[0]), "%llu",
+                 (unsigned long long)h->sbrk_calls);
+        snprintf(ev[1], sizeof(ev[1]), "%llu", (unsigned long long)h->splits);
+        snprintf(ev[2], sizeof(ev[2]), "%llu",
+                 (unsigned long long)h->coalesces);
+        snprintf(ev[3], sizeof(ev[3]), "%llu",
+                 (unsigned long long)h->fit_searches);
+        snprintf(ev[4], sizeof(ev[4]), "%.1f", probes);
+        for (e = 0; e < 5 && !h->events; e++)
+            strcpy(ev[e], "-");
+        if (tab_mode)
+            printf("%zu\t%s\t%s\t%s\t%s\t%s\t%zu\t%zu\t",
+                   h->heap_size / 1024, ev[0], ev[1], ev[2], ev[3], ev[4],
+                   h->alloc_blocks, h->free_blocks);
+        else
+            printf("  %7zu %6s %7s %8s %8s %6s %6zu %6zu  ",
+                   h->heap_size / 1024, ev[0], ev[1], ev[2], ev[3], ev[4],
+                   h->alloc_blocks, h->free_blocks);
+        for (c = 0; c < MM_SIZE_CLASSES; c++)
+            printf("%zu%c", h->class_free_blocks[c],
+                   c + 1 < MM_SIZE_CLASSES ? '/' : (tab_mode ? '\t' : ' '));
+        printf("%s\n", stats[i].filename);
+    }
+    printf("\n");
+}
+
+/*
+ * print_perf_results - prints, next to the throughput of each trace, the
+ *     instructions per cycle and the cycles and misses per operation
+ *     counted by the hardware over its timed replays (-e)
+ */
+static void print_perf_results(int n, stats_t *stats)
+{
+    int i, e;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        const perf_counts_t *pc = &stats[i].perf;
+        double ops = stats[i].ops * stats[i].perf_runs;
+        unsigned both = 1u << PERF_CYCLES | 1u << PERF_INSTRUCTIONS;
+
+        if (!stats[i].valid || pc->valid == 0 || ops == 0)
+            continue;
+        if (!header)
+        {
+            printf("Hardware counters (user mode, per op):\n");
+            printf(tab_mode ? "Kops/s\tIPC\t" : "  %7s %5s", "Kops/s",
+                   "IPC");
+            for (e = 0; e < PERF_NUM_EVENTS; e++)
+                if (e != PERF_INSTRUCTIONS)
+                    printf(tab_mode ? "%s\t" : " %9s", perf_event_name(e));
+            printf(tab_mode ? "trace\n" : "  trace\n");
+            header = true;
+        }
+        printf(tab_mode ? "%.0f\t" : "  %7.0f", stats[i].tput);
+        if ((pc->valid & both) == both && pc->count[PERF_CYCLES] > 0)
+            printf(tab_mode ? "%.2f\t" : " %5.2f",
+                   (double)pc->count[PERF_INSTRUCTIONS] /
+                       pc->count[PERF_CYCLES]);
+        else
+            printf(tab_mode ? "-\t" : " %5s", "-");
+        for (e = 0; e < PERF_NUM_EVENTS; e++)
+        {
+            if (e == PERF_INSTRUCTIONS)
+                continue;
+            if (pc->valid & 1u << e)
+                printf(tab_mode ? "%.3f\t" : " %9.3f", pc->count[e] / ops);
+            else
+                printf(tab_mode ? "-\t" : " %9s", "-");
+        }
+        printf(tab_mode ? "%s\n" : "  %s\n", stats[i].filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_robust_results - prints the spread of the timing samples of each
+ *     trace (-R): the median time per replay, which the throughput is
+ *     based on, its median absolute deviation, and the 95% confidence
+ *     interval of the median
+ */
+static void print_robust_results(int n, stats_t *stats)
+{
+    int i;
+    bool header = false;
+
+    for (i = 0; i < n; i++)
+    {
+        const stats_t *st = &stats[i];
+        if (!st->valid || st->samples == 0)
+            continue;
+        if (!header)
+        {
+            printf("Timing samples (medians; MAD and 95%% CI of the "
+                   "median):\n");
+            if (tab_mode)
+                printf("samples\tKops/s\tmsecs\tMAD%%\tCI lo\tCI hi\t"
+                       "trace\n");
+            else
+                printf("  %7s %7s %8s %6s %17s  %s\n", "samples", "Kops/s",
+                       "msecs", "MAD%", "95% CI msecs", "trace");
+            header = true;
+        }
+        if (tab_mode)
+            printf("%d\t%.0f\t%.3f\t%.2f\t%.3f\t%.3f\t%s\n", st->samples,
+                   st->tput, st->secs * 1e3, 100.0 * st->secs_mad / st->secs,
+                   st->secs_lo * 1e3, st->secs_hi * 1e3, st->filename);
+        else
+            printf("  %7d %7.0f %8.3f %6.2f %8.3f-%-8.3f  %s\n", st->samples,
+                   st->tput, st->secs * 1e3, 100.0 * st->secs_mad / st->secs,
+                   st->secs_lo * 1e3, st->secs_hi * 1e3, st->filename);
+    }
+    if (header)
+        printf("\n");
+}
+
+/*
+ * print_oracle_results - compares the heap of each trace with the heaps
+ *     of the oracle (-u): the compaction bound, which no allocator with
+ *     mm.c's block format can beat, and the clairvoyant best fit.  The
+ *     last column is mm.c's heap as a fraction of the bound, i.e. how much
+ *     of the achievable utilization it reaches.
+ */
+static void print_oracle_results(int n, stats_t *stats)
+{
+    double sum = 0.0;
+    int i, count = 0;
+
+    printf("Utilization against the oracle (heaps in KB):\n");
+    if (tab_mode)
+        printf("heap\tfit\tbound\tutil\tfit util\tmax util\tof max\t"
+               "trace\n");
+    else
+        printf("  %9s %9s %9s %6s %8s %8s %6s  %s\n", "heap", "fit", "bound",
+               "util", "fit util", "max util", "of max", "trace");
+    for (i = 0; i < n; i++)
+    {
+        const stats_t *st = &stats[i];
+        const oracle_t *o = &st->oracle;
+        double peak = (double)o->peak_payload, of_max;
+        if (!st->valid || st->heap_bytes == 0 || o->bound == 0)
+            continue;
+        of_max = (double)o->bound / st->heap_bytes;
+        sum += of_max;
+        count++;
+        printf(tab_mode ? "%.0f\t%.0f\t%.0f\t%.1f\t%.1f\t%.1f\t%.1f\t%s\n"
+                        : "  %9.0f %9.0f %9.0f %5.1f%% %7.1f%% %7.1f%% "
+                          "%5.1f%%  %s\n",
+               st->heap_bytes / 1024.0, o->fit / 1024.0, o->bound / 1024.0,
+               100.0 * st->util, 100.0 * peak / o->fit,
+               100.0 * peak / o->bound, 100.0 * of_max, st->filename);
+    }
+    if (count > 0 && tab_mode)
+        printf("Avg\t\t\t\t\t\t%.1f\n", 100.0 * sum / count);
+    else if (count > 0)
+        printf("  %-55s %5.1f%%\n", "Average", 100.0 * sum / count);
+    printf("\n");
+}
+
+/*
+ * save_samples - writes every timing sample of every valid trace to a CSV
+ *     file, as throughput in Kops/s, for mdcompare (-B)
+ */
+static void save_samples(int n, stats_t *stats, const char *filename)
+{
+    FILE *fp = fopen(filename, "w");
+    int i, k;
+
+    if (fp == NULL)
+        unix_error("Could not open %s", filename);
+    fprintf(fp, "trace,kops\n");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid)
+            continue;
+        for (k = 0; k < stats[i].samples; k++)
+            fprintf(fp, "%s,%.3f\n", stats[i].filename,
+                    stats[i].ops / (stats[i].sample_secs[k] * 1000.0));
+    }
+    if (fclose(fp) != 0)
+        unix_error("Could not write %s", filename);
+}
+
+/*
+ * print_hugepage_results - compares the throughput of each trace on the
+ * normal heap against the same trace on a heap backed by 2 MB pages.
+ */
+static void print_hugepage_results(int n, stats_t *stats)
+{
+    int i;
+    double sum4k = 0.0;
+    double sum2m = 0.0;
+    int count = 0;
+
+    printf("Results with huge-page heap (backing: %s):\n",
+           hugepage_backing ? hugepage_backing : "none");
+    if (tab_mode)
+        printf("Kops/s\tKops/s(2M)\tratio\ttrace\n");
+    else
+        printf("  %7s %10s %6s  %s\n", "Kops/s", "Kops/s(2M)", "ratio",
+               "trace");
+    for (i = 0; i < n; i++)
+    {
+        if (!stats[i].valid || stats[i].tput_huge == 0.0)
+            continue;
+        double ratio = stats[i].tput_huge / stats[i].tput;
+        if (tab_mode)
+            printf("%.0f\t%.0f\t%.3f\t%s\n", stats[i].tput,
+                   stats[i].tput_huge, ratio, stats[i].filename);
+        else
+            printf("  %7.0f %10.0f %6.3f  %s\n", stats[i].tput,
+                   stats[i].tput_huge, ratio, stats[i].filename);
+        if (stats[i].weight == WALL || stats[i].weight == WPERF)
+        {
+            sum4k += 1.0 / stats[i].tput;
+            sum2m += 1.0 / stats[i].tput_huge;
+            count++;
+        }
+    }
+    if (count > 0)
+    {
+        /* Harmonic means, matching the headline throughput figure */
+        double h4k = count / sum4k;
+        double h2m = count / sum2m;
+        if (tab_mode)
+            printf("Avg\t%.0f\t%.0f\t%.3f\n", h4k, h2m, h2m / h4k);
+        else
+            printf("  %7.0f %10.0f %6.3f\n", h4k, h2m, h2m / h4k);
+    }
+}
+
 /*
  * app_error - Report an arbitrary application error
  */
@@ -1963,19 +3556,35 @@ static char *gen_file_name(char *template, char *buf, int maxlen)
 
 /*
  * measure_ref_throughput: Measure throughput achieved by reference
- * implementation
+ * implementation.  CPUs listed in THROUGHPUT_FILE use the figure there.
+ * Otherwise the throughput of the reference machine is scaled by the
+ * machine score, unless -r asks for mdriver-ref to be run instead, as
+ * long as there is one to run.
  */
 static double measure_ref_throughput(bool checkpoint)
 {
     double ltput = lookup_ref_throughput(checkpoint);
     if (ltput > 0)
         return ltput;
+    const char *ref = checkpoint ? REF_DRIVER_CHECKPOINT : REF_DRIVER;
+    if (!ref_driver_mode || access(ref, X_OK) != 0)
+    {
+        double score = machine_score(verbose > 1);
+        double tput =
+            score * (checkpoint ? MSCORE_KOPS_CHECKPOINT : MSCORE_KOPS);
+        if (ref_driver_mode)
+            fprintf(stderr, "Warning: Could not run '%s'; using the machine "
+                            "score\n", ref);
+        if (verbose > 0)
+            printf("Estimated benchmark throughput %.0f from machine score "
+                   "%.3f\n", tput, score);
+        return tput;
+    }
     char buf[MAXLINE];
     char cmd[MAXLINE];
     char *fname = gen_file_name("./tput_%.8x.txt", buf, MAXLINE);
     float t;
-    sprintf(cmd, "%s > %s", checkpoint ? REF_DRIVER_CHECKPOINT : REF_DRIVER,
-            fname);
+    sprintf(cmd, "%s > %s", ref, fname);
     if (verbose > 1)
     {
         printf("Executing '%s'\n", cmd);
@@ -2013,7 +3622,9 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVCdDHLSeru] [-f <file>] [-j <n>] "
+                    "[-F <n>] [-M <n>] [-R <n>] [-B <file>] [-P <file>]\n",
+            prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -2028,4 +3639,25 @@ static void usage(char *prog)
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-H         Also time traces on a huge-page heap.\n");
+    fprintf(stderr, "\t-S         Stream traces in chunks (for huge traces).\n");
+    fprintf(stderr, "\t-L         Report per-call latency percentiles.\n");
+    fprintf(stderr, "\t-e         Report IPC and cache/TLB misses from "
+                    "hardware counters.\n");
+    fprintf(stderr, "\t-R <n>     Time with the median of <n> samples "
+                    "(0: until precise) instead of K-best.\n");
+    fprintf(stderr, "\t-B <file>  Save the timing samples to <file> for "
+                    "mdcompare (implies -R 0).\n");
+    fprintf(stderr, "\t-r         Benchmark unlisted CPUs with mdriver-ref, "
+                    "not the machine score.\n");
+    fprintf(stderr, "\t-u         Compare utilization to what an "
+                    "offline oracle achieves.\n");
+    fprintf(stderr, "\t-j <n>     Evaluate traces in <n> processes, one per "
+                    "core.\n");
+    fprintf(stderr, "\t-F <n>     Write a heap timeline sampled every <n> "
+                    "ops to <trace>.timeline.csv\n");
+    fprintf(stderr, "\t-M <n>     Write a map of the heap every <n> ops to "
+                    "<trace>.heapmap\n");
+    fprintf(stderr, "\t-P <file>  Check that a heap kept in <file> can be "
+                    "reopened.\n");
 }
@@ -4,13 +4,270 @@
  *
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
+ *
+ * Rather than moving the process break with sbrk(), which breaks as soon as
+ * anything else in the process also calls sbrk, the heap lives in a region
+ * of PASSTHROUGH_RESERVE bytes that is reserved PROT_NONE at start-up.  Pages
+ * are committed with mprotect as the break advances and given back to the
+ * kernel when it retreats, so the heap can shrink.  Each region_t is
+ * independent, so several heaps can coexist in one process.
+ *
+ * Compiled with -DPASSTHROUGH_NUMA (for mm-numa.so), there is one region per
+ * NUMA node, each managed by its own copy of mm.c (see mm-numa.h) under its
+ * own lock.  Each region is bound to its node with the raw mbind system
+ * call, so no libnuma is needed.  malloc and calloc go to the copy for the
+ * calling thread's node; free and realloc go to the copy whose region holds
+ * the block, so a block always returns to the node it came from.  A process
+ * with more nodes than copies shares copies between nodes; on a machine
+ * without NUMA, or if mbind fails, pages are placed on first touch.
+ *
+ * Compile with -DPASSTHROUGH_SBRK to get the old sbrk-based behavior.
  */
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "config.h"
 #include "memlib.h"
+#include "mm-numa.h"
+
+#ifndef PASSTHROUGH_SBRK
+
+/* Memory policy from <linux/mempolicy.h>, which libnuma's numaif.h wraps */
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED 1
+#endif
+
+/* Most copies of the allocator the NUMA mode supports */
+#define MAX_NUMA_NODES 64
+
+/* A growable heap carved out of a reserved range of address space */
+typedef struct {
+    unsigned char *base;      /* Start of the reservation (heap start) */
+    unsigned char *brk;       /* Current position of break */
+    unsigned char *committed; /* End of the readable/writable pages */
+    size_t reserved;          /* Bytes of address space reserved */
+} region_t;
+
+/* private global variables */
+#ifndef PASSTHROUGH_NUMA
+static bool init = false;
+static region_t heap_region; /* The heap handed to mm.c */
+#else
+/* The copies of mm.c, one per node, in link order (see mm-numa.h) */
+extern const mm_instance_t __start_mm_numa[], __stop_mm_numa[];
+static pthread_once_t numa_once = PTHREAD_ONCE_INIT;
+static size_t num_nodes;                           /* Copies in use */
+static region_t node_region[MAX_NUMA_NODES];       /* Heap of each copy */
+static pthread_mutex_t node_lock[MAX_NUMA_NODES];  /* Held while in a copy */
+static __thread region_t *cur_region = NULL;       /* Heap of current copy */
+#endif
+
+/*
+ * region_reserve - reserve `size` bytes of address space without committing
+ * any memory.  Returns false if the reservation fails.
+ */
+static bool region_reserve(region_t *r, size_t size) {
+    void *addr = mmap(NULL, size, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED) {
+        return false;
+    }
+    r->base = r->brk = r->committed = addr;
+    r->reserved = size;
+    return true;
+}
+
+/* Round a break position up to the commit granularity */
+static unsigned char *commit_limit(region_t *r, unsigned char *brk) {
+    size_t off = (size_t)(brk - r->base);
+    off = (off + PASSTHROUGH_COMMIT_CHUNK - 1) &
+          ~((size_t)PASSTHROUGH_COMMIT_CHUNK - 1);
+    return r->base + (off < r->reserved ? off : r->reserved);
+}
+
+/*
+ * region_sbrk - move the break of `r` by `incr` bytes, committing or
+ * releasing whole chunks as needed.  Returns the old break, or (void *)-1
+ * with errno set to ENOMEM.
+ */
+static void *region_sbrk(region_t *r, intptr_t incr) {
+    unsigned char *old_brk = r->brk;
+    size_t used = (size_t)(r->brk - r->base);
+
+    if ((incr > 0 && (size_t)incr > r->reserved - used) ||
+        (incr < 0 && (size_t)-incr > used)) {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    unsigned char *new_brk = r->brk + incr;
+    unsigned char *limit = commit_limit(r, new_brk);
+    if (limit > r->committed) {
+        if (mprotect(r->committed, (size_t)(limit - r->committed),
+                     PROT_READ | PROT_WRITE) != 0) {
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        r->committed = limit;
+    } else if (limit < r->committed) {
+        /* Remapping PROT_NONE both revokes access and frees the pages */
+        void *addr = mmap(limit, (size_t)(r->committed - limit), PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                              MAP_FIXED,
+                          -1, 0);
+        assert(addr != MAP_FAILED);
+        r->committed = limit;
+    }
+
+    r->brk = new_brk;
+    return (void *)old_brk;
+}
+
+#ifndef PASSTHROUGH_NUMA
+
+/* The region the memlib calls act on */
+static region_t *current(void) {
+    if (!init) {
+        bool ok = region_reserve(&heap_region, PASSTHROUGH_RESERVE);
+        assert(ok);
+        (void)ok;
+        init = true;
+    }
+    return &heap_region;
+}
+
+#else /* PASSTHROUGH_NUMA */
+
+/* The region the memlib calls act on: that of the copy being run */
+static region_t *current(void) {
+    assert(cur_region != NULL);
+    return cur_region;
+}
+
+/*
+ * region_bind - place all pages of `r` on `node` (MPOL_PREFERRED, so the
+ * kernel still falls back to other nodes when this one is full).  The
+ * policy is set once on the whole reservation and holds for every page
+ * committed later.  Failure (no such node, no NUMA support, seccomp
+ * filters, ...) leaves the default first-touch placement.
+ */
+static void region_bind(region_t *r, size_t node) {
+    unsigned long mask = 1UL << node;
+    syscall(SYS_mbind, r->base, r->reserved, MPOL_PREFERRED, &mask,
+            (unsigned long)MAX_NUMA_NODES + 1, 0);
+}
+
+static void numa_init(void) {
+    num_nodes = (size_t)(__stop_mm_numa - __start_mm_numa);
+    assert(num_nodes > 0 && num_nodes <= MAX_NUMA_NODES);
+    for (size_t node = 0; node < num_nodes; node++) {
+        bool ok = region_reserve(&node_region[node], PASSTHROUGH_RESERVE);
+        assert(ok);
+        (void)ok;
+        region_bind(&node_region[node], node);
+        pthread_mutex_init(&node_lock[node], NULL);
+    }
+}
+
+/* The copy for the calling thread's node */
+static size_t local_node(void) {
+    unsigned cpu, node;
+    pthread_once(&numa_once, numa_init);
+    if (getcpu(&cpu, &node) != 0) {
+        return 0;
+    }
+    return node % num_nodes;
+}
+
+/* The copy whose region holds `ptr`, or num_nodes if none does */
+static size_t owner_node(void *ptr) {
+    unsigned char *p = ptr;
+    pthread_once(&numa_once, numa_init);
+    for (size_t node = 0; node < num_nodes; node++) {
+        region_t *r = &node_region[node];
+        if (p >= r->base && p < r->base + r->reserved) {
+            return node;
+        }
+    }
+    return num_nodes;
+}
+
+/* Lock the copy for `node` and point the memlib calls at its region */
+static const mm_instance_t *enter(size_t node) {
+    pthread_mutex_lock(&node_lock[node]);
+    cur_region = &node_region[node];
+    return &__start_mm_numa[node];
+}
+
+static void leave(size_t node) {
+    cur_region = NULL;
+    pthread_mutex_unlock(&node_lock[node]);
+}
+
+void *malloc(size_t size) {
+    size_t node = local_node();
+    void *ptr = enter(node)->malloc(size);
+    leave(node);
+    return ptr;
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    size_t node = local_node();
+    void *ptr = enter(node)->calloc(nmemb, size);
+    leave(node);
+    return ptr;
+}
+
+void free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t node = owner_node(ptr);
+    assert(node < num_nodes);
+    enter(node)->free(ptr);
+    leave(node);
+}
+
+/* The block stays with its owner, even when the copy moves it */
+void *realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    size_t node = owner_node(ptr);
+    assert(node < num_nodes);
+    ptr = enter(node)->realloc(ptr, size);
+    leave(node);
+    return ptr;
+}
+
+#endif /* PASSTHROUGH_NUMA */
+
+void *mem_sbrk(intptr_t incr) {
+    return region_sbrk(current(), incr);
+}
+
+void *mem_heap_lo(void) {
+    return (void *)current()->base;
+}
+
+void *mem_heap_hi(void) {
+    return (void *)(current()->brk - 1);
+}
+
+size_t mem_heapsize(void) {
+    region_t *r = current();
+    return (size_t)(r->brk - r->base);
+}
+
+#else /* PASSTHROUGH_SBRK */
 
 /* private global variables */
 static bool init = false;
@@ -53,6 +310,14 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+#endif /* PASSTHROUGH_SBRK */
+
+void mem_protect(void *lo, size_t len, bool accessible) {
+    int ok = mprotect(lo, len, accessible ? PROT_READ | PROT_WRITE : PROT_NONE);
+    assert(ok == 0);
+    (void)ok;
+}
+
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
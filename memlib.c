@@ -54,6 +54,11 @@ void markGlobalsUninit(void);
 #include "config.h"
 #include "memlib.h"
 
+/* Older C libraries lack it; mem_init_persistent checks the address anyway */
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0
+#endif
+
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK
 {
@@ -63,6 +68,15 @@ typedef struct MBLK
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* Header page at the start of a persistent heap file */
+typedef struct
+{
+    uint64_t magic;   /* PERSISTENT_HEAP_MAGIC */
+    uint64_t start;   /* Address the heap was mapped at */
+    uint64_t length;  /* Maximum heap size */
+    uint64_t brk_off; /* Offset of the break from the start of the heap */
+} persist_header_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
@@ -74,6 +88,10 @@ static bool show_stats =
     false; /* Should program print allocation information? */
 static bool stats_printed =
     false; /* Has information been printed about allocation */
+static bool use_hugepages = false; /* Back dense heap with 2 MB pages */
+static const char *backing = "4K"; /* Kind of pages behind the heap */
+static persist_header_t *persist = NULL; /* Header of a file-backed heap */
+static bool have_guards = false; /* Has mem_protect revoked any pages */
 
 /* Sparse memory representation */
 static mem_block_t *next_free_page = NULL; /* Next free page */
@@ -114,6 +132,7 @@ static size_t page_id(const void *addr);
 static void *page_start(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static void *map_hugepages(void *start, size_t length);
 
 /*
  * mem_init - initialize the memory system model
@@ -146,14 +165,23 @@ void mem_init(bool do_sparse)
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    int dev_zero = open("/dev/zero", O_RDWR);
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
+    void *addr = MAP_FAILED;
+    backing = sparse ? "sparse" : "4K";
+    if (!sparse && use_hugepages)
+        addr = map_hugepages(start, mmap_length);
+    if (addr == MAP_FAILED)
+    {
+        int dev_zero = open("/dev/zero", O_RDWR);
+        addr = mmap(start,                  /* suggested start*/
+                    mmap_length,            /* length */
+                    PROT_READ | PROT_WRITE, /* permissions */
+                    MAP_PRIVATE,            /* private or shared? */
+                    dev_zero,               /* fd */
+                    0);                     /* offset */
+        if (dev_zero >= 0)
+            close(dev_zero);
+    }
     if (addr == MAP_FAILED)
     {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
@@ -175,19 +203,105 @@ void mem_init(bool do_sparse)
     mem_brk = heap;
 }
 
+/*
+ * mem_init_persistent - map a dense heap from a file at a fixed address,
+ *     reattaching to the heap already in it if there is one
+ */
+bool mem_init_persistent(const char *path)
+{
+    size_t hdr_len = mem_pagesize();
+    size_t file_len = hdr_len + MAX_DENSE_HEAP;
+    unsigned char *start = (unsigned char *)PERSISTENT_HEAP_START - hdr_len;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)file_len) != 0)
+    {
+        fprintf(stderr, "FAILURE.  Couldn't open heap file '%s': %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    void *addr = mmap(start, file_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED || addr != (void *)start)
+    {
+        fprintf(stderr, "FAILURE.  Couldn't map heap file '%s' at %p\n", path,
+                PERSISTENT_HEAP_START);
+        exit(1);
+    }
+
+    sparse = false;
+    next_free_page = NULL;
+    num_pages = 0;
+    page_table = NULL;
+    num_buckets = 0;
+    backing = "file";
+    mmap_length = MAX_DENSE_HEAP;
+    persist = (persist_header_t *)addr;
+    heap = start + hdr_len;
+    mem_max_addr = heap + MAX_DENSE_HEAP;
+    stats_printed = false;
+
+    bool reattach = persist->magic == PERSISTENT_HEAP_MAGIC &&
+                    persist->start == (uint64_t)(uintptr_t)heap &&
+                    persist->length == MAX_DENSE_HEAP &&
+                    persist->brk_off <= MAX_DENSE_HEAP;
+    if (!reattach)
+    {
+        persist->start = (uint64_t)(uintptr_t)heap;
+        persist->length = MAX_DENSE_HEAP;
+        persist->brk_off = 0;
+        persist->magic = PERSISTENT_HEAP_MAGIC;
+    }
+    mem_brk = heap + persist->brk_off;
+    return reattach;
+}
+
+/*
+ * mem_sync - write a persistent heap back to its file
+ */
+void mem_sync(void)
+{
+    if (persist)
+        msync(persist, mem_pagesize() + mem_heapsize(), MS_SYNC);
+}
+
 /*
  * mem_deinit - free the storage used by the memory system model
  */
 void mem_deinit(void)
 {
     print_stats();
-    munmap(heap, mmap_length);
+    if (persist)
+    {
+        mem_sync();
+        munmap(persist, mem_pagesize() + mmap_length);
+        persist = NULL;
+    }
+    else
+        munmap(heap, mmap_length);
     next_free_page = NULL;
     num_free_pages = 0;
     page_table = NULL;
     num_buckets = 0;
 }
 
+/*
+ * mem_set_hugepages - request 2 MB pages for the next dense heap
+ */
+void mem_set_hugepages(bool enable)
+{
+    use_hugepages = enable;
+}
+
+/*
+ * mem_backing - report which kind of pages back the current heap
+ */
+const char *mem_backing(void)
+{
+    return backing;
+}
+
 /*
  * mem_reset_brk - reset the simulated brk pointer to make an empty heap
  */
@@ -217,7 +331,30 @@ void mem_reset_brk()
         __msan_allocated_memory(heap, MAX_DENSE_HEAP);
 #endif
     }
+    if (have_guards)
+    {
+        mprotect(heap, (size_t)(mem_max_addr - heap), PROT_READ | PROT_WRITE);
+        have_guards = false;
+    }
     mem_brk = heap;
+    if (persist)
+        persist->brk_off = 0;
+}
+
+/*
+ * mem_protect - make a page-aligned range of the dense heap accessible or not
+ */
+void mem_protect(void *lo, size_t len, bool accessible)
+{
+    if (sparse || len == 0)
+        return;
+    if (mprotect(lo, len, accessible ? PROT_READ | PROT_WRITE : PROT_NONE) != 0)
+    {
+        perror("mem_protect");
+        exit(1);
+    }
+    if (!accessible)
+        have_guards = true;
 }
 
 /*
@@ -262,6 +399,8 @@ void *mem_sbrk(intptr_t incr)
         __asan_unpoison_memory_region(mem_brk, incr);
 #endif
         mem_brk += incr;
+        if (persist)
+            persist->brk_off = (uint64_t)(mem_brk - heap);
         return (void *)old_brk;
     }
     else
@@ -509,6 +648,43 @@ static void print_stats()
     stats_printed = true;
 }
 
+/*
+ * Map a dense heap with 2 MB pages.  Explicit huge pages come from the
+ * hugetlbfs pool; without MAP_NORESERVE the mmap itself fails when the pool
+ * cannot cover the heap, rather than faulting later.  Transparent huge
+ * pages only need the kernel's THP support, and the madvise is just a hint.
+ * Returns MAP_FAILED if neither works, so the caller can fall back to 4 KB
+ * pages.
+ */
+static void *map_hugepages(void *start, size_t length)
+{
+    void *addr;
+    length = (length + HUGE_PAGE_SIZE - 1) & ~((size_t)HUGE_PAGE_SIZE - 1);
+#ifdef MAP_HUGETLB
+    addr = mmap(start, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (addr != MAP_FAILED)
+    {
+        backing = "hugetlb";
+        return addr;
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    addr = mmap(start, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (addr == MAP_FAILED)
+        return addr;
+    if ((uintptr_t)addr % HUGE_PAGE_SIZE == 0 &&
+        madvise(addr, length, MADV_HUGEPAGE) == 0)
+    {
+        backing = "thp";
+        return addr;
+    }
+    munmap(addr, length);
+#endif
+    return MAP_FAILED;
+}
+
 /* Given an address, compute the ID  of its page */
 static size_t page_id(const void *addr)
 {
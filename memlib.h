@@ -21,11 +21,52 @@ void mem_init(bool sparse);
  */
 void mem_deinit(void);
 
+/**
+ * @brief Initializes a dense heap kept in a file, so that it survives
+ *        process restarts.
+ *
+ * The file holds a one-page header followed by the heap, and is mapped
+ * shared at PERSISTENT_HEAP_START.  If the file already holds a heap, the
+ * heap is reattached with its old break, and mm_reattach() (not mm_init())
+ * picks up the blocks in it.  Otherwise the file is created (or
+ * overwritten) with an empty heap, which mm_init() sets up as usual.
+ *
+ * @param[in] path File that holds the heap
+ * @return True if an existing heap was reattached, false if a new one was
+ *         created.  Exits the program if the file cannot be mapped.
+ */
+bool mem_init_persistent(const char *path);
+
+/**
+ * @brief Flushes a persistent heap to its file.  No-op for other heaps.
+ */
+void mem_sync(void);
+
+/**
+ * @brief Selects whether the next dense mem_init() backs the heap with 2 MB
+ *        pages.
+ *
+ * Explicit huge pages (MAP_HUGETLB) are tried first, then transparent huge
+ * pages (madvise(MADV_HUGEPAGE)).  If neither is available the heap silently
+ * falls back to ordinary pages; use mem_backing() to see what was obtained.
+ * Has no effect in sparse mode.
+ *
+ * @param[in] enable True to request huge pages
+ */
+void mem_set_hugepages(bool enable);
+
+/**
+ * @brief Describes the pages backing the current heap.
+ * @return "4K", "hugetlb", "thp" or "sparse"
+ */
+const char *mem_backing(void);
+
 /**
  * @brief Extends the heap by incr bytes.
  *
  * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * with this implementation, the heap cannot be shrunk.  (The passthrough
+ * build used for mm.so does accept a negative `incr`.)
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
@@ -67,6 +108,19 @@ size_t mem_heapsize(void);
  */
 size_t mem_pagesize(void);
 
+/**
+ * @brief Changes whether a page-aligned range of the heap can be accessed.
+ *
+ * Used by the guarded debug heap to place PROT_NONE pages next to payloads.
+ * Dense heaps only; a no-op for sparse emulation.  mem_reset_brk() makes the
+ * whole heap accessible again.
+ *
+ * @param[in] lo         Page-aligned start of the range
+ * @param[in] len        Length of the range, in bytes
+ * @param[in] accessible True for read/write, false for no access
+ */
+void mem_protect(void *lo, size_t len, bool accessible);
+
 /* Functions used for memory emulation */
 
 /**
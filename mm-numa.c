@@ -0,0 +1,15 @@
+/**
+ * @file mm-numa.c
+ * @brief Entry table of one copy of the allocator in mm-numa.so
+ *
+ * Linked with mm.c into a single object whose symbols are then all made
+ * local (see the mm-numa.so rule in the Makefile), so that the copies of
+ * mm.c in the library keep separate heaps and this table is their only way
+ * in.
+ */
+
+#include "mm-numa.h"
+#include "mm.h"
+
+__attribute__((section(MM_NUMA_SECTION), used))
+const mm_instance_t mm_instance = {malloc, free, realloc, calloc};
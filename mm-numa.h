@@ -0,0 +1,28 @@
+/**
+ * @file mm-numa.h
+ * @brief Entry points of one copy of the allocator in mm-numa.so
+ *
+ * mm-numa.so links one copy of mm.c per NUMA node, each managing its own
+ * heap region.  A copy exports nothing but an mm_instance_t (see mm-numa.c);
+ * the linker gathers those of all copies, in link order, into the mm_numa
+ * section, where memlib-passthrough.c finds them as the array running from
+ * __start_mm_numa to __stop_mm_numa.
+ */
+
+#ifndef __MM_NUMA_H_
+#define __MM_NUMA_H_
+
+#include <stddef.h>
+
+/* Section holding the entry points of every copy */
+#define MM_NUMA_SECTION "mm_numa"
+
+/* The malloc interface of one copy of mm.c */
+typedef struct {
+    void *(*malloc)(size_t size);
+    void (*free)(void *ptr);
+    void *(*realloc)(void *ptr, size_t size);
+    void *(*calloc)(size_t nmemb, size_t size);
+} mm_instance_t;
+
+#endif /* __MM_NUMA_H_ */
@@ -21,6 +21,10 @@
  * GitHub ID: AichenYao
  */
 
+#ifdef HEAP_CANARY
+#define _GNU_SOURCE // SCHED_IDLE and process_vm_readv
+#endif
+
 #include <assert.h>
 #include <inttypes.h>
 #include <stdbool.h>
@@ -30,6 +34,16 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifdef HEAP_CANARY
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#endif
+
 #include "memlib.h"
 #include "mm.h"
 
@@ -64,6 +78,10 @@
 #define dbg_assert(expr) assert(expr)
 #define dbg_ensures(expr) assert(expr)
 #define dbg_printheap(...) print_heap(__VA_ARGS__)
+#define dbg_mark_block(block) mark_dirty(block, false)
+#define dbg_mark_node(block) mark_dirty(block, true)
+#define dbg_unmark_block(block) unmark_dirty(block, false)
+#define dbg_unmark_node(block) unmark_dirty(block, true)
 #else
 /* When DEBUG is not defined, no code gets generated for these */
 /* The sizeof() hack is used to avoid "unused variable" warnings */
@@ -72,6 +90,10 @@
 #define dbg_assert(expr) (sizeof(expr), 1)
 #define dbg_ensures(expr) (sizeof(expr), 1)
 #define dbg_printheap(...) ((void)sizeof(__VA_ARGS__))
+#define dbg_mark_block(block) ((void)sizeof(block))
+#define dbg_mark_node(block) ((void)sizeof(block))
+#define dbg_unmark_block(block) ((void)sizeof(block))
+#define dbg_unmark_node(block) ((void)sizeof(block))
 #endif
 
 /* Basic constants */
@@ -157,6 +179,145 @@ static block_t *root7 = NULL; //[1024,2048)
 static block_t *root8 = NULL; //[2048,+inf)
 /** @brief Pointer to first block in the heap */
 static block_t *heap_start = NULL;
+#ifdef MM_STATS
+/**
+ * @brief Statistics reported by mm_stats, kept up to date as the heap
+ * changes in builds with -DMM_STATS (see mdriver-stats). They are static,
+ * not in the heap, so that they cost no utilization; other builds, which
+ * include the emulated one and its 128-byte limit on global data, leave
+ * them out and walk the heap when asked.
+ */
+static mm_stats_t heap_stats;
+#endif
+
+#ifdef DEBUG
+/*
+ * Incremental heap checking, in debug builds only.
+ *
+ * A full check walks every block and every seg list, and it runs before
+ * and after every call and inside the list helpers, so on its own it
+ * makes a debug run quadratic in the size of the heap.  Instead, every
+ * block whose header or footer is written, and every free block whose
+ * list links change, is logged as dirty, and a check looks only at those:
+ * the header and footer of each dirty block, and the links on both sides
+ * of each dirty list node.  Blocks that are merged into a neighbour or
+ * taken off their list are dropped from the log again, so that it only
+ * names blocks that still exist.  Whenever the log fills up, and after as
+ * many checks as the last full check walked blocks (but at least
+ * full_check_every), the whole heap is checked as before, so the full
+ * checks cost about one block per check however large the heap grows.
+ *
+ * The log lives at the very bottom of the heap, below the prologue; a debug
+ * build therefore lays out the heap differently from a normal one, and a
+ * persistent heap must be opened by the same kind.
+ */
+#define DIRTY_MAX 64
+
+typedef struct {
+    size_t num_blocks;          // blocks whose header or footer changed
+    size_t num_nodes;           // free blocks whose list links changed
+    bool overflow;              // too many changes: do a full check next
+    size_t checks;              // incremental checks since the last full one
+    size_t swept;               // blocks walked by the last full check
+    block_t *blocks[DIRTY_MAX];
+    block_t *nodes[DIRTY_MAX];
+} dirty_log_t;
+
+static const size_t full_check_every = 1024;
+
+/** @brief The log of changes since the last check */
+static dirty_log_t *dirty_log = NULL;
+
+static void mark_dirty(block_t *block, bool node);
+static void unmark_dirty(block_t *block, bool node);
+#endif
+
+#ifdef GUARD_HEAP
+/*
+ * Guarded debug heap, compiled in with -DGUARD_HEAP (see mdriver-guard).
+ *
+ * Every allocated block keeps the requested size in its last word, which is
+ * free because allocated blocks have no footer, and the slack between the
+ * end of the payload and that word is filled with canary bytes.  Requests of
+ * at least GUARD_THRESHOLD bytes get a span whose payload ends (up to
+ * alignment) flush against a PROT_NONE guard page.  Freed blocks sit in a
+ * FIFO quarantine of GUARD_QUARANTINE entries before they really become
+ * free: the first GUARD_POISON bytes of small ones are poisoned and the
+ * poison is verified on release, large ones have their payload pages
+ * revoked so stray accesses fault.  Poisoning whole payloads made the guard
+ * heap several times slower on traces of kilobyte arrays, and a write
+ * through a dangling pointer usually lands in the first fields anyway.
+ *
+ * mprotect is kept off the per-call path.  A guard page stays revoked for
+ * the life of its span: a released span waits, still revoked, in a cache
+ * of GUARD_SPANS spans for the next large request that fits, and only a
+ * span evicted from the cache goes back to the free lists.  Payload pages
+ * are revoked for the whole quarantine at once when the FIFO turns over,
+ * so a freed large block can stay accessible for up to GUARD_QUARANTINE - 1
+ * further frees.
+ */
+#ifndef GUARD_THRESHOLD
+#define GUARD_THRESHOLD 16384
+#endif
+#ifndef GUARD_QUARANTINE
+#define GUARD_QUARANTINE 64
+#endif
+#ifndef GUARD_SPANS
+#define GUARD_SPANS 64
+#endif
+#ifndef GUARD_POISON
+#define GUARD_POISON 64
+#endif
+
+/** @brief Header bit marking a block that ends in a guard page */
+static const word_t guard_mask = 0x4;
+static const unsigned char canary_byte = 0xCB;
+static const word_t canary_word = 0xCBCBCBCBCBCBCBCB;
+static const word_t poison_word = 0xDFDFDFDFDFDFDFDF;
+
+/** @brief Recently freed blocks, still marked allocated */
+static block_t *quarantine[GUARD_QUARANTINE];
+static size_t quarantine_next = 0;
+
+/** @brief Released guarded blocks, still marked allocated and revoked */
+static block_t *guard_spans[GUARD_SPANS];
+static size_t guard_spans_next = 0;
+
+#endif
+
+#ifdef HEAP_CANARY
+#ifdef GUARD_HEAP
+#error "HEAP_CANARY cannot be combined with GUARD_HEAP"
+#endif
+/*
+ * Background heap checker, compiled in with -DHEAP_CANARY (see
+ * mdriver-canary).
+ *
+ * A low-priority thread wakes every CANARY_PERIOD_MS milliseconds, copies
+ * the heap and the seg-list roots, and checks the copy for what
+ * mm_checkheap checks in the heap: block sizes, footers that match their
+ * headers, and lists whose links agree in both directions and hold every
+ * free block, once, in its own size class.  The copy only counts if no call
+ * changed the heap while it was taken: malloc, free and mm_init make
+ * canary_seq odd while they run and even again before they return, and the
+ * checker reads it before and after copying (a sequence lock).  It retries
+ * up to CANARY_RETRIES times and otherwise waits for the next period, so
+ * the foreground never waits and pays two stores a call.  The heap is
+ * copied with process_vm_readv, which fails rather than faults if the heap
+ * is unmapped meanwhile.  A violation is reported with the blocks around it
+ * and then the process aborts, leaving the heap in the core.
+ */
+#ifndef CANARY_PERIOD_MS
+#define CANARY_PERIOD_MS 100
+#endif
+#ifndef CANARY_RETRIES
+#define CANARY_RETRIES 16
+#endif
+
+/** @brief Odd while malloc, free or mm_init is changing the heap */
+static atomic_ulong canary_seq = 0;
+static pthread_once_t canary_once = PTHREAD_ONCE_INIT;
+#endif
 
 /*
  *****************************************************************************
@@ -389,6 +550,8 @@ static void write_block(block_t *block, size_t size, bool alloc) {
     dbg_requires(size > 0);
     block->header = pack(size, alloc);
     write_next_block(block, alloc);
+    dbg_mark_block(block);
+    dbg_mark_block(find_next(block));
     if (alloc == false) {
         // only add a footer if this block becomes free
         word_t *footerp = header_to_footer(block);
@@ -623,13 +786,46 @@ block_t **indexToAddress(size_t index) {
     return &root8;
 }
 
+//param[in] class: seg list index - 1; size: block size; sign: 1 if the
+//block joins that list, -1 if it leaves it
+//Counts the change in MM_STATS builds; a no-op otherwise
+static void count_free(size_t class, size_t size, int sign) {
+#ifdef MM_STATS
+    heap_stats.free_bytes += (size_t)sign * size;
+    heap_stats.free_blocks += (size_t)sign;
+    heap_stats.class_free_bytes[class] += (size_t)sign * size;
+    heap_stats.class_free_blocks[class] += (size_t)sign;
+#endif
+}
+
+//param[in] size: block size; sign: 1 if the block is allocated, -1 if it
+//is released
+//Counts the change in MM_STATS builds; a no-op otherwise
+static void count_alloc(size_t size, int sign) {
+#ifdef MM_STATS
+    heap_stats.alloc_bytes += (size_t)sign * size;
+    heap_stats.alloc_blocks += (size_t)sign;
+#endif
+}
+
+//param[in] field: offsetof(mm_stats_t, x) for one of the event counters x
+//Adds n to it in MM_STATS builds; a no-op otherwise
+static void count_event(size_t field, uint64_t n) {
+#ifdef MM_STATS
+    *(uint64_t *)((char *)&heap_stats + field) += n;
+#endif
+}
+
 //param[in] a block to be removed from one of the free lists
 //find the root that it belongs to, remove it from that list
 void remove_from_list(block_t *block) {
     dbg_requires(mm_checkheap(__LINE__));
     // a block has to be allocated to be removed from the free list
     block_t **rootAddress = find_list(get_size(block));
+    size_t class = addressToIndex(rootAddress) - 1;
+    count_free(class, get_size(block), -1);
     dbg_assert(*rootAddress != NULL);
+    dbg_unmark_node(block);
     if (block == *rootAddress) {
         //if the block is the root
         if ((*rootAddress)->next == NULL) {
@@ -641,11 +837,13 @@ void remove_from_list(block_t *block) {
         //the prev of the root should always point to NULL
         *rootAddress = (*rootAddress)->next;
         (*rootAddress)->prev = NULL;
+        dbg_mark_node(*rootAddress);
         return;
     }
     block_t *prevBlock = block->prev;
     dbg_assert(prevBlock != NULL);
     block_t *nextBlock = block->next;
+    dbg_mark_node(prevBlock);
     if (nextBlock == NULL) {
         //if the block was at the end of a seg list
         prevBlock->next = NULL;
@@ -655,6 +853,7 @@ void remove_from_list(block_t *block) {
     //if the block has a non-NULL prev and next block
     prevBlock->next = nextBlock;
     nextBlock->prev = prevBlock;
+    dbg_mark_node(nextBlock);
     return;
 }
 
@@ -667,6 +866,9 @@ void add_to_list(block_t *block) {
         return;
     }
     block_t **rootAddress = find_list(get_size(block));
+    size_t class = addressToIndex(rootAddress) - 1;
+    count_free(class, get_size(block), 1);
+    dbg_mark_node(block);
     if (*rootAddress == NULL) {
         // the seg list was originally empty
         *rootAddress = block;
@@ -683,6 +885,7 @@ void add_to_list(block_t *block) {
     block->next = oldBlock;
     block->prev = NULL;
     oldBlock->prev = block;
+    dbg_mark_node(oldBlock);
     dbg_assert(*rootAddress != NULL);
     dbg_assert(((*rootAddress)->prev) == NULL);
     return;
@@ -699,6 +902,7 @@ static void split_block(block_t *block, size_t asize) {
     if ((block_size - asize) >= min_block_size) {
         block_t *block_next;
         write_block(block, asize, true);
+        count_event(offsetof(mm_stats_t, splits), 1);
         //if it could be split, then there are two blocks now, write both
         block_next = find_next(block);
         write_block(block_next, block_size - asize, false);
@@ -745,24 +949,31 @@ static block_t *coalesce_block(block_t *block) {
         return block;
     } else if (prev_alloc && !next_alloc) {
         // next block is free, write to the current block
+        count_event(offsetof(mm_stats_t, coalesces), 1);
         remove_from_list(nextBlock);
         write_block(block, current_size + next_size, false);
+        dbg_unmark_block(nextBlock);
         //combine their size, write to block since that is the start of this
         //"large new block"
         add_to_list(block);
         return block;
     } else if (!prev_alloc && next_alloc) {
         // prev block is free, write to the previous block
+        count_event(offsetof(mm_stats_t, coalesces), 1);
         remove_from_list(prevBlock);
         write_block(prevBlock, current_size + prev_size, false);
+        dbg_unmark_block(block);
         add_to_list(prevBlock);
         return prevBlock;
     } else {
         //when both prevBlock and nextBlock are free
         dbg_assert((!prev_alloc) && (!next_alloc));
+        count_event(offsetof(mm_stats_t, coalesces), 2);
         remove_from_list(prevBlock);
         remove_from_list(nextBlock);
         write_block(prevBlock, current_size + prev_size + next_size, false);
+        dbg_unmark_block(block);
+        dbg_unmark_block(nextBlock);
         add_to_list(prevBlock);
         return prevBlock;
     }
@@ -784,6 +995,7 @@ static block_t *extend_heap(size_t size) {
     if ((bp = mem_sbrk(size)) == (void *)-1) {
         return NULL;
     }
+    count_event(offsetof(mm_stats_t, sbrk_calls), 1);
     // Initialize free block header/footer
     block_t *block = payload_to_header(bp);
     write_block(block, size, false);
@@ -794,6 +1006,344 @@ static block_t *extend_heap(size_t size) {
     return block;
 }
 
+/**
+ * @brief
+ * @param[in] block that is no longer in use
+ * mark it free and merge it with its free neighbours
+ */
+static void release_block(block_t *block) {
+    count_alloc(get_size(block), -1);
+    write_block(block, get_size(block), false);
+    coalesce_block(block);
+}
+
+#ifdef GUARD_HEAP
+/**
+ * @brief Finds the word at the end of an allocated block that holds the
+ *        size originally requested for it.
+ */
+static word_t *request_word(block_t *block) {
+    return (word_t *)((char *)block + get_size(block) - wsize);
+}
+
+/**
+ * @brief Returns the first byte after the payload area that the canary
+ *        bytes may use: the guard page for guarded blocks, otherwise the
+ *        request word.
+ */
+static char *slack_end(block_t *block) {
+    if (block->header & guard_mask) {
+        return (char *)request_word(block) - mem_pagesize();
+    }
+    return (char *)request_word(block);
+}
+
+/**
+ * @brief Reports heap corruption detected in `block` and aborts.
+ */
+static void guard_abort(block_t *block, const char *what) {
+    fprintf(stderr, "mm: %s in block %p (payload %p, block size %zu)\n", what,
+            (void *)block, header_to_payload(block), get_size(block));
+    abort();
+}
+
+/**
+ * @brief Records the requested size of a newly allocated block and fills
+ *        the slack after the payload with canary bytes, a byte at a time
+ *        up to the first word boundary and a word at a time after it.
+ */
+static void set_request(block_t *block, size_t size) {
+    unsigned char *p = (unsigned char *)header_to_payload(block) + size;
+    word_t *end = (word_t *)slack_end(block);
+    *request_word(block) = size;
+    for (; (word_t *)p < end && (size_t)p % wsize != 0; p++) {
+        *p = canary_byte;
+    }
+    for (word_t *w = (word_t *)p; w < end; w++) {
+        *w = canary_word;
+    }
+}
+
+/**
+ * @brief Verifies the request word and canary bytes of a block being freed.
+ */
+static void check_request(block_t *block) {
+    unsigned char *payload = header_to_payload(block);
+    word_t *end = (word_t *)slack_end(block);
+    size_t size = *request_word(block);
+    if (size > (size_t)((unsigned char *)end - payload)) {
+        guard_abort(block, "request size overwritten");
+    }
+    unsigned char *p = payload + size;
+    for (; (word_t *)p < end && (size_t)p % wsize != 0; p++) {
+        if (*p != canary_byte) {
+            guard_abort(block, "canary overwritten (overflow or double free)");
+        }
+    }
+    for (word_t *w = (word_t *)p; w < end; w++) {
+        if (*w != canary_word) {
+            guard_abort(block, "canary overwritten (overflow or double free)");
+        }
+    }
+}
+
+/**
+ * @brief Returns the end of the poisoned part of a small freed block.
+ */
+static word_t *poison_end(block_t *block) {
+    word_t *end = (word_t *)header_to_payload(block) + GUARD_POISON / wsize;
+    return (end < request_word(block)) ? end : request_word(block);
+}
+
+/**
+ * @brief Returns the start of the payload pages of a guarded block: the
+ *        whole pages between the payload and the guard page, which are
+ *        revoked while the block is free.
+ */
+static char *revocable(block_t *block) {
+    char *lo = (char *)round_up((size_t)header_to_payload(block),
+                                mem_pagesize());
+    char *guard = slack_end(block);
+    return (lo < guard) ? lo : guard;
+}
+
+/**
+ * @brief Finds where the guard page of a guarded block would go inside a
+ *        free block:
+ *
+ *   | gap (free) | hdr | payload | canary | guard page | size | tail (free) |
+ *
+ * That is the first page boundary that leaves a gap and a tail that are
+ * each either empty or at least min_block_size.
+ *
+ * @param[in] free_block A block on one of the seg lists
+ * @param[in] span Payload size, rounded up to dsize
+ * @return The guard page, or NULL if free_block is too small
+ */
+static char *guard_spot(block_t *free_block, size_t span) {
+    size_t page = mem_pagesize();
+    char *lo = (char *)free_block;
+    char *hi = lo + get_size(free_block);
+    char *guard = (char *)round_up((size_t)lo + wsize + span, page);
+    for (; guard + page + wsize <= hi; guard += page) {
+        size_t gap = (size_t)(guard - span - wsize - lo);
+        size_t tail = (size_t)(hi - (guard + page + wsize));
+        if ((gap == 0 || gap >= min_block_size) &&
+            (tail == 0 || tail >= min_block_size)) {
+            return guard;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Carves a guarded block out of a free block at the spot that
+ *        guard_spot found, and revokes its guard page; the gap and the
+ *        tail stay free.
+ */
+static block_t *guarded_carve(block_t *free_block, size_t span, char *guard) {
+    char *lo = (char *)free_block;
+    char *hi = lo + get_size(free_block);
+    block_t *block = (block_t *)(guard - span - wsize);
+    block_t *tail_block = (block_t *)(guard + mem_pagesize() + wsize);
+    size_t gap = (size_t)((char *)block - lo);
+    size_t tail = (size_t)(hi - (char *)tail_block);
+    remove_from_list(free_block);
+    if (gap != 0) {
+        write_block(free_block, gap, false);
+        add_to_list(free_block);
+    }
+    write_block(block, (size_t)((char *)tail_block - (char *)block), true);
+    block->header |= guard_mask;
+    count_alloc(get_size(block), 1);
+    if (tail != 0) {
+        write_block(tail_block, tail, false);
+        add_to_list(tail_block);
+    }
+    mem_protect(guard, mem_pagesize(), false);
+    return block;
+}
+
+/**
+ * @brief Takes a span out of the cache for a request of `span` bytes,
+ *        giving its payload pages back.  The block moves up so the new
+ *        payload ends at the guard page; what it leaves in front is freed.
+ */
+static block_t *span_take(size_t slot, size_t span) {
+    block_t *old = guard_spans[slot];
+    char *guard = slack_end(old);
+    block_t *block = (block_t *)(guard - span - wsize);
+    guard_spans[slot] = NULL;
+    mem_protect(revocable(old), (size_t)(guard - revocable(old)), true);
+    if (block != old) {
+        size_t total = get_size(old);
+        size_t gap = (size_t)((char *)block - (char *)old);
+        count_alloc(total, -1);
+        write_block(old, gap, false);
+        write_block(block, total - gap, true);
+        block->header |= guard_mask;
+        count_alloc(total - gap, 1);
+        coalesce_block(old);
+    }
+    return block;
+}
+
+/**
+ * @brief Gives a cached span back to the heap: its pages, guard page
+ *        included, become accessible and it is freed like any block.
+ */
+static void span_release(block_t *block) {
+    char *lo = revocable(block);
+    mem_protect(lo, (size_t)(slack_end(block) + mem_pagesize() - lo), true);
+    release_block(block);
+}
+
+/**
+ * @brief Allocates a block whose payload ends flush against a guard page.
+ *
+ * A span from the cache is used if one fits with less than a page to
+ * spare, taking the one that leaves the least in front of the block; its
+ * guard page is still revoked, so only the payload pages cost an
+ * mprotect.  Larger spans are kept for larger requests.  Otherwise the
+ * block is carved from the first free block with room for it and a guard
+ * page (see guard_spot), or from new space at the end of the heap, and a
+ * new guard page is revoked.  The payload ends at most dsize - 1 bytes
+ * before the page boundary.
+ *
+ * @param[in] size Requested payload size
+ * @return The new block, or NULL if the heap cannot grow
+ */
+static block_t *guarded_malloc(size_t size) {
+    size_t page = mem_pagesize();
+    size_t span = round_up(size, dsize);
+    size_t best = GUARD_SPANS;
+    size_t best_gap = 0;
+    for (size_t slot = 0; slot < GUARD_SPANS; slot++) {
+        block_t *cached = guard_spans[slot];
+        if (cached == NULL) {
+            continue;
+        }
+        char *lo = (char *)cached + span + wsize;
+        char *guard = slack_end(cached);
+        if (lo > guard) {
+            continue;
+        }
+        size_t gap = (size_t)(guard - lo);
+        if ((gap == 0 || gap >= min_block_size) && gap < page &&
+            (best == GUARD_SPANS || gap < best_gap)) {
+            best = slot;
+            best_gap = gap;
+        }
+    }
+    if (best != GUARD_SPANS) {
+        block_t *block = span_take(best, span);
+        set_request(block, size);
+        return block;
+    }
+
+    for (size_t index = addressToIndex(find_list(span + page + dsize));
+         index <= 8; index++) {
+        for (block_t *free_block = *indexToAddress(index); free_block != NULL;
+             free_block = free_block->next) {
+            char *guard = guard_spot(free_block, span);
+            if (guard != NULL) {
+                block_t *block = guarded_carve(free_block, span, guard);
+                set_request(block, size);
+                return block;
+            }
+        }
+    }
+
+    // Room for the block, a gap and a tail in any page alignment
+    size_t need = span + 2 * page + 2 * min_block_size + dsize;
+    block_t *free_block = extend_heap(max(need, chunksize));
+    if (free_block == NULL) {
+        return NULL;
+    }
+    block_t *block =
+        guarded_carve(free_block, span, guard_spot(free_block, span));
+    set_request(block, size);
+    return block;
+}
+
+/**
+ * @brief Really frees a block leaving the quarantine, after checking that
+ *        nothing wrote to it while it sat there.  A guarded block goes to
+ *        the span cache instead, evicting the oldest span there.
+ */
+static void quarantine_release(block_t *block) {
+    if (block->header & guard_mask) {
+        block_t *evicted = guard_spans[guard_spans_next];
+        guard_spans[guard_spans_next] = block;
+        guard_spans_next = (guard_spans_next + 1) % GUARD_SPANS;
+        if (evicted != NULL) {
+            span_release(evicted);
+        }
+        return;
+    }
+    word_t *end = poison_end(block);
+    for (word_t *w = header_to_payload(block); w < end; w++) {
+        if (*w != poison_word) {
+            guard_abort(block, "write after free");
+        }
+    }
+    release_block(block);
+}
+
+/**
+ * @brief Revokes the payload pages of the guarded blocks in the
+ *        quarantine.  Done each time the FIFO turns over, when every
+ *        entry was freed since the last turnover, rather than on each free.
+ */
+static void quarantine_revoke(void) {
+    for (size_t i = 0; i < GUARD_QUARANTINE; i++) {
+        block_t *block = quarantine[i];
+        if (block != NULL && (block->header & guard_mask)) {
+            char *lo = revocable(block);
+            mem_protect(lo, (size_t)(slack_end(block) - lo), false);
+        }
+    }
+}
+
+/**
+ * @brief Puts a freed block into the quarantine, evicting the oldest entry.
+ *        Small blocks are poisoned now; guarded ones are revoked with the
+ *        rest of the quarantine when the FIFO turns over.
+ */
+static void quarantine_push(block_t *block) {
+    if (!(block->header & guard_mask)) {
+        word_t *end = poison_end(block);
+        for (word_t *w = header_to_payload(block); w < end; w++) {
+            *w = poison_word;
+        }
+    }
+    block_t *victim = quarantine[quarantine_next];
+    quarantine[quarantine_next] = block;
+    quarantine_next = (quarantine_next + 1) % GUARD_QUARANTINE;
+    if (victim != NULL) {
+        quarantine_release(victim);
+    }
+    if (quarantine_next == 0) {
+        quarantine_revoke();
+    }
+}
+
+/**
+ * @brief Empties the quarantine and the span cache without touching the
+ *        heap, for mm_init.
+ */
+static void quarantine_reset(void) {
+    for (size_t i = 0; i < GUARD_QUARANTINE; i++) {
+        quarantine[i] = NULL;
+    }
+    quarantine_next = 0;
+    for (size_t i = 0; i < GUARD_SPANS; i++) {
+        guard_spans[i] = NULL;
+    }
+    guard_spans_next = 0;
+}
+#endif
+
 
 //param[in] asize: size being requested, the address of a root: the list to
 //search from
@@ -805,6 +1355,7 @@ static block_t *find_fit_helper(size_t asize, block_t **rootAddress) {
     block_t *bestBlock = NULL;
     size_t count = 0;
     for (block = *rootAddress; block != NULL; block = block->next) {
+        count_event(offsetof(mm_stats_t, fit_probes), 1);
         if ((asize <= get_size(block)) && (bestBlock == NULL)) {
             bestBlock = block;
         }
@@ -828,6 +1379,7 @@ static block_t *find_fit(size_t asize) {
     block_t **rootAddress = find_list(asize);
     size_t startIndex = addressToIndex(rootAddress);
     block_t *fitBlock;
+    count_event(offsetof(mm_stats_t, fit_searches), 1);
     for (size_t index = startIndex; index <= 8; index++) {
         //start from the list this size should belongs to. If not found,
         //search from the list with the next larger bucket size
@@ -872,21 +1424,100 @@ bool checkList(block_t **rootAddress) {
     return true;
 }
 
-bool mm_checkheap(int line) {
+//param[in] a block, or the epilogue
+//check that it lies in the heap and, if free, that its footer matches its
+//header; the checks that the full walk makes of every block
+static bool check_block(block_t *block) {
+    dbg_assert((void *)block > mem_heap_lo());
+    dbg_assert((void *)block < mem_heap_hi());
+    if (get_size(block) == 0) {
+        // only the epilogue has size 0
+        dbg_assert((char *)block == (char *)mem_heap_hi() - 7);
+        return true;
+    }
+    if (get_alloc(block) == false) {
+        // if the block has a footer, make sure the footer and header
+        // matches
+        word_t *footer = header_to_footer(block);
+        dbg_assert(extract_alloc(block->header) == extract_alloc(*footer));
+        dbg_assert(extract_size(block->header) == extract_size(*footer));
+        dbg_assert(extract_prev_alloc(block->header) ==
+                   extract_prev_alloc(*footer));
+    }
+    return true;
+}
+
+#ifdef DEBUG
+//param[in] a block, and whether its list links (rather than its header or
+//footer) changed
+//log it as dirty, unless it already is; if the log is full, the next check
+//will be a full one
+static void mark_dirty(block_t *block, bool node) {
+    if (dirty_log == NULL || dirty_log->overflow) {
+        return;
+    }
+    block_t **set = node ? dirty_log->nodes : dirty_log->blocks;
+    size_t *n = node ? &dirty_log->num_nodes : &dirty_log->num_blocks;
+    for (size_t i = 0; i < *n; i++) {
+        if (set[i] == block) {
+            return;
+        }
+    }
+    if (*n == DIRTY_MAX) {
+        dirty_log->overflow = true;
+        return;
+    }
+    set[(*n)++] = block;
+}
+
+//param[in] a block that no longer exists (merged into its neighbour), or no
+//longer has list links (taken off its list), and which of the two
+//drop it from the log
+static void unmark_dirty(block_t *block, bool node) {
+    if (dirty_log == NULL) {
+        return;
+    }
+    block_t **set = node ? dirty_log->nodes : dirty_log->blocks;
+    size_t *n = node ? &dirty_log->num_nodes : &dirty_log->num_blocks;
+    for (size_t i = 0; i < *n; i++) {
+        if (set[i] == block) {
+            set[i] = set[--(*n)];
+            return;
+        }
+    }
+}
+
+//param[in] a block on a seg list
+//check that its neighbours on the list point back at it, and that it is the
+//root of its list if it has no predecessor
+static bool check_node(block_t *block) {
+    if (block->prev == NULL) {
+        dbg_assert(*find_list(get_size(block)) == block);
+    } else {
+        dbg_assert(block->prev->next == block);
+    }
+    if (block->next != NULL) {
+        dbg_assert(block->next->prev == block);
+    }
+    return true;
+}
+#endif
+
+//param[in] line: where the check was called from, for debugging
+//check the whole heap: every block in address order and every seg list
+static bool check_full(int line) {
     block_t *block = NULL;
+    size_t blocks = 0;
     for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
-        dbg_assert((void *)block > mem_heap_lo());
-        dbg_assert((void *)block < mem_heap_hi());
-        if (get_alloc(block) == false) {
-            // if the block has a footer, make sure the footer and header
-            // matches
-            word_t *footer = header_to_footer(block);
-            dbg_assert(extract_alloc(block->header) == extract_alloc(*footer));
-            dbg_assert(extract_size(block->header) == extract_size(*footer));
-            dbg_assert(extract_prev_alloc(block->header) ==
-                       extract_prev_alloc(*footer));
-        }
+        check_block(block);
+        blocks++;
+    }
+#ifdef DEBUG
+    if (dirty_log != NULL) {
+        memset(dirty_log, 0, sizeof(dirty_log_t));
+        dirty_log->swept = blocks;
     }
+#endif
     checkList(&root1);
     checkList(&root2);
     checkList(&root3);
@@ -898,6 +1529,466 @@ bool mm_checkheap(int line) {
     return true;
 }
 
+bool mm_checkheap(int line) {
+#ifdef DEBUG
+    if (dirty_log != NULL && !dirty_log->overflow &&
+        (++dirty_log->checks < full_check_every ||
+         dirty_log->checks < dirty_log->swept)) {
+        // only what changed since the last check
+        for (size_t i = 0; i < dirty_log->num_blocks; i++) {
+            check_block(dirty_log->blocks[i]);
+        }
+        for (size_t i = 0; i < dirty_log->num_nodes; i++) {
+            check_node(dirty_log->nodes[i]);
+        }
+        dirty_log->num_blocks = 0;
+        dirty_log->num_nodes = 0;
+        return true;
+    }
+#endif
+    return check_full(line);
+}
+
+//@return the space reserved for the dirty log at the bottom of the heap;
+//none unless this is a debug build, and otherwise a multiple of dsize, so
+//the blocks above stay aligned
+static size_t log_span(void) {
+#ifdef DEBUG
+    return round_up(sizeof(dirty_log_t), dsize);
+#else
+    return 0;
+#endif
+}
+
+//param[out] stats: a copy of the counters of an MM_STATS build; other
+//builds count the blocks by walking the heap, and report no events
+void mm_stats(mm_stats_t *stats) {
+#ifdef MM_STATS
+    *stats = heap_stats;
+    stats->events = true;
+#else
+    memset(stats, 0, sizeof(mm_stats_t));
+    for (block_t *block = heap_start; block != NULL && get_size(block) > 0;
+         block = find_next(block)) {
+        size_t size = get_size(block);
+        if (get_alloc(block)) {
+            stats->alloc_bytes += size;
+            stats->alloc_blocks += 1;
+        } else {
+            size_t class = addressToIndex(find_list(size)) - 1;
+            stats->free_bytes += size;
+            stats->free_blocks += 1;
+            stats->class_free_bytes[class] += size;
+            stats->class_free_blocks[class] += 1;
+        }
+    }
+#endif
+    stats->heap_size = mem_heapsize();
+}
+
+//param[in] ptr: payload of an allocated block
+//@return the size of the whole block, header included; what the request
+//actually costs in the heap
+size_t mm_block_size(void *ptr) {
+    return get_size(payload_to_header(ptr));
+}
+
+//param[out] count, largest: the number of free blocks and the largest size
+//@return the total size of the free blocks, found by walking every seg list
+size_t mm_free_summary(size_t *count, size_t *largest) {
+    size_t total = 0;
+    *count = 0;
+    *largest = 0;
+    for (size_t index = 1; index <= 8; index++) {
+        for (block_t *block = *indexToAddress(index); block != NULL;
+             block = block->next) {
+            size_t size = get_size(block);
+            total += size;
+            *count += 1;
+            if (size > *largest) {
+                *largest = size;
+            }
+        }
+    }
+    return total;
+}
+
+//param[in] visit, arg: visit(info, arg) is called for each block of the
+//heap in turn, from heap_start up to the epilogue
+void mm_heap_walk(void (*visit)(const mm_block_info_t *info, void *arg),
+                  void *arg) {
+    if (heap_start == NULL) {
+        return;
+    }
+    for (block_t *block = heap_start; get_size(block) > 0;
+         block = find_next(block)) {
+        mm_block_info_t info;
+        info.offset = (size_t)((char *)block - (char *)mem_heap_lo());
+        info.size = get_size(block);
+        info.alloc = get_alloc(block);
+        info.size_class = (int)addressToIndex(find_list(info.size)) - 1;
+        visit(&info, arg);
+    }
+}
+
+//Marks the start of a change to the heap, for the checker of HEAP_CANARY
+//builds; a no-op otherwise
+//@return whether this call entered; false if it is nested in one that did
+static bool canary_enter(void) {
+#ifdef HEAP_CANARY
+    unsigned long seq = atomic_load_explicit(&canary_seq, memory_order_relaxed);
+    if ((seq & 1) != 0) {
+        return false; // e.g. mm_init called from malloc
+    }
+    atomic_store_explicit(&canary_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    return true;
+#else
+    return false;
+#endif
+}
+
+//param[in] entered: what canary_enter returned
+//Marks the end of a change to the heap
+static void canary_exit(bool entered) {
+#ifdef HEAP_CANARY
+    if (entered) {
+        unsigned long seq =
+            atomic_load_explicit(&canary_seq, memory_order_relaxed);
+        atomic_store_explicit(&canary_seq, seq + 1, memory_order_release);
+    }
+#endif
+}
+
+#ifdef HEAP_CANARY
+/** @brief A copy of the heap taken by the checker */
+typedef struct {
+    char *buf;              // the copy, followed by the bitmap
+    size_t cap;             // bytes mapped at buf
+    unsigned char *bitmap;  // one bit per dsize: free headers not yet listed
+    char *lo;               // where the heap lies
+    size_t size;            // bytes in the heap
+    block_t *start;         // heap_start
+    block_t *roots[9];      // root1..root8 at 1..8, as in indexToAddress
+    size_t free_blocks;     // free blocks found by the walk
+} canary_snap_t;
+
+//param[in] snap: the copy; addr: a heap address that should be a header
+//@return the header in the copy, or NULL if no header can lie at addr
+static block_t *snap_block(canary_snap_t *snap, block_t *addr) {
+    uintptr_t off = (uintptr_t)addr - (uintptr_t)snap->lo;
+    if ((uintptr_t)addr < (uintptr_t)snap->lo || off % dsize != wsize ||
+        off + wsize > snap->size) {
+        return NULL;
+    }
+    return (block_t *)(snap->buf + off);
+}
+
+//@return the heap address of a block of the copy
+static block_t *heap_block(canary_snap_t *snap, block_t *block) {
+    return (block_t *)(snap->lo + ((char *)block - snap->buf));
+}
+
+//@return whether a block of the copy has a size that keeps it, and the
+//header after it, inside the heap
+static bool snap_sane(canary_snap_t *snap, block_t *block) {
+    size_t size = get_size(block);
+    char *end = snap->buf + snap->size;
+    return size >= min_block_size && size % dsize == 0 &&
+           size <= (size_t)(end - wsize - (char *)block);
+}
+
+//param[in] mark: printed in front of the block
+//print a block of the copy, with its footer and links if it is free
+static void canary_print(canary_snap_t *snap, block_t *block,
+                         const char *mark) {
+    fprintf(stderr, "%s %p: header %#" PRIx64 ", size %zu, %s", mark,
+            (void *)heap_block(snap, block), block->header, get_size(block),
+            get_alloc(block) ? "allocated" : "free");
+    if (!get_alloc(block) && snap_sane(snap, block)) {
+        fprintf(stderr, ", footer %#" PRIx64 ", prev %p, next %p",
+                *header_to_footer(block), (void *)block->prev,
+                (void *)block->next);
+    }
+    fprintf(stderr, "\n");
+}
+
+//param[in] block: the block of the copy at fault, or NULL if there is none
+//report a violation with the blocks around it, and abort
+static void canary_abort(canary_snap_t *snap, block_t *block,
+                         const char *what) {
+    block_t *before[2] = {NULL, NULL};
+    fprintf(stderr, "mm canary: %s (heap %p, %zu bytes)\n", what,
+            (void *)snap->lo, snap->size);
+    if (block != NULL) {
+        // the blocks before it, as far as the walk from the start gets
+        block_t *prev = snap_block(snap, snap->start);
+        while (prev != NULL && prev < block && snap_sane(snap, prev)) {
+            before[0] = before[1];
+            before[1] = prev;
+            prev = find_next(prev);
+        }
+        for (size_t i = 0; i < 2; i++) {
+            if (before[i] != NULL) {
+                canary_print(snap, before[i], " ");
+            }
+        }
+        canary_print(snap, block, ">");
+        block_t *next = block;
+        for (size_t i = 0; i < 2 && snap_sane(snap, next); i++) {
+            next = find_next(next);
+            canary_print(snap, next, " ");
+        }
+    }
+    abort();
+}
+
+//check the copy: walk the blocks in address order, then every seg list
+static void canary_check(canary_snap_t *snap) {
+    char what[128];
+    char *end = snap->buf + snap->size;
+    block_t *block = snap_block(snap, snap->start);
+    snap->free_blocks = 0;
+    memset(snap->bitmap, 0, snap->size / dsize / 8 + 1);
+    if (block == NULL) {
+        canary_abort(snap, NULL, "heap_start lies outside the heap");
+    }
+    while (get_size(block) > 0) {
+        if (!snap_sane(snap, block)) {
+            canary_abort(snap, block, "bad block size");
+        }
+        if (get_alloc(block) == false) {
+            word_t footer = *header_to_footer(block);
+            if (extract_alloc(block->header) != extract_alloc(footer) ||
+                extract_size(block->header) != extract_size(footer) ||
+                extract_prev_alloc(block->header) !=
+                    extract_prev_alloc(footer)) {
+                canary_abort(snap, block, "footer does not match header");
+            }
+            size_t bit = (size_t)((char *)block - snap->buf) / dsize;
+            snap->bitmap[bit / 8] |= (unsigned char)(1 << (bit % 8));
+            snap->free_blocks++;
+        }
+        block = find_next(block);
+    }
+    if ((char *)block != end - wsize) {
+        canary_abort(snap, block, "epilogue before the end of the heap");
+    }
+
+    size_t listed = 0;
+    for (size_t index = 1; index <= 8; index++) {
+        block_t *prev = NULL;
+        block_t *node = snap->roots[index];
+        while (node != NULL) {
+            block_t *copy = snap_block(snap, node);
+            size_t bit = 0;
+            if (copy != NULL) {
+                bit = (size_t)((char *)copy - snap->buf) / dsize;
+            }
+            if (copy == NULL ||
+                (snap->bitmap[bit / 8] & (1 << (bit % 8))) == 0) {
+                // not a free block, or one already seen on a list
+                snprintf(what, sizeof(what),
+                         "seg list %zu links to %p, not an unlisted free "
+                         "block",
+                         index, (void *)node);
+                canary_abort(snap, prev == NULL ? NULL
+                                                : snap_block(snap, prev),
+                             what);
+            }
+            snap->bitmap[bit / 8] &= (unsigned char)~(1 << (bit % 8));
+            listed++;
+            if (copy->prev != prev) {
+                snprintf(what, sizeof(what),
+                         "prev link on seg list %zu does not point back",
+                         index);
+                canary_abort(snap, copy, what);
+            }
+            size_t class = addressToIndex(find_list(get_size(copy)));
+            if (class != index) {
+                snprintf(what, sizeof(what),
+                         "block of size class %zu on seg list %zu", class,
+                         index);
+                canary_abort(snap, copy, what);
+            }
+            prev = node;
+            node = copy->next;
+        }
+    }
+    if (listed != snap->free_blocks) {
+        for (block = snap_block(snap, snap->start); get_size(block) > 0;
+             block = find_next(block)) {
+            size_t bit = (size_t)((char *)block - snap->buf) / dsize;
+            if ((snap->bitmap[bit / 8] & (1 << (bit % 8))) != 0) {
+                canary_abort(snap, block, "free block on no seg list");
+            }
+        }
+    }
+}
+
+//param[in] size: bytes of heap to copy
+//@return whether snap has room for the copy and its bitmap
+static bool canary_reserve(canary_snap_t *snap, size_t size) {
+    size_t need = round_up(size + size / dsize / 8 + 1, mem_pagesize());
+    if (need <= snap->cap) {
+        return true;
+    }
+    if (snap->buf != NULL) {
+        munmap(snap->buf, snap->cap);
+        snap->buf = NULL;
+        snap->cap = 0;
+    }
+    void *buf = mmap(NULL, need, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        return false;
+    }
+    snap->buf = buf;
+    snap->cap = need;
+    return true;
+}
+
+//copy the heap and the roots, unless a call changes them meanwhile
+//@return whether snap now holds a consistent copy
+static bool canary_take(canary_snap_t *snap) {
+    unsigned long seq = atomic_load_explicit(&canary_seq, memory_order_acquire);
+    if ((seq & 1) != 0) {
+        return false;
+    }
+    // nothing to check until mm_init has laid out a heap
+    char *lo = (char *)mem_heap_lo();
+    block_t *start = __atomic_load_n(&heap_start, __ATOMIC_RELAXED);
+    size_t size = mem_heapsize();
+    if (start == NULL || (char *)start < lo || size == 0 ||
+        !canary_reserve(snap, size)) {
+        return false;
+    }
+    struct iovec local = {snap->buf, size};
+    struct iovec remote = {lo, size};
+    if (process_vm_readv(getpid(), &local, 1, &remote, 1, 0) !=
+        (ssize_t)size) {
+        return false;
+    }
+    snap->start = __atomic_load_n(&heap_start, __ATOMIC_RELAXED);
+    for (size_t index = 1; index <= 8; index++) {
+        snap->roots[index] =
+            __atomic_load_n(indexToAddress(index), __ATOMIC_RELAXED);
+    }
+    atomic_thread_fence(memory_order_acquire);
+    if (atomic_load_explicit(&canary_seq, memory_order_relaxed) != seq ||
+        mem_heapsize() != size) {
+        return false;
+    }
+    snap->lo = lo;
+    snap->size = size;
+    snap->bitmap = (unsigned char *)snap->buf + size;
+    return true;
+}
+
+//the checker thread: check a copy of the heap every CANARY_PERIOD_MS
+static void *canary_thread(void *arg) {
+    static canary_snap_t snap;
+    struct timespec period = {CANARY_PERIOD_MS / 1000,
+                              (CANARY_PERIOD_MS % 1000) * 1000000L};
+#ifdef SCHED_IDLE
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+#endif
+    for (;;) {
+        nanosleep(&period, NULL);
+        for (int tries = 0; tries < CANARY_RETRIES; tries++) {
+            errno = 0;
+            if (canary_take(&snap)) {
+                canary_check(&snap);
+                break;
+            }
+            if (errno == EPERM || errno == ENOSYS) {
+                fprintf(stderr, "mm canary: cannot read the heap (%s), "
+                                "checker stopped\n",
+                        strerror(errno));
+                return NULL;
+            }
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+//start the checker thread, once per process
+static void canary_spawn(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, canary_thread, NULL) != 0) {
+        fprintf(stderr, "mm canary: cannot start the checker thread\n");
+        return;
+    }
+    pthread_detach(thread);
+}
+#endif
+
+//Reattach to a heap that already holds blocks, e.g. a persistent heap that
+//memlib mapped back in from its file. Nothing in the heap is rewritten except
+//the free-list links: every free block found by walking the implicit list is
+//pushed onto its seg list again.
+//@return false if the walk does not end exactly at the epilogue or finds a
+//block that is misaligned or runs off the end of the heap
+static bool reattach_heap(void) {
+    char *hi = (char *)mem_heap_hi();
+    block_t *block;
+    heap_start = (block_t *)((char *)mem_heap_lo() + log_span() + wsize);
+#ifdef DEBUG
+    // the lists are rebuilt from scratch, so the first check is a full one
+    dirty_log = (dirty_log_t *)mem_heap_lo();
+    memset(dirty_log, 0, sizeof(dirty_log_t));
+    dirty_log->overflow = true;
+#endif
+#ifdef MM_STATS
+    // the counts are rebuilt by the walk below, the events start again
+    memset(&heap_stats, 0, sizeof(mm_stats_t));
+#endif
+    root1 = NULL;
+    root2 = NULL;
+    root3 = NULL;
+    root4 = NULL;
+    root5 = NULL;
+    root6 = NULL;
+    root7 = NULL;
+    root8 = NULL;
+    for (block = heap_start; (char *)block <= hi - 7; block = find_next(block)) {
+        size_t size = get_size(block);
+        if (size == 0) {
+            // only the epilogue has size 0, and it must end the heap
+            return ((char *)block == hi - 7) && mm_checkheap(__LINE__);
+        }
+        if ((size % dsize) != 0 || size < min_block_size ||
+            size > (size_t)(hi - (char *)block)) {
+            return false;
+        }
+        if (!get_alloc(block)) {
+            add_to_list(block);
+        } else {
+            count_alloc(size, 1);
+        }
+    }
+    return false;
+}
+
+//the counterpart of mm_init for a heap that already holds blocks, such as a
+//persistent heap that mem_init_persistent mapped back in: the blocks are
+//kept and only the seg lists are rebuilt.
+//@return false if the heap is not one that mm_init laid out
+bool mm_reattach(void) {
+#ifdef HEAP_CANARY
+    pthread_once(&canary_once, canary_spawn);
+#endif
+    bool entered = canary_enter();
+#ifdef GUARD_HEAP
+    quarantine_reset();
+#endif
+    bool ok = mem_heapsize() != 0 && reattach_heap();
+    canary_exit(entered);
+    return ok;
+}
+
 /**
  * @brief
  *
@@ -909,14 +2000,32 @@ bool mm_checkheap(int line) {
  * @return
  */
 //initialize all data structures such as the heap_start and each of the seg
-//free list
+//free list, on a new empty heap above the current break.
 bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+#ifdef HEAP_CANARY
+    pthread_once(&canary_once, canary_spawn);
+#endif
+    bool entered = canary_enter();
+#ifdef GUARD_HEAP
+    quarantine_reset();
+#endif
+
+    // Create the initial empty heap, above the dirty log of debug builds
+    char *bottom = (char *)(mem_sbrk((intptr_t)(log_span() + 2 * wsize)));
 
-    if (start == (void *)-1) {
+    if (bottom == (void *)-1) {
+        canary_exit(entered);
         return false;
     }
+#ifdef MM_STATS
+    memset(&heap_stats, 0, sizeof(mm_stats_t));
+    heap_stats.sbrk_calls = 1;
+#endif
+#ifdef DEBUG
+    dirty_log = (dirty_log_t *)bottom;
+    memset(dirty_log, 0, sizeof(dirty_log_t));
+#endif
+    word_t *start = (word_t *)(bottom + log_span());
 
     /*
      * TODO: delete or replace this comment once you've thought about it.
@@ -939,8 +2048,10 @@ bool mm_init(void) {
     root8 = NULL; //[4096, 8192)
     // Extend the empty heap with a free block of chunksize bytes
     if (extend_heap(chunksize) == NULL) {
+        canary_exit(entered);
         return false;
     }
+    canary_exit(entered);
     return true;
 }
 
@@ -956,6 +2067,7 @@ void *malloc(size_t size) {
     size_t extendsize; // Amount to extend heap if no fit is found
     block_t *block;
     void *bp = NULL;
+    bool entered = canary_enter();
     if (heap_start == NULL) {
         mm_init();
     }
@@ -963,11 +2075,24 @@ void *malloc(size_t size) {
     // Ignore spurious request
     if (size == 0) {
         dbg_ensures(mm_checkheap(__LINE__));
+        canary_exit(entered);
         return bp;
     }
 
+#ifdef GUARD_HEAP
+    if (size >= GUARD_THRESHOLD) {
+        block = guarded_malloc(size);
+        bp = (block == NULL) ? NULL : header_to_payload(block);
+        dbg_ensures(mm_checkheap(__LINE__));
+        canary_exit(entered);
+        return bp;
+    }
+    // Room for the request word and at least one canary byte
+    asize = round_up(size + 2 * wsize + 1, dsize);
+#else
     // Adjust block size to include overhead and to meet alignment requirements
     asize = round_up(size + wsize, dsize);
+#endif
     if (asize < min_block_size) {
         //asize has to be at least min_block_size, any size smaller would cause
         //a segmentation fault
@@ -983,6 +2108,7 @@ void *malloc(size_t size) {
         block = extend_heap(extendsize);
         // extend_heap returns an error
         if (block == NULL) {
+            canary_exit(entered);
             return bp;
         }
     }
@@ -997,9 +2123,14 @@ void *malloc(size_t size) {
     remove_from_list(block);
     // Try to split the block if too large
     split_block(block, asize);
+    count_alloc(get_size(block), 1);
+#ifdef GUARD_HEAP
+    set_request(block, size);
+#endif
     bp = header_to_payload(block);
 
     dbg_ensures(mm_checkheap(__LINE__));
+    canary_exit(entered);
     return bp;
 }
 
@@ -1014,12 +2145,15 @@ void free(void *bp) {
         return;
     }
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
-    write_block(block, size, false);
-    block = coalesce_block(block);
-    dbg_ensures(!get_alloc(block));
-    dbg_ensures((get_size(block) % 16) == 0);
+    bool entered = canary_enter();
+#ifdef GUARD_HEAP
+    check_request(block);
+    quarantine_push(block);
+#else
+    release_block(block);
+#endif
     dbg_ensures(mm_checkheap(__LINE__));
+    canary_exit(entered);
     return;
 }
 
@@ -1054,7 +2188,11 @@ void *realloc(void *ptr, size_t size) {
     }
 
     // Copy the old data
+#ifdef GUARD_HEAP
+    copysize = *request_word(block); // the size that was asked for
+#else
     copysize = get_payload_size(block); // gets size of old payload
+#endif
     if (size < copysize) {
         //if the newsize is smaller, make copysize this new size
         copysize = size;
@@ -5,6 +5,7 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #ifdef DRIVER
 
@@ -65,6 +66,16 @@ extern void *calloc(size_t nmemb, size_t size);
  */
 extern bool mm_init(void);
 
+/**
+ * @brief  Resume using a heap that already holds blocks.
+ *
+ * Call this instead of mm_init() after mem_init_persistent() reports that
+ * it reattached an existing heap.  The blocks in it are kept as they are.
+ *
+ * @return  True on success, False if the heap is not one mm_init() made.
+ */
+extern bool mm_reattach(void);
+
 /* This is for debugging.  Returns false if error encountered */
 /**
  * @brief  Check the heap for inconsistencies.
@@ -74,3 +85,90 @@ extern bool mm_init(void);
  * @return  True if the heap is consistent, False otherwise.
  */
 extern bool mm_checkheap(int line);
+
+/**
+ * @brief  Size of the block holding an allocated payload.
+ *
+ * @param[in] ptr  A pointer returned by malloc, calloc or realloc.
+ *
+ * @return  The size in bytes of the whole block, header included.
+ */
+extern size_t mm_block_size(void *ptr);
+
+/**
+ * @brief  Summarize the free blocks in the heap.
+ *
+ * Walks the free lists, so the cost grows with the number of free blocks.
+ *
+ * @param[out] count  The number of free blocks.
+ * @param[out] largest  The size in bytes of the largest free block.
+ *
+ * @return  The total size in bytes of all free blocks.
+ */
+extern size_t mm_free_summary(size_t *count, size_t *largest);
+
+/** @brief Number of segregated free lists, and so of size classes */
+#define MM_SIZE_CLASSES 8
+
+/**
+ * @brief  Statistics of the allocator.
+ *
+ * Byte and block counts describe the heap as it is now.  Event counters
+ * accumulate from mm_init or mm_reattach, and are only kept by a build
+ * with -DMM_STATS; otherwise they are zero and events is false.
+ */
+typedef struct {
+    size_t heap_size;    /**< Bytes obtained from mem_sbrk */
+    size_t alloc_bytes;  /**< Bytes in allocated blocks, headers included */
+    size_t alloc_blocks; /**< Number of allocated blocks */
+    size_t free_bytes;   /**< Bytes in free blocks */
+    size_t free_blocks;  /**< Number of free blocks */
+    size_t class_free_bytes[MM_SIZE_CLASSES];  /**< free_bytes by class */
+    size_t class_free_blocks[MM_SIZE_CLASSES]; /**< free_blocks by class */
+    uint64_t sbrk_calls; /**< Calls to mem_sbrk */
+    uint64_t splits;     /**< Free blocks split to place a request */
+    uint64_t coalesces;  /**< Free neighbours merged into a freed block */
+    uint64_t fit_searches; /**< Free-list searches for a fitting block */
+    uint64_t fit_probes;   /**< Free blocks examined by those searches */
+    bool events;           /**< Whether the event counters were kept */
+} mm_stats_t;
+
+/**
+ * @brief  Report allocator statistics.
+ *
+ * With -DMM_STATS the counters are maintained incrementally, so this
+ * costs a copy.  Without it, the counts are found by walking the heap.
+ *
+ * @param[out] stats  Filled in with the current statistics.
+ */
+extern void mm_stats(mm_stats_t *stats);
+
+/**
+ * @brief  One block of the heap, as seen by mm_heap_walk().
+ */
+typedef struct {
+    size_t offset;  /**< Address of the block header, from mem_heap_lo() */
+    size_t size;    /**< Size in bytes of the whole block */
+    bool alloc;     /**< True if allocated, false if free */
+    int size_class; /**< Segregated list a block of this size goes on */
+} mm_block_info_t;
+
+/**
+ * @brief  Visit every block in the heap, in address order.
+ *
+ * Walks the whole heap, so the cost grows with the number of blocks.
+ * The heap must not change while the walk is under way.
+ *
+ * @param[in] visit  Called once for each block.
+ * @param[in] arg  Passed to visit unchanged.
+ */
+extern void mm_heap_walk(void (*visit)(const mm_block_info_t *info, void *arg),
+                         void *arg);
+
+/**
+ * @brief  Set to true by a package whose calls may run concurrently.
+ *
+ * Optional.  When it is missing or false, the driver serializes the calls
+ * of the threads replaying a multithreaded trace with a lock.
+ */
+extern const bool mm_thread_safe;
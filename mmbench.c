@@ -0,0 +1,358 @@
+/*
+ * mmbench - time the mm.c allocator on isolated scenarios
+ *
+ * usage: mmbench [-hT] [-n name]
+ *
+ * mdriver times whole traces, so a slower coalesce, split or fit search
+ * shows only once it moves a trace total.  mmbench instead runs small
+ * scenarios that each stress one path through the allocator, and reports
+ * cycles and nanoseconds per call.  Every scenario has a setup part (a
+ * fresh heap, and any blocks that must be live beforehand) and a body;
+ * both are timed with fcyc, setup alone and setup plus body, and only the
+ * difference is charged to the calls in the body.  All sizes and orders
+ * come from a fixed seed, so two builds of mm.c see the same calls.
+ */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "clock.h"
+#include "fcyc.h"
+#include "memlib.h"
+#include "mm.h"
+
+/* Blocks live at once in the order and churn scenarios */
+#define LIVE 2000
+
+/* Calls in the ping-pong and churn scenarios */
+#define ROUNDS 20000
+
+/* Chains grown by the realloc scenarios, and the size they stop at */
+#define CHAINS 64
+#define CHAIN_MAX (64 * 1024)
+
+/* Blocks allocated by the calloc scenarios */
+#define CALLOCS 2000
+#define CALLOC_SIZE 512
+
+typedef struct
+{
+    const char *name;
+    void (*setup)(void);
+    void (*body)(void);
+    double calls; /* calls to the allocator made by body (0: one
+                     realloc chain for each of CHAINS blocks) */
+    const char *desc;
+} scenario_t;
+
+/* Arguments to timed(): the scenario, and whether to run its body */
+typedef struct
+{
+    const scenario_t *sc;
+    bool body;
+} run_t;
+
+static void *blocks[LIVE];
+static size_t sizes[LIVE];    /* random sizes, 16 to 1039 bytes */
+static int slots[ROUNDS];     /* random slots for the churn scenario */
+static size_t churn[ROUNDS];  /* ... and the sizes that replace them */
+
+static void *chains[CHAINS];
+
+/* xorshift64: the same sequence everywhere */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+/* Mostly small sizes, as in the traces: 16 << k plus up to 15 bytes */
+static size_t rand_size(uint64_t *state)
+{
+    uint64_t r = next_rand(state);
+    return ((size_t)16 << (r % 7)) + (size_t)((r >> 8) % 16);
+}
+
+static void init_data(void)
+{
+    uint64_t seed = 0x853c49e6748fea9bULL;
+    int i;
+
+    for (i = 0; i < LIVE; i++)
+        sizes[i] = rand_size(&seed);
+    for (i = 0; i < ROUNDS; i++)
+    {
+        slots[i] = (int)(next_rand(&seed) % LIVE);
+        churn[i] = rand_size(&seed);
+    }
+}
+
+static void check(void *p, const char *what)
+{
+    if (p == NULL)
+    {
+        fprintf(stderr, "ERROR: %s returned NULL\n", what);
+        exit(1);
+    }
+}
+
+/* Setups */
+
+static void fresh_heap(void)
+{
+    mem_reset_brk();
+    if (!mm_init())
+    {
+        fprintf(stderr, "ERROR: mm_init failed\n");
+        exit(1);
+    }
+}
+
+static void live_set(void)
+{
+    int i;
+
+    fresh_heap();
+    for (i = 0; i < LIVE; i++)
+        check(blocks[i] = mm_malloc(sizes[i]), "mm_malloc");
+}
+
+static void dirty_heap(void)
+{
+    int i;
+
+    fresh_heap();
+    for (i = 0; i < CALLOCS; i++)
+        check(blocks[i] = mm_malloc(CALLOC_SIZE), "mm_malloc");
+    for (i = 0; i < CALLOCS; i++)
+    {
+        memset(blocks[i], 0xa5, CALLOC_SIZE);
+        mm_free(blocks[i]);
+    }
+}
+
+/* Bodies */
+
+static void pingpong(size_t size)
+{
+    int i;
+
+    for (i = 0; i < ROUNDS / 2; i++)
+    {
+        void *p = mm_malloc(size);
+        check(p, "mm_malloc");
+        mm_free(p);
+    }
+}
+
+static void pingpong_small(void)
+{
+    pingpong(32);
+}
+
+static void pingpong_large(void)
+{
+    pingpong(4000);
+}
+
+static void alloc_all(void)
+{
+    int i;
+
+    for (i = 0; i < LIVE; i++)
+        check(blocks[i] = mm_malloc(sizes[i]), "mm_malloc");
+}
+
+static void lifo(void)
+{
+    int i;
+
+    alloc_all();
+    for (i = LIVE - 1; i >= 0; i--)
+        mm_free(blocks[i]);
+}
+
+static void fifo(void)
+{
+    int i;
+
+    alloc_all();
+    for (i = 0; i < LIVE; i++)
+        mm_free(blocks[i]);
+}
+
+static void churn_live(void)
+{
+    int i;
+
+    for (i = 0; i < ROUNDS / 2; i++)
+    {
+        int s = slots[i];
+        mm_free(blocks[s]);
+        check(blocks[s] = mm_malloc(churn[i]), "mm_malloc");
+    }
+}
+
+/* Grow every chain from 16 bytes by half again until CHAIN_MAX, either
+   one chain after another (in place where possible) or all in turn */
+static void grow(bool interleave)
+{
+    size_t size = 16;
+    int c;
+
+    if (!interleave)
+    {
+        for (c = 0; c < CHAINS; c++)
+        {
+            void *p = NULL;
+            for (size = 16; size <= CHAIN_MAX; size += size / 2)
+                check(p = mm_realloc(p, size), "mm_realloc");
+            chains[c] = p;
+        }
+        return;
+    }
+    memset(chains, 0, sizeof(chains));
+    for (size = 16; size <= CHAIN_MAX; size += size / 2)
+        for (c = 0; c < CHAINS; c++)
+            check(chains[c] = mm_realloc(chains[c], size), "mm_realloc");
+}
+
+static void grow_alone(void)
+{
+    grow(false);
+}
+
+static void grow_together(void)
+{
+    grow(true);
+}
+
+static void calloc_all(void)
+{
+    int i;
+
+    for (i = 0; i < CALLOCS; i++)
+        check(blocks[i] = mm_calloc(1, CALLOC_SIZE), "mm_calloc");
+}
+
+/* Number of reallocs needed to grow one chain */
+static double chain_calls(void)
+{
+    size_t size;
+    double n = 0;
+
+    for (size = 16; size <= CHAIN_MAX; size += size / 2)
+        n++;
+    return n;
+}
+
+static const scenario_t scenarios[] = {
+    {"pingpong-32", fresh_heap, pingpong_small, ROUNDS,
+     "malloc(32) and free it, repeatedly"},
+    {"pingpong-4000", fresh_heap, pingpong_large, ROUNDS,
+     "malloc(4000) and free it, repeatedly"},
+    {"lifo", fresh_heap, lifo, 2 * LIVE,
+     "malloc random sizes, free newest first"},
+    {"fifo", fresh_heap, fifo, 2 * LIVE,
+     "malloc random sizes, free oldest first"},
+    {"churn", live_set, churn_live, ROUNDS,
+     "free a random live block, malloc a new size"},
+    {"realloc-chain", fresh_heap, grow_alone, 0,
+     "grow one block at a time by 1.5x to 64 KB"},
+    {"realloc-interleaved", fresh_heap, grow_together, 0,
+     "grow blocks in turn by 1.5x to 64 KB"},
+    {"calloc-fresh", fresh_heap, calloc_all, CALLOCS,
+     "calloc(512) from newly grown heap"},
+    {"calloc-reused", dirty_heap, calloc_all, CALLOCS,
+     "calloc(512) from freed, dirty blocks"},
+};
+#define NUM_SCENARIOS (int)(sizeof(scenarios) / sizeof(scenarios[0]))
+
+/*
+ * timed - the function fcyc measures: a scenario's setup, and its body
+ *     if asked for
+ */
+static void timed(void *ptr)
+{
+    const run_t *run = ptr;
+
+    run->sc->setup();
+    if (run->body)
+        run->sc->body();
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-hT] [-n name]\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <name>  Run only scenarios whose name contains "
+                    "<name>.\n");
+    fprintf(stderr, "\t-T         Print the results as tab-separated "
+                    "fields.\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *only = NULL;
+    bool tab_mode = false;
+    double ns_per_cycle;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "hn:T")) != -1)
+    {
+        switch (c)
+        {
+        case 'n':
+            only = optarg;
+            break;
+        case 'T':
+            tab_mode = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+
+    ns_per_cycle = 1e3 / mhz(0);
+    init_data();
+    mem_init(false);
+
+    if (tab_mode)
+        printf("scenario\tcalls\tcycles/op\tns/op\tdescription\n");
+    else
+        printf("%-20s %7s %10s %8s  %s\n", "scenario", "calls", "cycles/op",
+               "ns/op", "description");
+    for (i = 0; i < NUM_SCENARIOS; i++)
+    {
+        const scenario_t *sc = &scenarios[i];
+        run_t setup = {sc, false}, full = {sc, true};
+        double calls = sc->calls > 0 ? sc->calls : CHAINS * chain_calls();
+        double cyc;
+
+        if (only != NULL && strstr(sc->name, only) == NULL)
+            continue;
+        cyc = fcyc(timed, &full) - fcyc(timed, &setup);
+        if (cyc < 0.0)
+            cyc = 0.0;
+        cyc /= calls;
+        if (tab_mode)
+            printf("%s\t%.0f\t%.1f\t%.1f\t%s\n", sc->name, calls, cyc,
+                   cyc * ns_per_cycle, sc->desc);
+        else
+            printf("%-20s %7.0f %10.1f %8.1f  %s\n", sc->name, calls, cyc,
+                   cyc * ns_per_cycle, sc->desc);
+    }
+    mem_deinit();
+    return 0;
+}
@@ -0,0 +1,603 @@
+/**
+ * @file mmtrace.c
+ * @brief An interpositioning library that records the allocations of a
+ *        running program as a malloc trace.
+ *
+ *      unix> LD_PRELOAD=./mmtrace.so MMTRACE_OUT=prog.trc prog args...
+ *      unix> ./mdriver -f prog.trc
+ *
+ * malloc, calloc, realloc and free are passed on to the next definition
+ * (normally libc's) and each call is appended to a single-producer ring
+ * buffer owned by the calling thread.  Every record carries a number from
+ * a global sequence counter, so a writer thread can merge the rings back
+ * into one stream in call order.  The writer alone maps pointers to block
+ * ids (reusing the ids of freed blocks), tracks the peak number of live
+ * bytes, and writes the trace; the calling threads never take a lock.
+ *
+ * The output is a binary trace (see trace.h) unless MMTRACE_OUT ends in
+ * .rep, in which case it is text.  Either way it is a multithreaded trace:
+ * each thread that allocates gets a number, in order of its first call.
+ * The header is filled in when the program exits.  Zero-byte allocations
+ * are not recorded, since mm_malloc may return NULL for them.  Frees of
+ * pointers the recorder never saw allocated (from before it started, from
+ * zero-byte requests, or from memalign and friends) are dropped.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+
+#define TLS __thread __attribute__((tls_model("initial-exec")))
+
+/* One intercepted call */
+typedef struct
+{
+    uint64_t seq;  /* position in the global call order */
+    int type;      /* ALLOC, FREE or REALLOC */
+    void *ptr;     /* block returned, or block freed */
+    void *old;     /* block passed to realloc */
+    size_t size;   /* requested size */
+} record_t;
+
+/* Records of one thread, written by it and read by the writer thread */
+typedef struct ring
+{
+    _Atomic uint64_t head; /* next record the thread fills */
+    _Atomic uint64_t tail; /* next record the writer reads */
+    struct ring *next;     /* list of all rings */
+    int tid;               /* thread number in the trace */
+    record_t recs[MMTRACE_RING_SIZE];
+} ring_t;
+
+/* The functions we interpose on */
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static void (*real_free)(void *);
+
+/* Memory handed out while dlsym itself allocates */
+static char boot_heap[1 << 14] __attribute__((aligned(16)));
+static size_t boot_used = 0;
+static bool resolving = false;
+
+/* Shared state */
+static _Atomic uint64_t next_seq = 0;
+static _Atomic(ring_t *) rings = NULL;
+static atomic_int num_threads = 0;
+static atomic_bool recording = false;
+static atomic_bool stopping = false;
+static pthread_t writer;
+
+/* Per-thread state */
+static TLS ring_t *my_ring = NULL;
+static TLS bool in_hook = false;
+
+/* Writer state: output, and the map from live pointers to block ids */
+static FILE *out = NULL;
+static FILE *tid_out = NULL; /* thread numbers, appended to a binary trace */
+static bool text_out = false;
+static uintptr_t *map_keys = NULL; /* 0 if empty */
+static int *map_vals = NULL;
+static size_t map_cap = 0;
+static size_t map_used = 0;
+static int *free_ids = NULL;       /* stack of ids of freed blocks */
+static size_t num_free_ids = 0;
+static size_t *id_sizes = NULL;    /* live size of each id */
+static size_t ids_cap = 0;
+static int num_ids = 0;
+static uint64_t num_ops = 0;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
+/*****************
+ * Symbol lookup
+ *****************/
+
+static void *boot_alloc(size_t size)
+{
+    size_t start = (boot_used + 15) & ~(size_t)15;
+    if (start + size > sizeof(boot_heap))
+        return NULL;
+    boot_used = start + size;
+    return boot_heap + start;
+}
+
+static bool is_boot(void *ptr)
+{
+    return (char *)ptr >= boot_heap && (char *)ptr < boot_heap + sizeof(boot_heap);
+}
+
+static void resolve(void)
+{
+    resolving = true;
+    real_malloc = dlsym(RTLD_NEXT, "malloc");
+    real_calloc = dlsym(RTLD_NEXT, "calloc");
+    real_realloc = dlsym(RTLD_NEXT, "realloc");
+    real_free = dlsym(RTLD_NEXT, "free");
+    resolving = false;
+    if (!real_malloc || !real_calloc || !real_realloc || !real_free)
+    {
+        fprintf(stderr, "mmtrace: cannot find the libc allocator\n");
+        abort();
+    }
+}
+
+/*******************
+ * Calling threads
+ *******************/
+
+static ring_t *new_ring(void)
+{
+    ring_t *r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r == MAP_FAILED)
+        return NULL;
+    r->tid = atomic_fetch_add(&num_threads, 1);
+    r->next = atomic_load(&rings);
+    while (!atomic_compare_exchange_weak(&rings, &r->next, r))
+        ;
+    return r;
+}
+
+/*
+ * record - append a call to this thread's ring.  The sequence number is
+ *          taken here, so frees must be recorded before the block is
+ *          released and allocations after the block is obtained.
+ */
+static void record(int type, void *ptr, void *old, size_t size)
+{
+    ring_t *r = my_ring;
+    if (r == NULL && (r = my_ring = new_ring()) == NULL)
+        return;
+
+    uint64_t h = atomic_load_explicit(&r->head, memory_order_relaxed);
+    while (h - atomic_load_explicit(&r->tail, memory_order_acquire) ==
+           MMTRACE_RING_SIZE)
+    {
+        if (atomic_load(&stopping))
+            return; /* the writer is gone; drop the call */
+        sched_yield();
+    }
+
+    record_t *rec = &r->recs[h % MMTRACE_RING_SIZE];
+    rec->seq = atomic_fetch_add_explicit(&next_seq, 1, memory_order_relaxed);
+    rec->type = type;
+    rec->ptr = ptr;
+    rec->old = old;
+    rec->size = size;
+    atomic_store_explicit(&r->head, h + 1, memory_order_release);
+}
+
+static bool should_record(void)
+{
+    return !in_hook && atomic_load_explicit(&recording, memory_order_relaxed);
+}
+
+void *malloc(size_t size)
+{
+    if (resolving)
+        return boot_alloc(size);
+    if (real_malloc == NULL)
+        resolve();
+    if (!should_record())
+        return real_malloc(size);
+
+    in_hook = true;
+    void *p = real_malloc(size);
+    if (p != NULL && size != 0)
+        record(ALLOC, p, NULL, size);
+    in_hook = false;
+    return p;
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    if (resolving)
+        return boot_alloc(nmemb * size); /* static memory is zeroed */
+    if (real_calloc == NULL)
+        resolve();
+    if (!should_record())
+        return real_calloc(nmemb, size);
+
+    in_hook = true;
+    void *p = real_calloc(nmemb, size);
+    if (p != NULL && nmemb * size != 0)
+        record(ALLOC, p, NULL, nmemb * size);
+    in_hook = false;
+    return p;
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    if (real_realloc == NULL)
+        resolve();
+    if (is_boot(ptr))
+    {
+        /* Move the block out of boot_heap; its old size is unknown */
+        void *p = malloc(size);
+        size_t avail = (size_t)(boot_heap + sizeof(boot_heap) - (char *)ptr);
+        if (p != NULL)
+            memcpy(p, ptr, size < avail ? size : avail);
+        return p;
+    }
+    if (!should_record())
+        return real_realloc(ptr, size);
+
+    in_hook = true;
+    void *p = real_realloc(ptr, size);
+    if (p != NULL || size == 0)
+        record(REALLOC, p, ptr, size);
+    in_hook = false;
+    return p;
+}
+
+void free(void *ptr)
+{
+    if (ptr == NULL || is_boot(ptr))
+        return;
+    if (real_free == NULL)
+        resolve();
+    if (!should_record())
+    {
+        real_free(ptr);
+        return;
+    }
+
+    in_hook = true;
+    record(FREE, ptr, NULL, 0);
+    real_free(ptr);
+    in_hook = false;
+}
+
+/*****************
+ * Writer thread
+ *****************/
+
+static size_t ptr_hash(uintptr_t key)
+{
+    return (size_t)((key >> 4) * 0x9e3779b97f4a7c15UL) & (map_cap - 1);
+}
+
+static size_t map_find(uintptr_t key)
+{
+    size_t i = ptr_hash(key);
+    while (map_keys[i] != 0 && map_keys[i] != key)
+        i = (i + 1) & (map_cap - 1);
+    return i;
+}
+
+static void map_grow(void)
+{
+    uintptr_t *old_keys = map_keys;
+    int *old_vals = map_vals;
+    size_t old_cap = map_cap;
+    size_t i;
+
+    map_cap = old_cap ? 2 * old_cap : 1 << 12;
+    map_keys = real_calloc(map_cap, sizeof(*map_keys));
+    map_vals = real_malloc(map_cap * sizeof(*map_vals));
+    if (map_keys == NULL || map_vals == NULL)
+    {
+        fprintf(stderr, "mmtrace: out of memory for the pointer map\n");
+        abort();
+    }
+    for (i = 0; i < old_cap; i++)
+    {
+        if (old_keys[i] != 0)
+        {
+            size_t j = map_find(old_keys[i]);
+            map_keys[j] = old_keys[i];
+            map_vals[j] = old_vals[i];
+        }
+    }
+    real_free(old_keys);
+    real_free(old_vals);
+}
+
+static void map_insert(void *ptr, int id)
+{
+    if (2 * (map_used + 1) > map_cap)
+        map_grow();
+    size_t i = map_find((uintptr_t)ptr);
+    map_used += (map_keys[i] == 0);
+    map_keys[i] = (uintptr_t)ptr;
+    map_vals[i] = id;
+}
+
+/*
+ * map_remove - drop a pointer from the map, returning its id or -1
+ */
+static int map_remove(void *ptr)
+{
+    size_t mask = map_cap - 1;
+    size_t i, j;
+    int id;
+
+    if (map_cap == 0)
+        return -1;
+    i = map_find((uintptr_t)ptr);
+    if (map_keys[i] == 0)
+        return -1;
+    id = map_vals[i];
+    map_used--;
+    for (j = (i + 1) & mask; map_keys[j] != 0; j = (j + 1) & mask)
+    {
+        size_t home = ptr_hash(map_keys[j]);
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            map_keys[i] = map_keys[j];
+            map_vals[i] = map_vals[j];
+            i = j;
+        }
+    }
+    map_keys[i] = 0;
+    return id;
+}
+
+static int new_id(void)
+{
+    if (num_free_ids > 0)
+        return free_ids[--num_free_ids];
+    if ((size_t)num_ids == ids_cap)
+    {
+        ids_cap = ids_cap ? 2 * ids_cap : 1 << 12;
+        id_sizes = real_realloc(id_sizes, ids_cap * sizeof(*id_sizes));
+        free_ids = real_realloc(free_ids, ids_cap * sizeof(*free_ids));
+        if (id_sizes == NULL || free_ids == NULL)
+        {
+            fprintf(stderr, "mmtrace: out of memory for block ids\n");
+            abort();
+        }
+    }
+    return num_ids++;
+}
+
+static void emit(int tid, int type, int id, size_t size)
+{
+    if (text_out)
+    {
+        fprintf(out, "%d: ", tid);
+        if (type == FREE)
+            fprintf(out, "f %d\n", id);
+        else
+            fprintf(out, "%c %d %zu\n", type == ALLOC ? 'a' : 'r', id, size);
+    }
+    else
+    {
+        traceop_t op = {.type = type, .index = id, .size = size};
+        uint16_t t = (uint16_t)tid;
+        fwrite(&op, sizeof(op), 1, out);
+        fwrite(&t, sizeof(t), 1, tid_out);
+    }
+    num_ops++;
+}
+
+static void emit_alloc(int tid, void *ptr, size_t size)
+{
+    /* A racing realloc may have released ptr before it was recorded */
+    int id = map_remove(ptr);
+    if (id >= 0)
+    {
+        live_bytes -= id_sizes[id];
+        emit(tid, FREE, id, 0);
+        free_ids[num_free_ids++] = id;
+    }
+    id = new_id();
+    map_insert(ptr, id);
+    id_sizes[id] = size;
+    live_bytes += size;
+    emit(tid, ALLOC, id, size);
+}
+
+static void emit_free(int tid, void *ptr)
+{
+    int id = map_remove(ptr);
+    if (id < 0)
+        return;
+    live_bytes -= id_sizes[id];
+    emit(tid, FREE, id, 0);
+    free_ids[num_free_ids++] = id;
+}
+
+/*
+ * process - turn one record into trace requests
+ */
+static void process(int tid, const record_t *rec)
+{
+    int id;
+
+    switch (rec->type)
+    {
+    case ALLOC:
+        emit_alloc(tid, rec->ptr, rec->size);
+        break;
+    case FREE:
+        emit_free(tid, rec->ptr);
+        break;
+    case REALLOC:
+        if (rec->old == NULL)
+        {
+            emit_alloc(tid, rec->ptr, rec->size);
+            break;
+        }
+        if (rec->size == 0)
+        {
+            emit_free(tid, rec->old);
+            break;
+        }
+        if ((id = map_remove(rec->old)) < 0)
+        {
+            emit_alloc(tid, rec->ptr, rec->size);
+            break;
+        }
+        map_insert(rec->ptr, id);
+        live_bytes += rec->size - id_sizes[id];
+        id_sizes[id] = rec->size;
+        emit(tid, REALLOC, id, rec->size);
+        break;
+    }
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+/*
+ * writer_main - merge the rings in sequence order until told to stop and
+ *               every numbered record has been written
+ */
+static void *writer_main(void *arg __attribute__((unused)))
+{
+    struct timespec nap = {0, 50000};
+    uint64_t expected = 0;
+
+    in_hook = true;
+    for (;;)
+    {
+        bool progress = false;
+        ring_t *r;
+
+        for (r = atomic_load(&rings); r != NULL; r = r->next)
+        {
+            uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+            uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+            while (tail < head && r->recs[tail % MMTRACE_RING_SIZE].seq == expected)
+            {
+                process(r->tid, &r->recs[tail % MMTRACE_RING_SIZE]);
+                tail++;
+                expected++;
+            }
+            if (tail != atomic_load_explicit(&r->tail, memory_order_relaxed))
+            {
+                atomic_store_explicit(&r->tail, tail, memory_order_release);
+                progress = true;
+            }
+        }
+        if (!progress)
+        {
+            if (atomic_load(&stopping) && expected == atomic_load(&next_seq))
+                break;
+            nanosleep(&nap, NULL);
+        }
+    }
+    return NULL;
+}
+
+/*
+ * write_header - fill in the header once the counts are known.  The text
+ *                header was reserved as four fixed-width lines.
+ */
+static void write_header(void)
+{
+    rewind(out);
+    if (text_out)
+    {
+        fprintf(out, "%-20d\n%-20d\n%-20lu\n%-20zu\n", 1, num_ids,
+                (unsigned long)num_ops, peak_bytes);
+    }
+    else
+    {
+        char pad[TRACE_OPS_OFFSET] = {0};
+        trace_header_t hdr = {
+            .weight = 1,
+            .num_ids = num_ids,
+            .num_ops = (int32_t)num_ops,
+            .op_size = sizeof(traceop_t),
+            .data_bytes = peak_bytes,
+            .ops_offset = TRACE_OPS_OFFSET,
+            .num_threads = (uint32_t)atomic_load(&num_threads),
+            .tids_offset = TRACE_OPS_OFFSET + num_ops * sizeof(traceop_t)};
+        memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+        memcpy(pad, &hdr, sizeof(hdr));
+        fwrite(pad, sizeof(pad), 1, out);
+    }
+}
+
+/*
+ * stop_in_child - a forked child records nothing.  It still holds the
+ *     parent's streams, buffered data and all, and exit() would flush them
+ *     into the parent's trace, so their descriptors are pointed at
+ *     /dev/null first.
+ */
+static void stop_in_child(void)
+{
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    atomic_store(&recording, false);
+    if (null_fd < 0)
+        return;
+    if (out != NULL)
+        dup2(null_fd, fileno(out));
+    if (tid_out != NULL)
+        dup2(null_fd, fileno(tid_out));
+    close(null_fd);
+}
+
+__attribute__((constructor)) static void mmtrace_start(void)
+{
+    const char *path = getenv("MMTRACE_OUT");
+    size_t len;
+
+    in_hook = true;
+    if (real_malloc == NULL)
+        resolve();
+    if (path == NULL)
+        path = MMTRACE_DEFAULT_OUT;
+    len = strlen(path);
+    text_out = len > 4 && strcmp(path + len - 4, ".rep") == 0;
+    if ((out = fopen(path, "w")) == NULL ||
+        (!text_out && (tid_out = tmpfile()) == NULL))
+    {
+        perror("mmtrace");
+        in_hook = false;
+        return;
+    }
+    write_header(); /* placeholder, rewritten at exit */
+    pthread_atfork(NULL, NULL, stop_in_child);
+    if (pthread_create(&writer, NULL, writer_main, NULL) != 0)
+    {
+        fprintf(stderr, "mmtrace: cannot start the writer thread\n");
+        fclose(out);
+        out = NULL;
+        in_hook = false;
+        return;
+    }
+    atomic_store(&recording, true);
+    in_hook = false;
+}
+
+__attribute__((destructor)) static void mmtrace_stop(void)
+{
+    if (!atomic_load(&recording))
+        return;
+    in_hook = true;
+    atomic_store(&recording, false);
+    atomic_store(&stopping, true);
+    pthread_join(writer, NULL);
+    if (num_ops > INT32_MAX && !text_out)
+        fprintf(stderr, "mmtrace: trace too long, header is truncated\n");
+    if (tid_out != NULL)
+    {
+        /* Append the thread numbers after the ops */
+        char buf[1 << 12];
+        size_t n;
+        rewind(tid_out);
+        while ((n = fread(buf, 1, sizeof(buf), tid_out)) > 0)
+            fwrite(buf, 1, n, out);
+        fclose(tid_out);
+    }
+    write_header();
+    fclose(out);
+    in_hook = false;
+}
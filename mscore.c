@@ -0,0 +1,274 @@
+/*
+ * mscore.c - Machine score from a few deterministic micro-kernels
+ *
+ * Every kernel works on data laid out from a fixed seed and does a fixed
+ * amount of work, so the only thing that differs from one machine to the
+ * next is how long it takes.  Each kernel is run MSCORE_RUNS times and
+ * the fastest run counts, as in fcyc's K-best scheme; its time is divided
+ * into the time the reference machine took.  The reference is the machine
+ * that MSCORE_KOPS in config.h was measured on.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "clock.h"
+#include "config.h"
+#include "mscore.h"
+
+#define MAXLINE 1024
+
+/* Number of timed runs of each kernel, after one warm-up run */
+#define MSCORE_RUNS 5
+
+/* Pointer chase: a random cycle through 4 MB of 64-byte lines */
+#define CHASE_LINES (1 << 16)
+#define CHASE_STEPS (1 << 18)
+
+/* Copy: 256 KB through a 64-block ring, in a mix of block sizes */
+#define COPY_BYTES (1 << 18)
+#define COPY_ROUNDS 1024
+
+/* List walk: 64K nodes with random keys, branching on each */
+#define WALK_NODES (1 << 16)
+#define WALK_ROUNDS 16
+
+typedef struct
+{
+    const char *name;
+    void (*run)(void);
+    double ref_secs; /* best time on the reference machine */
+} kernel_t;
+
+static volatile uint64_t sink;
+
+/* xorshift64: the same sequence everywhere */
+static uint64_t next_rand(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+static void *xmalloc(size_t size)
+{
+    void *p = malloc(size);
+    if (p == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in mscore\n");
+        exit(1);
+    }
+    return p;
+}
+
+/*
+ * chase - follows a random cyclic permutation of cache lines, so every
+ *     load depends on the one before and most miss the L2 cache
+ */
+static void chase(void)
+{
+    static uint64_t (*lines)[8] = NULL;
+    uint64_t i, p = 0;
+
+    if (lines == NULL)
+    {
+        uint32_t *order = xmalloc(CHASE_LINES * sizeof(uint32_t));
+        uint64_t seed = 0x9e3779b97f4a7c15ULL;
+        lines = xmalloc(CHASE_LINES * sizeof(*lines));
+        for (i = 0; i < CHASE_LINES; i++)
+            order[i] = (uint32_t)i;
+        for (i = CHASE_LINES - 1; i > 0; i--)
+        {
+            uint64_t j = next_rand(&seed) % (i + 1);
+            uint32_t t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+        for (i = 0; i < CHASE_LINES; i++)
+            lines[order[i]][0] = order[(i + 1) % CHASE_LINES];
+        free(order);
+    }
+    for (i = 0; i < CHASE_STEPS; i++)
+        p = lines[p][0];
+    sink = p;
+}
+
+/*
+ * copy - memcpy of blocks of 16 bytes to 4 KB, as in realloc, between
+ *     buffers that fit in the L2 cache
+ */
+static void copy(void)
+{
+    static char *src = NULL, *dst = NULL;
+    static size_t sizes[64];
+    size_t off;
+    int r, k;
+
+    if (src == NULL)
+    {
+        uint64_t seed = 0x2545f4914f6cdd1dULL;
+        src = xmalloc(COPY_BYTES + 4096);
+        dst = xmalloc(COPY_BYTES + 4096);
+        for (k = 0; k < COPY_BYTES + 4096; k++)
+            src[k] = (char)next_rand(&seed);
+        for (k = 0; k < 64; k++)
+            sizes[k] = (size_t)16 << (next_rand(&seed) % 9);
+    }
+    for (r = 0; r < COPY_ROUNDS; r++)
+        for (k = 0, off = 0; off < COPY_BYTES; k = (k + 1) % 64)
+        {
+            memcpy(dst + off, src + off, sizes[k]);
+            off += sizes[k];
+        }
+    sink = (uint64_t)(unsigned char)dst[COPY_BYTES / 2];
+}
+
+/*
+ * walk - walks a linked list, taking one of three paths at each node
+ *     depending on a random key, as a free-list search does
+ */
+typedef struct wnode
+{
+    struct wnode *next;
+    uint64_t key;
+} wnode_t;
+
+static void walk(void)
+{
+    static wnode_t *nodes = NULL;
+    uint64_t fits = 0, small = 0, acc = 0;
+    const wnode_t *n;
+    int r, i;
+
+    if (nodes == NULL)
+    {
+        uint64_t seed = 0xd1b54a32d192ed03ULL;
+        nodes = xmalloc(WALK_NODES * sizeof(wnode_t));
+        for (i = 0; i < WALK_NODES; i++)
+        {
+            nodes[i].next = i + 1 < WALK_NODES ? &nodes[i + 1] : NULL;
+            nodes[i].key = next_rand(&seed);
+        }
+    }
+    for (r = 0; r < WALK_ROUNDS; r++)
+        for (n = nodes; n != NULL; n = n->next)
+        {
+            if (n->key % 3 == 0)
+                fits++;
+            else if (n->key & 4)
+                small += n->key >> 40;
+            else
+                acc ^= n->key;
+        }
+    sink = fits + small + acc;
+}
+
+static const kernel_t kernels[] = {
+    {"pointer chase", chase, MSCORE_CHASE_SECS},
+    {"memcpy", copy, MSCORE_COPY_SECS},
+    {"list walk", walk, MSCORE_WALK_SECS},
+};
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+double measure_machine_score(bool verbose)
+{
+    double log_sum = 0.0;
+    int k, r;
+
+    for (k = 0; k < NUM_KERNELS; k++)
+    {
+        double best = 1e20;
+        kernels[k].run();
+        for (r = 0; r < MSCORE_RUNS; r++)
+        {
+            double secs;
+            start_timer();
+            kernels[k].run();
+            secs = get_timer();
+            if (secs > 0.0 && secs < best)
+                best = secs;
+        }
+        log_sum += log(kernels[k].ref_secs / best);
+        if (verbose)
+            printf("Machine score: %-13s %8.3f ms (%.2fx reference)\n",
+                   kernels[k].name, best * 1e3, kernels[k].ref_secs / best);
+    }
+    return exp(log_sum / NUM_KERNELS);
+}
+
+/*
+ * host_key - host name and CPU model, without spaces or colons, naming
+ *     the line of the cache that belongs to this machine
+ */
+static void host_key(char *key, size_t len)
+{
+    char host[MAXLINE] = "unknown", model[MAXLINE] = "unknown";
+    char buf[MAXLINE];
+    size_t i, j;
+    FILE *fp;
+
+    gethostname(host, sizeof(host) - 1);
+    if ((fp = fopen(CPU_FILE, "r")) != NULL)
+    {
+        while (fgets(buf, MAXLINE, fp) != NULL)
+        {
+            char *colon = strchr(buf, ':');
+            if (strncmp(buf, "model name", 10) == 0 && colon != NULL)
+            {
+                snprintf(model, sizeof(model), "%s", colon + 1);
+                break;
+            }
+        }
+        fclose(fp);
+    }
+    snprintf(buf, sizeof(buf), "%s/%s", host, model);
+    for (i = j = 0; buf[i] != '\0' && j + 1 < len; i++)
+        if (buf[i] != ' ' && buf[i] != '\t' && buf[i] != '\n' &&
+            buf[i] != ':')
+            key[j++] = buf[i];
+    key[j] = '\0';
+}
+
+double machine_score(bool verbose)
+{
+    char key[MAXLINE], buf[MAXLINE];
+    double score = 0.0;
+    FILE *fp;
+
+    host_key(key, sizeof(key));
+    if ((fp = fopen(MSCORE_FILE, "r")) != NULL)
+    {
+        while (fgets(buf, MAXLINE, fp) != NULL)
+        {
+            char *colon = strrchr(buf, ':');
+            if (colon == NULL)
+                continue;
+            *colon = '\0';
+            if (strcmp(buf, key) == 0)
+                score = atof(colon + 1);
+        }
+        fclose(fp);
+    }
+    if (score > 0.0)
+    {
+        if (verbose)
+            printf("Machine score %.3f for %s (cached in %s)\n", score, key,
+                   MSCORE_FILE);
+        return score;
+    }
+
+    score = measure_machine_score(verbose);
+    if ((fp = fopen(MSCORE_FILE, "a")) != NULL)
+    {
+        fprintf(fp, "%s:%.4f\n", key, score);
+        fclose(fp);
+    }
+    if (verbose)
+        printf("Machine score %.3f for %s (measured)\n", score, key);
+    return score;
+}
@@ -0,0 +1,32 @@
+/**
+ * @file mscore.h
+ * @brief Machine score: the speed of this machine relative to a reference
+ *
+ * A few small, deterministic kernels stand in for the work an allocator
+ * does: chasing pointers through a heap bigger than the L2 cache, copying
+ * blocks, and walking a list with branches that cannot be predicted.  Each
+ * is timed, and the score is the geometric mean of its speed relative to
+ * the reference machine, so a machine twice as fast on all of them scores
+ * 2.0.  mdriver scales the reference throughput by the score to get the
+ * throughput targets on a CPU that throughputs.txt does not list.
+ *
+ * The kernels take about a second in all, so the score is cached in
+ * MSCORE_FILE (see config.h), one line per host and CPU model.
+ */
+
+#ifndef __MSCORE_H_
+#define __MSCORE_H_
+
+#include <stdbool.h>
+
+/*
+ * Returns the score of this machine, from the cache if it has one for this
+ * host, else by running the kernels and caching the result.  With verbose
+ * set, prints the speed of each kernel.
+ */
+double machine_score(bool verbose);
+
+/* Runs the kernels, ignoring the cache */
+double measure_machine_score(bool verbose);
+
+#endif /* __MSCORE_H_ */
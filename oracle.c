@@ -0,0 +1,442 @@
+/*
+ * oracle.c - Utilization an allocator could achieve on a trace
+ *
+ * The replay works on a simulated address space.  Allocated blocks and
+ * free gaps are each kept in a btree_t keyed by address, which finds the
+ * neighbours of a block or gap in O(log n).  Gaps are coalesced as they
+ * are made, and also sit in segregated bins by size, GAP_SUB_BINS bins to
+ * each power of two, so that the best fit is the smallest gap in the
+ * first bin that holds one large enough.  A bitmap of the bins that are
+ * not empty lets the search skip over empty ones.
+ *
+ * A block that fits no gap goes at the top of the heap, taking over any
+ * gap that ends there.  Reallocs shrink in place, and grow in place when
+ * the gap or the top of the heap after the block allows; otherwise the
+ * block is placed anew and the old one freed, as realloc must copy.
+ */
+#include <limits.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "btree.h"
+#include "oracle.h"
+
+/* log2 of the number of bins per power of two of gap sizes */
+#define GAP_SUB_BITS 3
+#define GAP_SUB_BINS (1 << GAP_SUB_BITS)
+#define GAP_BINS ((64 - GAP_SUB_BITS + 1) * GAP_SUB_BINS)
+
+/* The simulated heap starts here, so that no block is at address 0 */
+#define HEAP_BASE ORACLE_ALIGN
+
+/* A free gap, in its size bin */
+typedef struct
+{
+    uint64_t lo, size;
+    int prev, next; /* neighbours in the bin, or -1 */
+    int bin;        /* -1 while the record is unused */
+} gap_t;
+
+/* A trace id while it is live */
+typedef struct
+{
+    uint64_t addr;  /* 0 if not live */
+    uint64_t size;  /* block size */
+    size_t payload; /* bytes requested */
+    int death;      /* op that frees it, or INT_MAX */
+} block_t;
+
+typedef struct
+{
+    btree_t *blocks; /* live blocks by address; index is the id */
+    btree_t *gaps;   /* gaps by address; index is the gap record */
+    gap_t *gap;      /* gap records */
+    int num_gap, cap_gap, free_gap; /* free_gap heads the unused records */
+    int bins[GAP_BINS];
+    uint64_t nonempty[GAP_BINS / 64 + 1];
+    block_t *ids;
+    uint64_t top; /* end of the heap */
+} oracle_state_t;
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in oracle\n");
+        exit(1);
+    }
+    return p;
+}
+
+static uint64_t block_size(size_t payload)
+{
+    uint64_t size = ((uint64_t)payload + ORACLE_HEADER + ORACLE_ALIGN - 1) /
+                    ORACLE_ALIGN * ORACLE_ALIGN;
+    return size < ORACLE_MIN_BLOCK ? ORACLE_MIN_BLOCK : size;
+}
+
+/* Bin of a gap of this size, bucketed as in hist.c */
+static int bin_of(uint64_t size)
+{
+    if (size < 2 * GAP_SUB_BINS)
+        return (int)size;
+    int shift = 63 - __builtin_clzll(size) - GAP_SUB_BITS;
+    return (shift + 1) * GAP_SUB_BINS +
+           (int)((size >> shift) - GAP_SUB_BINS);
+}
+
+static char *key(uint64_t addr)
+{
+    return (char *)(uintptr_t)addr;
+}
+
+static uint64_t addr_of(const char *p)
+{
+    return (uint64_t)(uintptr_t)p;
+}
+
+/* Gaps */
+
+static void bin_insert(oracle_state_t *s, int g)
+{
+    int b = bin_of(s->gap[g].size);
+
+    s->gap[g].bin = b;
+    s->gap[g].prev = -1;
+    s->gap[g].next = s->bins[b];
+    if (s->bins[b] >= 0)
+        s->gap[s->bins[b]].prev = g;
+    s->bins[b] = g;
+    s->nonempty[b / 64] |= 1ULL << (b % 64);
+}
+
+static void bin_remove(oracle_state_t *s, int g)
+{
+    gap_t *gp = &s->gap[g];
+
+    if (gp->prev >= 0)
+        s->gap[gp->prev].next = gp->next;
+    else
+        s->bins[gp->bin] = gp->next;
+    if (gp->next >= 0)
+        s->gap[gp->next].prev = gp->prev;
+    if (s->bins[gp->bin] < 0)
+        s->nonempty[gp->bin / 64] &= ~(1ULL << (gp->bin % 64));
+}
+
+static void gap_drop(oracle_state_t *s, int g)
+{
+    bin_remove(s, g);
+    btree_remove(s->gaps, key(s->gap[g].lo), NULL);
+    s->gap[g].bin = -1;
+    s->gap[g].next = s->free_gap;
+    s->free_gap = g;
+}
+
+/*
+ * gap_add - adds the free range [lo, lo + size), merging it with the gaps
+ *     on either side
+ */
+static void gap_add(oracle_state_t *s, uint64_t lo, uint64_t size)
+{
+    const range_t *prev, *next;
+    range_t r;
+    int g;
+
+    if (size == 0)
+        return;
+    btree_neighbors(s->gaps, key(lo), &prev, &next);
+    if (next != NULL && addr_of(next->lo) == lo + size)
+    {
+        g = next->index;
+        size += s->gap[g].size;
+        gap_drop(s, g);
+        btree_neighbors(s->gaps, key(lo), &prev, &next);
+    }
+    if (prev != NULL && addr_of(prev->hi) == lo)
+    {
+        g = prev->index;
+        lo = s->gap[g].lo;
+        size += s->gap[g].size;
+        gap_drop(s, g);
+    }
+
+    if (s->free_gap >= 0)
+    {
+        g = s->free_gap;
+        s->free_gap = s->gap[g].next;
+    }
+    else
+    {
+        if (s->num_gap == s->cap_gap)
+        {
+            s->cap_gap = s->cap_gap ? 2 * s->cap_gap : 1024;
+            s->gap = xrealloc(s->gap, s->cap_gap * sizeof(gap_t));
+        }
+        g = s->num_gap++;
+    }
+    s->gap[g].lo = lo;
+    s->gap[g].size = size;
+    bin_insert(s, g);
+    r.lo = key(lo);
+    r.hi = key(lo + size);
+    r.index = g;
+    btree_insert(s->gaps, &r);
+}
+
+/* best_fit - the smallest gap of at least size bytes, or -1 */
+static int best_fit(const oracle_state_t *s, uint64_t size)
+{
+    int b = bin_of(size), g, best = -1;
+
+    /* The first bin may hold gaps too small; any later one will do */
+    for (g = s->bins[b]; g >= 0; g = s->gap[g].next)
+        if (s->gap[g].size >= size &&
+            (best < 0 || s->gap[g].size < s->gap[best].size))
+            best = g;
+    if (best >= 0)
+        return best;
+    for (b++; b < GAP_BINS; b++)
+    {
+        uint64_t word = s->nonempty[b / 64] >> (b % 64);
+        if (word == 0)
+        {
+            b = (b / 64 + 1) * 64 - 1;
+            continue;
+        }
+        b += __builtin_ctzll(word);
+        for (g = s->bins[b]; g >= 0; g = s->gap[g].next)
+            if (best < 0 || s->gap[g].size < s->gap[best].size)
+                best = g;
+        return best;
+    }
+    return -1;
+}
+
+/* The gap that starts at addr, or -1 */
+static int gap_at(const oracle_state_t *s, uint64_t addr)
+{
+    const range_t *prev, *next;
+
+    btree_neighbors(s->gaps, key(addr), &prev, &next);
+    return prev != NULL && addr_of(prev->lo) == addr ? prev->index : -1;
+}
+
+/* Death of the block that ends at addr (or starts there, if above) */
+static int neighbor_death(const oracle_state_t *s, uint64_t addr, bool above)
+{
+    const range_t *prev, *next;
+
+    btree_neighbors(s->blocks, key(above ? addr : addr - 1), &prev, &next);
+    if (prev == NULL)
+        return INT_MAX; /* the bottom of the heap never goes away */
+    if (above ? addr_of(prev->lo) != addr : addr_of(prev->hi) != addr)
+        return -1;
+    return s->ids[prev->index].death;
+}
+
+/* Blocks */
+
+static void block_add(oracle_state_t *s, int id, uint64_t addr)
+{
+    range_t r;
+
+    s->ids[id].addr = addr;
+    r.lo = key(addr);
+    r.hi = key(addr + s->ids[id].size);
+    r.index = id;
+    btree_insert(s->blocks, &r);
+}
+
+/*
+ * place - finds room for a block of ids[id].size bytes that dies at
+ *     ids[id].death
+ */
+static void place(oracle_state_t *s, int id)
+{
+    uint64_t size = s->ids[id].size, lo, left;
+    int g = best_fit(s, size);
+
+    if (g < 0)
+    {
+        /* Grow the heap, starting inside a gap that ends at the top */
+        const range_t *prev, *next;
+        lo = s->top;
+        btree_neighbors(s->gaps, key(s->top - 1), &prev, &next);
+        if (prev != NULL && addr_of(prev->hi) == s->top)
+        {
+            lo = addr_of(prev->lo);
+            gap_drop(s, prev->index);
+        }
+        s->top = lo + size;
+        block_add(s, id, lo);
+        return;
+    }
+
+    lo = s->gap[g].lo;
+    left = s->gap[g].size - size;
+    if (left > 0 && lo + s->gap[g].size != s->top)
+    {
+        /* Sit next to the neighbour whose death is nearest ours */
+        long death = s->ids[id].death;
+        long below = neighbor_death(s, lo, false);
+        long above = neighbor_death(s, lo + s->gap[g].size, true);
+        if (above >= 0 && (below < 0 || labs(above - death) <
+                                            labs(below - death)))
+            lo += left;
+    }
+    {
+        uint64_t glo = s->gap[g].lo, gsize = s->gap[g].size;
+        gap_drop(s, g);
+        block_add(s, id, lo);
+        gap_add(s, glo, lo - glo);
+        gap_add(s, lo + size, glo + gsize - (lo + size));
+    }
+}
+
+static void release(oracle_state_t *s, int id)
+{
+    block_t *b = &s->ids[id];
+
+    btree_remove(s->blocks, key(b->addr), NULL);
+    gap_add(s, b->addr, b->size);
+    b->addr = 0;
+    b->size = 0;
+    b->payload = 0;
+}
+
+/*
+ * resize - changes the size of a live block in place if it can, and
+ *     returns whether it did
+ */
+static bool resize(oracle_state_t *s, int id, uint64_t size)
+{
+    block_t *b = &s->ids[id];
+    uint64_t end = b->addr + b->size;
+    range_t r;
+    int g;
+
+    if (size <= b->size)
+    {
+        if (b->size - size < ORACLE_MIN_BLOCK)
+            return true;
+        gap_add(s, b->addr + size, b->size - size);
+    }
+    else if (end == s->top)
+        s->top = b->addr + size;
+    else if ((g = gap_at(s, end)) >= 0 &&
+             (b->size + s->gap[g].size >= size ||
+              end + s->gap[g].size == s->top))
+    {
+        /* Take the gap after the block, and grow the heap if it runs
+           up to the top and is too small */
+        uint64_t gend = end + s->gap[g].size;
+        gap_drop(s, g);
+        if (b->addr + size < gend)
+            gap_add(s, b->addr + size, gend - (b->addr + size));
+        else if (b->addr + size > s->top)
+            s->top = b->addr + size;
+    }
+    else
+        return false;
+
+    /* Update the extent in the tree */
+    b->size = size;
+    btree_remove(s->blocks, key(b->addr), &r);
+    r.hi = key(b->addr + size);
+    btree_insert(s->blocks, &r);
+    return true;
+}
+
+void oracle_run(const traceop_t *ops, int num_ops, int num_ids,
+                oracle_t *result)
+{
+    oracle_state_t s;
+    int *death = xrealloc(NULL, ((size_t)num_ops + 1) * sizeof(int));
+    int *next_free = xrealloc(NULL, ((size_t)num_ids + 1) * sizeof(int));
+    size_t payload = 0, formatted = 0;
+    int i;
+
+    /* Work out when each block will be freed */
+    for (i = 0; i <= num_ids; i++)
+        next_free[i] = INT_MAX;
+    for (i = num_ops - 1; i >= 0; i--)
+    {
+        int id = ops[i].index;
+        if (id < 0)
+            continue;
+        if (ops[i].type == FREE)
+            next_free[id] = i;
+        else
+            death[i] = next_free[id];
+    }
+    free(next_free);
+
+    memset(&s, 0, sizeof(s));
+    s.blocks = btree_new();
+    s.gaps = btree_new();
+    s.free_gap = -1;
+    for (i = 0; i < GAP_BINS; i++)
+        s.bins[i] = -1;
+    s.ids = xrealloc(NULL, ((size_t)num_ids + 1) * sizeof(block_t));
+    memset(s.ids, 0, ((size_t)num_ids + 1) * sizeof(block_t));
+    s.top = HEAP_BASE;
+    memset(result, 0, sizeof(*result));
+
+    for (i = 0; i < num_ops; i++)
+    {
+        const traceop_t *op = &ops[i];
+        block_t *b;
+
+        if (op->index < 0)
+            continue; /* free(NULL) */
+        b = &s.ids[op->index];
+        if (b->addr != 0)
+        {
+            payload -= b->payload;
+            formatted -= block_size(b->payload);
+        }
+        if (op->type == FREE || op->size == 0)
+        {
+            /* realloc(p, 0) frees p, and malloc(0) returns NULL */
+            if (b->addr != 0)
+                release(&s, op->index);
+            continue;
+        }
+
+        b->death = death[i];
+        if (b->addr == 0)
+        {
+            b->size = block_size(op->size);
+            place(&s, op->index);
+        }
+        else if (!resize(&s, op->index, block_size(op->size)))
+        {
+            /* Copy to a new block, then free the old one */
+            block_t old = *b;
+            btree_remove(s.blocks, key(old.addr), NULL);
+            b->size = block_size(op->size);
+            place(&s, op->index);
+            gap_add(&s, old.addr, old.size);
+        }
+        b->payload = op->size;
+        payload += op->size;
+        formatted += block_size(op->size);
+
+        if (payload > result->peak_payload)
+            result->peak_payload = payload;
+        if (formatted > result->bound)
+            result->bound = formatted;
+        if (s.top - HEAP_BASE > result->fit)
+            result->fit = (size_t)(s.top - HEAP_BASE);
+    }
+
+    btree_free(s.blocks);
+    btree_free(s.gaps);
+    free(s.gap);
+    free(s.ids);
+    free(death);
+}
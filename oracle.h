@@ -0,0 +1,48 @@
+/**
+ * @file oracle.h
+ * @brief Utilization an allocator could achieve on a trace
+ *
+ * The utilization that mdriver reports divides the peak live payload by
+ * the heap size, so even a perfect allocator falls short of 100%: every
+ * block carries a header and is rounded up to the alignment.  The oracle
+ * replays a trace offline, knowing every request in advance, and gives
+ * two heap sizes to compare an allocator against:
+ *
+ *  - bound: the peak total size of the live blocks, each as small as the
+ *    block format allows.  No allocator that uses the format can do with
+ *    less, and only one that moves blocks could reach it.
+ *  - fit: the heap grown by a clairvoyant best fit, which places each
+ *    block in the smallest gap that holds it, next to whichever neighbour
+ *    dies closest in time to the block itself, so that gaps tend to open
+ *    up whole.  It does not move blocks, so it is achievable, though not
+ *    necessarily optimal; finding the optimum is NP-hard.
+ *
+ * The block format is that of mm.c, one header word and 16-byte
+ * alignment; the few bytes of fixed overhead at the ends of the heap are
+ * not counted.
+ */
+
+#ifndef __ORACLE_H_
+#define __ORACLE_H_
+
+#include <stddef.h>
+
+#include "trace.h"
+
+/* Block format: header bytes, alignment, and smallest block */
+#define ORACLE_HEADER 8
+#define ORACLE_ALIGN 16
+#define ORACLE_MIN_BLOCK 32
+
+typedef struct
+{
+    size_t peak_payload; /* peak bytes requested by live blocks */
+    size_t bound;        /* peak bytes of live blocks, as formatted */
+    size_t fit;          /* heap size reached by the clairvoyant fit */
+} oracle_t;
+
+/* Replays num_ops requests on num_ids ids and fills in *result */
+void oracle_run(const traceop_t *ops, int num_ops, int num_ids,
+                oracle_t *result);
+
+#endif /* __ORACLE_H_ */
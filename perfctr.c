@@ -0,0 +1,121 @@
+/*
+ * perfctr.c - Hardware event counters read through perf_event_open
+ *
+ * Every event is a counter of its own rather than a member of a group:
+ * a group is scheduled all or nothing, so one event the PMU cannot take
+ * would cost all of them.  Each counter is read together with the time it
+ * was enabled and the time it was actually on the PMU, and the count is
+ * scaled by their ratio when the kernel multiplexed it.
+ */
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perfctr.h"
+
+static const struct
+{
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[PERF_NUM_EVENTS] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instrs", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"L1D-miss", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {"dTLB-miss", PERF_TYPE_HW_CACHE,
+     PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+static int fds[PERF_NUM_EVENTS];
+static pid_t owner = 0; /* process the counters were opened in */
+static bool any_open = false;
+static bool warned = false;
+
+bool perf_open(void)
+{
+    struct perf_event_attr attr;
+    int e, err = 0;
+
+    /* Descriptors inherited over fork count the parent's thread */
+    if (owner == getpid())
+        return any_open;
+    if (owner != 0)
+        for (e = 0; e < PERF_NUM_EVENTS; e++)
+            if (fds[e] >= 0)
+                close(fds[e]);
+    owner = getpid();
+    any_open = false;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+    {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = events[e].type;
+        attr.config = events[e].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[e] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fds[e] < 0)
+            err = errno;
+        else
+            any_open = true;
+    }
+    if (!any_open && !warned)
+    {
+        fprintf(stderr, "Hardware counters unavailable (%s); "
+                        "-e has no effect\n", strerror(err));
+        warned = true;
+    }
+    return any_open;
+}
+
+void perf_start(void)
+{
+    int e;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+        if (fds[e] >= 0)
+        {
+            ioctl(fds[e], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[e], PERF_EVENT_IOC_ENABLE, 0);
+        }
+}
+
+void perf_stop(perf_counts_t *counts)
+{
+    uint64_t buf[3]; /* value, time enabled, time running */
+    int e;
+
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+        if (fds[e] >= 0)
+            ioctl(fds[e], PERF_EVENT_IOC_DISABLE, 0);
+
+    counts->valid = 0;
+    for (e = 0; e < PERF_NUM_EVENTS; e++)
+    {
+        counts->count[e] = 0;
+        if (fds[e] < 0 || read(fds[e], buf, sizeof(buf)) != sizeof(buf) ||
+            buf[2] == 0)
+            continue;
+        counts->count[e] = buf[2] < buf[1]
+                               ? (uint64_t)((double)buf[0] * buf[1] / buf[2])
+                               : buf[0];
+        counts->valid |= 1u << e;
+    }
+}
+
+const char *perf_event_name(perf_event_t e)
+{
+    return events[e].name;
+}
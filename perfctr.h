@@ -0,0 +1,52 @@
+/**
+ * @file perfctr.h
+ * @brief Hardware event counters read through perf_event_open
+ *
+ * The driver counts cycles, instructions, L1 data cache read misses,
+ * last-level cache misses and data TLB read misses over the timed replays
+ * of a trace (-e).  Each event is opened on its own, so an event the CPU or
+ * the kernel does not offer is simply left out, and if none can be opened
+ * (no PMU in a virtual machine, or perf_event_paranoid too high) the driver
+ * runs as it would without -e.  Counts are those of the calling thread,
+ * user mode only, scaled up when the kernel had to multiplex the events.
+ */
+
+#ifndef __PERFCTR_H_
+#define __PERFCTR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Events counted, in the order of perf_counts_t.count */
+typedef enum
+{
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_NUM_EVENTS
+} perf_event_t;
+
+typedef struct
+{
+    unsigned valid;                  /* bit e is set if event e was counted */
+    uint64_t count[PERF_NUM_EVENTS]; /* event counts */
+} perf_counts_t;
+
+/*
+ * Opens the counters for the calling thread, once per process.  Returns
+ * false if no event could be opened; the reason is printed the first time.
+ */
+bool perf_open(void);
+
+/* Zeroes the counters and starts them */
+void perf_start(void);
+
+/* Stops the counters and reads them into *counts */
+void perf_stop(perf_counts_t *counts);
+
+/* Short name of event e, for column headers */
+const char *perf_event_name(perf_event_t e);
+
+#endif /* __PERFCTR_H_ */
@@ -0,0 +1,683 @@
+/*
+ * trace.c - Loading and saving of malloc trace files
+ *
+ * Text traces are parsed into a malloc'd op array.  Binary traces are
+ * mapped with mmap and their op array is used where it lies, so loading
+ * one costs a few page-table entries no matter how long the trace is.
+ *
+ * Traces too large to hold in memory can instead be streamed: a reader
+ * thread parses fixed-size chunks ahead of the consumer and renumbers
+ * block ids so that the ids of freed blocks are reused.  The consumer
+ * then only needs per-block arrays as large as the peak number of live
+ * blocks, rather than the number of blocks the trace ever allocates.
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+_Static_assert(sizeof(traceop_t) == 16, "traceop_t must stay 16 bytes");
+_Static_assert(sizeof(trace_header_t) <= TRACE_OPS_OFFSET,
+               "trace header overlaps the op array");
+
+static void trace_error(const char *path, const char *msg)
+{
+    fprintf(stderr, "ERROR: %s: %s\n", path, msg);
+    exit(1);
+}
+
+/*
+ * check_op - NULL if op is a request of a known type on a block id below
+ *            num_ids, else what is wrong with it.  Only a free may use -1,
+ *            the null pointer.
+ */
+static const char *check_op(const traceop_t *op, int num_ids)
+{
+    if (op->type != ALLOC && op->type != FREE && op->type != REALLOC)
+        return "bad request type";
+    if (op->index < (op->type == FREE ? -1 : 0) || op->index >= num_ids)
+        return "block id out of range";
+    return NULL;
+}
+
+/*
+ * check_ops - validate every op of a loaded trace, and its thread number
+ */
+static void check_ops(const trace_file_t *tf, const char *path)
+{
+    int i;
+
+    for (i = 0; i < tf->header.num_ops; i++)
+    {
+        const char *err = check_op(&tf->ops[i], tf->header.num_ids);
+        if (err == NULL && tf->tids != NULL &&
+            tf->tids[i] >= tf->header.num_threads)
+            err = "thread number out of range";
+        if (err != NULL)
+        {
+            fprintf(stderr, "ERROR: %s: request %d: %s\n", path, i, err);
+            exit(1);
+        }
+    }
+}
+
+/*
+ * read_text_header - parse the four header lines of a .rep trace
+ */
+static void read_text_header(trace_header_t *hdr, FILE *fp, const char *path)
+{
+    int weight, num_ids, num_ops;
+    size_t data_bytes;
+
+    if (fscanf(fp, "%d %d %d %zu", &weight, &num_ids, &num_ops,
+               &data_bytes) != 4)
+        trace_error(path, "bad trace header");
+    if (weight < 0 || weight > 3)
+        trace_error(path, "weight can only be in {0, 1, 2 3}");
+    if (num_ids < 0 || num_ops < 0)
+        trace_error(path, "negative id or op count");
+
+    memcpy(hdr->magic, TRACE_MAGIC, sizeof(hdr->magic));
+    hdr->weight = (uint32_t)weight;
+    hdr->num_ids = num_ids;
+    hdr->num_ops = num_ops;
+    hdr->op_size = sizeof(traceop_t);
+    hdr->data_bytes = data_bytes;
+    hdr->ops_offset = TRACE_OPS_OFFSET;
+    hdr->num_threads = 0;
+    hdr->reserved = 0;
+    hdr->tids_offset = 0;
+}
+
+/*
+ * read_text_op - parse one request line of a .rep trace, storing the
+ *                thread number (or -1 if the line has none) in *tid.
+ *                Returns false at end of file.
+ */
+static bool read_text_op(traceop_t *op, int *tid, FILE *fp, const char *path)
+{
+    char tok[16];
+    int index;
+    size_t size;
+
+    if (fscanf(fp, "%15s", tok) != 1)
+        return false;
+    *tid = -1;
+    if (tok[strlen(tok) - 1] == ':')
+    {
+        *tid = atoi(tok);
+        if (*tid < 0 || *tid > UINT16_MAX || fscanf(fp, "%15s", tok) != 1)
+            trace_error(path, "bad thread number");
+    }
+    switch (tok[0])
+    {
+    case 'a':
+    case 'r':
+        if (fscanf(fp, "%d %zu", &index, &size) != 2)
+            trace_error(path, "truncated request");
+        if (index < 0)
+            trace_error(path, "negative block id");
+        op->type = (tok[0] == 'a') ? ALLOC : REALLOC;
+        op->index = index;
+        op->size = size;
+        break;
+    case 'f':
+        if (fscanf(fp, "%d", &index) != 1)
+            trace_error(path, "truncated request");
+        op->type = FREE;
+        op->index = index;
+        op->size = 0;
+        break;
+    default:
+        fprintf(stderr, "ERROR: %s: bogus type character (%c)\n", path,
+                tok[0]);
+        exit(1);
+    }
+    return true;
+}
+
+/*
+ * load_text - parse a .rep trace from an open stream
+ */
+static void load_text(trace_file_t *tf, FILE *fp, const char *path)
+{
+    int num_ops;
+    int max_index = 0;
+    int op_index;
+    int tid;
+
+    read_text_header(&tf->header, fp, path);
+    num_ops = tf->header.num_ops;
+    tf->tids = NULL;
+    tf->map = NULL;
+    tf->map_len = 0;
+
+    /* We'll store each request line in the trace in this array */
+    if ((tf->ops = malloc((size_t)num_ops * sizeof(traceop_t) + 1)) == NULL)
+        trace_error(path, "out of memory for the op array");
+
+    /* read every request line in the trace file */
+    for (op_index = 0; op_index < num_ops; op_index++)
+    {
+        traceop_t *op = &tf->ops[op_index];
+        if (!read_text_op(op, &tid, fp, path))
+            break;
+        if (op->type != FREE && op->index > max_index)
+            max_index = op->index;
+        if (tid >= 0 && tf->tids == NULL &&
+            (tf->tids = calloc((size_t)num_ops, sizeof(uint16_t))) == NULL)
+            trace_error(path, "out of memory for the thread array");
+        if (tid >= 0)
+        {
+            tf->tids[op_index] = (uint16_t)tid;
+            if ((uint32_t)tid >= tf->header.num_threads)
+                tf->header.num_threads = (uint32_t)tid + 1;
+        }
+    }
+    if (op_index != num_ops)
+        trace_error(path, "fewer requests than the header promises");
+    if (num_ops > 0 && max_index != tf->header.num_ids - 1)
+        trace_error(path, "id count does not match the requests");
+    check_ops(tf, path);
+}
+
+/*
+ * check_binary_header - validate the header of a binary trace whose op
+ *                       array must fit in file_len bytes
+ */
+static void check_binary_header(const trace_header_t *hdr, size_t file_len,
+                                const char *path)
+{
+    if (hdr->op_size != sizeof(traceop_t))
+        trace_error(path, "binary trace has a different op layout");
+    if (hdr->weight > 3 || hdr->num_ids < 0 || hdr->num_ops < 0)
+        trace_error(path, "bad binary trace header");
+    if (hdr->ops_offset % sizeof(traceop_t) != 0 ||
+        hdr->ops_offset > file_len ||
+        (file_len - hdr->ops_offset) / sizeof(traceop_t) <
+            (size_t)hdr->num_ops)
+        trace_error(path, "binary trace is shorter than its header says");
+    if (hdr->num_threads > 0 &&
+        (hdr->tids_offset % sizeof(uint16_t) != 0 ||
+         hdr->tids_offset > file_len ||
+         (file_len - hdr->tids_offset) / sizeof(uint16_t) <
+             (size_t)hdr->num_ops))
+        trace_error(path, "binary trace is missing its thread array");
+}
+
+/*
+ * load_binary - map a binary trace and check its header
+ */
+static void load_binary(trace_file_t *tf, int fd, const char *path)
+{
+    struct stat st;
+    trace_header_t *hdr;
+
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(trace_header_t))
+        trace_error(path, "truncated binary trace");
+    tf->map_len = (size_t)st.st_size;
+    tf->map = mmap(NULL, tf->map_len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (tf->map == MAP_FAILED)
+        trace_error(path, "cannot map binary trace");
+    madvise(tf->map, tf->map_len, MADV_SEQUENTIAL);
+
+    hdr = tf->map;
+    check_binary_header(hdr, tf->map_len, path);
+    tf->header = *hdr;
+    tf->ops = (traceop_t *)((char *)tf->map + hdr->ops_offset);
+    tf->tids = hdr->num_threads > 0
+                   ? (uint16_t *)((char *)tf->map + hdr->tids_offset)
+                   : NULL;
+    check_ops(tf, path);
+}
+
+void trace_load(trace_file_t *tf, const char *path)
+{
+    char magic[sizeof(tf->header.magic)];
+    FILE *fp;
+
+    if ((fp = fopen(path, "r")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0)
+    {
+        load_binary(tf, fileno(fp), path);
+    }
+    else
+    {
+        rewind(fp);
+        load_text(tf, fp, path);
+    }
+    fclose(fp);
+}
+
+void trace_unload(trace_file_t *tf)
+{
+    if (tf->map != NULL)
+        munmap(tf->map, tf->map_len);
+    else
+    {
+        free(tf->ops);
+        free(tf->tids);
+    }
+    tf->ops = NULL;
+    tf->tids = NULL;
+    tf->map = NULL;
+}
+
+void trace_save(const trace_file_t *tf, const char *path)
+{
+    char pad[TRACE_OPS_OFFSET] = {0};
+    trace_header_t hdr = tf->header;
+    size_t len = (size_t)hdr.num_ops * sizeof(traceop_t);
+    FILE *fp;
+
+    memcpy(hdr.magic, TRACE_MAGIC, sizeof(hdr.magic));
+    hdr.op_size = sizeof(traceop_t);
+    hdr.ops_offset = TRACE_OPS_OFFSET;
+    if (tf->tids == NULL)
+        hdr.num_threads = 0;
+    hdr.tids_offset = tf->tids ? TRACE_OPS_OFFSET + len : 0;
+    memcpy(pad, &hdr, sizeof(hdr));
+
+    if ((fp = fopen(path, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not create %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    if (fwrite(pad, 1, sizeof(pad), fp) != sizeof(pad) ||
+        fwrite(tf->ops, 1, len, fp) != len ||
+        (tf->tids != NULL &&
+         fwrite(tf->tids, sizeof(uint16_t), (size_t)hdr.num_ops, fp) !=
+             (size_t)hdr.num_ops) ||
+        fclose(fp) != 0)
+        trace_error(path, "write failed");
+}
+
+void trace_save_text(const trace_file_t *tf, const char *path)
+{
+    FILE *fp;
+    int i;
+
+    if ((fp = fopen(path, "w")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not create %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    fprintf(fp, "%u\n%d\n%d\n%lu\n", tf->header.weight, tf->header.num_ids,
+            tf->header.num_ops, (unsigned long)tf->header.data_bytes);
+    for (i = 0; i < tf->header.num_ops; i++)
+    {
+        const traceop_t *op = &tf->ops[i];
+        if (tf->tids != NULL)
+            fprintf(fp, "%u: ", tf->tids[i]);
+        switch (op->type)
+        {
+        case ALLOC:
+            fprintf(fp, "a %d %zu\n", op->index, op->size);
+            break;
+        case REALLOC:
+            fprintf(fp, "r %d %zu\n", op->index, op->size);
+            break;
+        case FREE:
+            fprintf(fp, "f %d\n", op->index);
+            break;
+        }
+    }
+    if (fclose(fp) != 0)
+        trace_error(path, "write failed");
+}
+
+/*******************
+ * Streaming replay
+ *******************/
+
+/* One buffer of ops passed from the reader thread to the consumer */
+typedef struct
+{
+    traceop_t *ops;
+    size_t count;  /* number of valid ops */
+    int num_slots; /* slots used up to the end of this chunk */
+    bool full;     /* filled by the reader, not yet released by consumer */
+} chunk_t;
+
+struct trace_stream
+{
+    FILE *fp;
+    char *path;
+    bool binary;
+    size_t remaining; /* ops left in the file */
+    size_t read;      /* ops read so far */
+    int num_ids;      /* from the header */
+
+    /* Map from trace id to slot, open addressing; owned by the reader */
+    int *keys;        /* trace ids, -1 if empty */
+    int *vals;        /* slot of each id */
+    size_t cap;       /* size of keys and vals, a power of two */
+    size_t used;      /* number of ids in the map */
+    int *free_slots;  /* stack of released slots */
+    size_t num_free;
+    size_t free_cap;
+    int next_slot;    /* slots below this have been handed out */
+
+    /* Double buffer between the reader and the consumer */
+    chunk_t chunk[2];
+    int take;         /* chunk the consumer reads next */
+    bool holding;     /* consumer still holds chunk[take ^ 1] */
+    bool done;        /* consumer has seen the end of the trace */
+    bool stop;        /* reader should quit */
+    pthread_t reader;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+};
+
+static size_t id_hash(int id, size_t cap)
+{
+    return ((uint32_t)id * 2654435761u) & (cap - 1);
+}
+
+/*
+ * remap_find - position of id in the map, or of the empty entry where
+ *              it would go
+ */
+static size_t remap_find(const trace_stream_t *ts, int id)
+{
+    size_t i = id_hash(id, ts->cap);
+    while (ts->keys[i] != -1 && ts->keys[i] != id)
+        i = (i + 1) & (ts->cap - 1);
+    return i;
+}
+
+static void remap_grow(trace_stream_t *ts)
+{
+    int *old_keys = ts->keys;
+    int *old_vals = ts->vals;
+    size_t old_cap = ts->cap;
+    size_t i;
+
+    ts->cap = old_cap ? 2 * old_cap : 1024;
+    ts->keys = malloc(ts->cap * sizeof(int));
+    ts->vals = malloc(ts->cap * sizeof(int));
+    if (ts->keys == NULL || ts->vals == NULL)
+        trace_error(ts->path, "out of memory for the id map");
+    memset(ts->keys, -1, ts->cap * sizeof(int));
+    for (i = 0; i < old_cap; i++)
+    {
+        if (old_keys[i] != -1)
+        {
+            size_t j = remap_find(ts, old_keys[i]);
+            ts->keys[j] = old_keys[i];
+            ts->vals[j] = old_vals[i];
+        }
+    }
+    free(old_keys);
+    free(old_vals);
+}
+
+/*
+ * remap_new - give id a fresh slot, or return the one it already has
+ */
+static int remap_new(trace_stream_t *ts, int id)
+{
+    size_t i;
+    int slot;
+
+    if (2 * (ts->used + 1) > ts->cap)
+        remap_grow(ts);
+    i = remap_find(ts, id);
+    if (ts->keys[i] == id)
+        return ts->vals[i];
+    slot = ts->num_free > 0 ? ts->free_slots[--ts->num_free] : ts->next_slot++;
+    ts->keys[i] = id;
+    ts->vals[i] = slot;
+    ts->used++;
+    return slot;
+}
+
+/*
+ * remap_release - drop id from the map and recycle its slot.  Returns the
+ *                 slot, or -1 if id was not live.
+ */
+static int remap_release(trace_stream_t *ts, int id)
+{
+    size_t mask = ts->cap - 1;
+    size_t i = remap_find(ts, id);
+    size_t j;
+    int slot;
+
+    if (ts->keys[i] != id)
+        return -1;
+    slot = ts->vals[i];
+    ts->used--;
+
+    /* Shift later entries of the probe sequence back into the hole */
+    for (j = (i + 1) & mask; ts->keys[j] != -1; j = (j + 1) & mask)
+    {
+        size_t home = id_hash(ts->keys[j], ts->cap);
+        if (((j - home) & mask) >= ((j - i) & mask))
+        {
+            ts->keys[i] = ts->keys[j];
+            ts->vals[i] = ts->vals[j];
+            i = j;
+        }
+    }
+    ts->keys[i] = -1;
+
+    if (ts->num_free == ts->free_cap)
+    {
+        ts->free_cap = ts->free_cap ? 2 * ts->free_cap : 1024;
+        ts->free_slots = realloc(ts->free_slots, ts->free_cap * sizeof(int));
+        if (ts->free_slots == NULL)
+            trace_error(ts->path, "out of memory for the id map");
+    }
+    ts->free_slots[ts->num_free++] = slot;
+    return slot;
+}
+
+/*
+ * remap_op - replace the trace id of op by its slot
+ */
+static void remap_op(trace_stream_t *ts, traceop_t *op)
+{
+    if (op->index < 0)
+        return;
+    switch (op->type)
+    {
+    case ALLOC:
+        op->index = remap_new(ts, op->index);
+        break;
+    case REALLOC:
+        if (op->size == 0)
+        {
+            /* realloc to 0 frees the block, so the id dies here */
+            int slot = remap_release(ts, op->index);
+            op->index = slot >= 0 ? slot : remap_new(ts, op->index);
+            if (slot < 0)
+                remap_release(ts, op->index);
+        }
+        else
+            op->index = remap_new(ts, op->index);
+        break;
+    case FREE:
+        op->index = remap_release(ts, op->index);
+        break;
+    }
+}
+
+/*
+ * read_chunk - read and renumber the next ops of the trace into buf
+ */
+static size_t read_chunk(trace_stream_t *ts, traceop_t *buf)
+{
+    size_t n = ts->remaining < TRACE_STREAM_CHUNK ? ts->remaining
+                                                  : TRACE_STREAM_CHUNK;
+    size_t i;
+    int tid;
+
+    if (ts->binary)
+    {
+        if (fread(buf, sizeof(traceop_t), n, ts->fp) != n)
+            trace_error(ts->path, "binary trace is shorter than its header says");
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
+            if (!read_text_op(&buf[i], &tid, ts->fp, ts->path))
+                trace_error(ts->path, "fewer requests than the header promises");
+    }
+    for (i = 0; i < n; i++)
+    {
+        const char *err = check_op(&buf[i], ts->num_ids);
+        if (err != NULL)
+        {
+            fprintf(stderr, "ERROR: %s: request %zu: %s\n", ts->path,
+                    ts->read + i, err);
+            exit(1);
+        }
+        remap_op(ts, &buf[i]);
+    }
+    ts->read += n;
+    ts->remaining -= n;
+    return n;
+}
+
+/*
+ * reader_main - fill the two chunks in turn until the trace ends
+ */
+static void *reader_main(void *arg)
+{
+    trace_stream_t *ts = arg;
+    int b = 0;
+
+    for (;;)
+    {
+        chunk_t *c = &ts->chunk[b];
+
+        pthread_mutex_lock(&ts->lock);
+        while (c->full && !ts->stop)
+            pthread_cond_wait(&ts->cond, &ts->lock);
+        pthread_mutex_unlock(&ts->lock);
+        if (ts->stop)
+            break;
+
+        c->count = read_chunk(ts, c->ops);
+        c->num_slots = ts->next_slot;
+
+        pthread_mutex_lock(&ts->lock);
+        c->full = true;
+        pthread_cond_broadcast(&ts->cond);
+        pthread_mutex_unlock(&ts->lock);
+        if (c->count == 0)
+            break;
+        b ^= 1;
+    }
+    return NULL;
+}
+
+trace_stream_t *trace_stream_open(const char *path, trace_header_t *hdr)
+{
+    char magic[sizeof(hdr->magic)];
+    trace_stream_t *ts;
+    struct stat st;
+    int b;
+
+    if ((ts = calloc(1, sizeof(*ts))) == NULL ||
+        (ts->path = strdup(path)) == NULL)
+        trace_error(path, "out of memory for the trace stream");
+    if ((ts->fp = fopen(path, "r")) == NULL)
+    {
+        fprintf(stderr, "ERROR: Could not open %s: %s\n", path,
+                strerror(errno));
+        exit(1);
+    }
+    setvbuf(ts->fp, NULL, _IOFBF, 1 << 20);
+
+    ts->binary = fread(magic, 1, sizeof(magic), ts->fp) == sizeof(magic) &&
+                 memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0;
+    rewind(ts->fp);
+    if (ts->binary)
+    {
+        if (fstat(fileno(ts->fp), &st) < 0 ||
+            fread(hdr, sizeof(*hdr), 1, ts->fp) != 1)
+            trace_error(path, "truncated binary trace");
+        check_binary_header(hdr, (size_t)st.st_size, path);
+        if (fseek(ts->fp, (long)hdr->ops_offset, SEEK_SET) != 0)
+            trace_error(path, "cannot seek to the op array");
+    }
+    else
+        read_text_header(hdr, ts->fp, path);
+    ts->remaining = (size_t)hdr->num_ops;
+    ts->num_ids = hdr->num_ids;
+
+    remap_grow(ts);
+    for (b = 0; b < 2; b++)
+        if ((ts->chunk[b].ops =
+                 malloc(TRACE_STREAM_CHUNK * sizeof(traceop_t))) == NULL)
+            trace_error(path, "out of memory for the trace stream");
+    pthread_mutex_init(&ts->lock, NULL);
+    pthread_cond_init(&ts->cond, NULL);
+    if (pthread_create(&ts->reader, NULL, reader_main, ts) != 0)
+        trace_error(path, "cannot start the reader thread");
+    return ts;
+}
+
+size_t trace_stream_next(trace_stream_t *ts, const traceop_t **ops,
+                         int *num_slots)
+{
+    chunk_t *c = &ts->chunk[ts->take];
+
+    if (ts->done)
+        return 0;
+
+    pthread_mutex_lock(&ts->lock);
+    /* Hand the previous chunk back to the reader */
+    if (ts->holding)
+    {
+        ts->chunk[ts->take ^ 1].full = false;
+        pthread_cond_broadcast(&ts->cond);
+    }
+    while (!c->full)
+        pthread_cond_wait(&ts->cond, &ts->lock);
+    pthread_mutex_unlock(&ts->lock);
+
+    ts->holding = true;
+    ts->take ^= 1;
+    ts->done = (c->count == 0);
+    *ops = c->ops;
+    *num_slots = c->num_slots;
+    return c->count;
+}
+
+void trace_stream_close(trace_stream_t *ts)
+{
+    pthread_mutex_lock(&ts->lock);
+    ts->stop = true;
+    pthread_cond_broadcast(&ts->cond);
+    pthread_mutex_unlock(&ts->lock);
+    pthread_join(ts->reader, NULL);
+
+    pthread_mutex_destroy(&ts->lock);
+    pthread_cond_destroy(&ts->cond);
+    fclose(ts->fp);
+    free(ts->chunk[0].ops);
+    free(ts->chunk[1].ops);
+    free(ts->keys);
+    free(ts->vals);
+    free(ts->free_slots);
+    free(ts->path);
+    free(ts);
+}
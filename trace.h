@@ -0,0 +1,127 @@
+/**
+ * @file trace.h
+ * @brief Loading and saving of malloc trace files
+ *
+ * A trace exists in two formats.  The text format (.rep) has four header
+ * lines (weight, number of ids, number of ops, peak data bytes) followed
+ * by one request per line:
+ *
+ *      a <id> <size>   allocate
+ *      r <id> <size>   reallocate
+ *      f <id>          free
+ *
+ * In a multithreaded trace each request line starts with the number of
+ * the thread that made it, followed by a colon ("2: f 17").  Lines without
+ * one belong to thread 0.
+ *
+ * The binary format (.trc) holds the same information as a trace_header_t
+ * followed by the array of traceop_t records, in native byte order, and
+ * for multithreaded traces an array of 16-bit thread numbers, one per op.  The
+ * records are fixed-width, so op i lives at ops_offset + i * op_size and no
+ * separate index is needed; a binary trace is mapped into memory and used
+ * in place, without parsing or copying.  Loading still checks every op (its
+ * type, block id and thread number), so a corrupt file is rejected rather
+ * than replayed.  Use trconv to produce one.
+ */
+
+#ifndef __TRACE_H_
+#define __TRACE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* First eight bytes of a binary trace */
+#define TRACE_MAGIC "MLTRACE1"
+
+/* Offset of the op array in binary traces written by trace_save() */
+#define TRACE_OPS_OFFSET 64
+
+/* Characterizes a single trace operation (allocator request) */
+typedef struct
+{
+    enum
+    {
+        ALLOC,
+        FREE,
+        REALLOC
+    } type;      /* type of request */
+    int index;   /* index for free() to use later */
+    size_t size; /* byte size of alloc/realloc request */
+} traceop_t;
+
+/* Header of a binary trace */
+typedef struct
+{
+    char magic[8];       /* TRACE_MAGIC, without a terminating null */
+    uint32_t weight;     /* weight for this trace */
+    int32_t num_ids;     /* number of alloc/realloc ids */
+    int32_t num_ops;     /* number of requests */
+    uint32_t op_size;    /* sizeof(traceop_t) of the writer */
+    uint64_t data_bytes; /* peak number of data bytes allocated */
+    uint64_t ops_offset; /* file offset of the op array */
+    uint32_t num_threads; /* threads of a multithreaded trace, else 0 */
+    uint32_t reserved;
+    uint64_t tids_offset; /* file offset of the thread array, if any */
+} trace_header_t;
+
+/* A trace in memory, as returned by trace_load() */
+typedef struct
+{
+    trace_header_t header;
+    traceop_t *ops; /* header.num_ops requests */
+    uint16_t *tids; /* thread of each request, NULL if single-threaded */
+    void *map;      /* mapping of a binary trace, NULL for text */
+    size_t map_len; /* length of that mapping */
+} trace_file_t;
+
+/*
+ * Reads the trace at path, in either format.  Binary traces are mapped
+ * read-only and ops points into the mapping.  Exits the program with a
+ * message if the file cannot be read or is malformed.
+ */
+void trace_load(trace_file_t *tf, const char *path);
+
+/* Releases the memory held by a trace read with trace_load() */
+void trace_unload(trace_file_t *tf);
+
+/*
+ * Writes a trace to path in the binary format.  Exits the program with a
+ * message if the file cannot be written.
+ */
+void trace_save(const trace_file_t *tf, const char *path);
+
+/* Writes a trace to path in the text format, exiting on errors likewise */
+void trace_save_text(const trace_file_t *tf, const char *path);
+
+/* Number of ops handed out by each trace_stream_next() call */
+#define TRACE_STREAM_CHUNK (1 << 16)
+
+/* A trace being read incrementally; see trace_stream_open() */
+typedef struct trace_stream trace_stream_t;
+
+/*
+ * Opens the trace at path, in either format, for streaming and starts a
+ * reader thread that parses ahead of the caller.  Fills in *hdr from the
+ * trace header.  Exits the program with a message on errors.
+ *
+ * Streamed ops do not carry the ids from the file.  Ids are renumbered
+ * into slots, and a slot is reused once the block holding it is freed,
+ * so the slots in use never exceed the peak number of live blocks.  The
+ * index of a free of a block that was never allocated becomes -1.  The
+ * thread numbers of a multithreaded trace are dropped.
+ */
+trace_stream_t *trace_stream_open(const char *path, trace_header_t *hdr);
+
+/*
+ * Hands out the next chunk of up to TRACE_STREAM_CHUNK ops through *ops,
+ * valid until the next call.  *num_slots is set to a bound on the slots
+ * used by the ops handed out so far.  Returns the number of ops in the
+ * chunk, or 0 at the end of the trace.
+ */
+size_t trace_stream_next(trace_stream_t *ts, const traceop_t **ops,
+                         int *num_slots);
+
+/* Stops the reader thread and releases the stream */
+void trace_stream_close(trace_stream_t *ts);
+
+#endif /* __TRACE_H_ */
@@ -0,0 +1,435 @@
+/*
+ * tracegen - generate synthetic malloc traces from a parametric workload
+ *
+ * usage: tracegen [-h] [-n ops] [-s seed] [-S sizes] [-L lifetimes]
+ *                 [-l live] [-r prob] [-w weight] -o outfile
+ *
+ * Each step first frees the blocks whose lifetime has run out, then either
+ * reallocates a random live block (with probability -r) or allocates a new
+ * one, with a size drawn from the size distribution and a lifetime, in
+ * steps, drawn from the lifetime distribution.  With -l, the live set is
+ * capped: a new block first evicts the live block due to die soonest.
+ * Once the trace nears the requested op count, allocation stops and every
+ * block still live is freed, so each trace ends with an empty heap.
+ * Reallocations grow a block by a random factor between 1 and 2.
+ *
+ * Size distributions:
+ *      powerlaw:<alpha>:<min>:<max>    density ~ size^-(alpha+1)
+ *      bimodal:<small>:<large>:<p>     <large> with probability p, else
+ *                                      <small>, each +-25% uniformly
+ *      trace:<file>                    the alloc and realloc sizes of a
+ *                                      recorded .rep or .trc trace
+ * Lifetime distributions, in steps:
+ *      exp:<mean>                      geometric with that mean
+ *      powerlaw:<alpha>:<min>:<max>    as for sizes
+ *      fixed:<n>                       always n
+ *
+ * The same seed and parameters give the same trace on every machine.  The
+ * output is in the text format, or the binary one if its name ends in .trc.
+ */
+#include <getopt.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+typedef enum
+{
+    DIST_POWERLAW,
+    DIST_BIMODAL,
+    DIST_EMPIRICAL,
+    DIST_EXP,
+    DIST_FIXED
+} dist_kind_t;
+
+typedef struct
+{
+    dist_kind_t kind;
+    double a, b, c;  /* parameters, in the order of the spec */
+    size_t *values;  /* DIST_EMPIRICAL: the sizes to draw from */
+    size_t count;    /* ... and how many there are */
+} dist_t;
+
+/* A live block and when it dies */
+typedef struct
+{
+    long death; /* step at which it is freed */
+    size_t size;
+    int pos;    /* position in the live array */
+} block_t;
+
+/* Entry of the min-heap of deaths; stale once its block has been freed */
+typedef struct
+{
+    long death;
+    int id;
+} due_t;
+
+static uint64_t rng_state;
+
+/* splitmix64: well mixed even from small seeds */
+static uint64_t next_rand(void)
+{
+    uint64_t z = (rng_state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1) */
+static double uniform(void)
+{
+    return (next_rand() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static void *xrealloc(void *p, size_t size)
+{
+    if ((p = realloc(p, size)) == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in tracegen\n");
+        exit(1);
+    }
+    return p;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-h] [-n ops] [-s seed] [-S sizes] [-L lifetimes]\n"
+            "          [-l live] [-r prob] [-w weight] -o outfile\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <ops>   Number of requests (default 100000).\n");
+    fprintf(stderr, "\t-s <seed>  Seed of the generator (default 1).\n");
+    fprintf(stderr, "\t-S <dist>  Sizes: powerlaw:<alpha>:<min>:<max>, "
+                    "bimodal:<small>:<large>:<p>\n"
+                    "\t           or trace:<file> (default "
+                    "powerlaw:1:16:65536).\n");
+    fprintf(stderr, "\t-L <dist>  Lifetimes in steps: exp:<mean>, "
+                    "powerlaw:<alpha>:<min>:<max>\n"
+                    "\t           or fixed:<n> (default exp:1000).\n");
+    fprintf(stderr, "\t-l <n>     Keep at most <n> blocks live.\n");
+    fprintf(stderr, "\t-r <p>     Probability of a realloc per step "
+                    "(default 0).\n");
+    fprintf(stderr, "\t-w <w>     Weight written to the header "
+                    "(default 1).\n");
+    fprintf(stderr, "\t-o <file>  Output trace (.trc for binary).\n");
+}
+
+/*
+ * load_empirical - the sizes of the alloc and realloc requests of a trace
+ */
+static void load_empirical(dist_t *d, const char *path)
+{
+    trace_file_t tf;
+    int i;
+
+    trace_load(&tf, path);
+    d->values = xrealloc(NULL, (tf.header.num_ops + 1) * sizeof(size_t));
+    d->count = 0;
+    for (i = 0; i < tf.header.num_ops; i++)
+        if (tf.ops[i].type != FREE && tf.ops[i].size > 0)
+            d->values[d->count++] = tf.ops[i].size;
+    trace_unload(&tf);
+    if (d->count == 0)
+    {
+        fprintf(stderr, "ERROR: %s has no allocations\n", path);
+        exit(1);
+    }
+}
+
+/*
+ * parse_dist - parse a distribution spec; sizes says whether trace: and
+ *     bimodal: are allowed (sizes) or exp: and fixed: (lifetimes)
+ */
+static bool parse_dist(dist_t *d, const char *spec, bool sizes)
+{
+    memset(d, 0, sizeof(*d));
+    if (sscanf(spec, "powerlaw:%lf:%lf:%lf", &d->a, &d->b, &d->c) == 3)
+    {
+        d->kind = DIST_POWERLAW;
+        return d->a > 0 && d->b >= 1 && d->c >= d->b;
+    }
+    if (sizes && sscanf(spec, "bimodal:%lf:%lf:%lf", &d->a, &d->b,
+                        &d->c) == 3)
+    {
+        d->kind = DIST_BIMODAL;
+        return d->a >= 1 && d->b >= 1 && d->c >= 0 && d->c <= 1;
+    }
+    if (sizes && strncmp(spec, "trace:", 6) == 0)
+    {
+        d->kind = DIST_EMPIRICAL;
+        load_empirical(d, spec + 6);
+        return true;
+    }
+    if (!sizes && sscanf(spec, "exp:%lf", &d->a) == 1)
+    {
+        d->kind = DIST_EXP;
+        return d->a >= 1;
+    }
+    if (!sizes && sscanf(spec, "fixed:%lf", &d->a) == 1)
+    {
+        d->kind = DIST_FIXED;
+        return d->a >= 1;
+    }
+    return false;
+}
+
+/*
+ * draw - one value from a distribution, at least 1
+ */
+static double draw(const dist_t *d)
+{
+    double u = uniform(), x = 1.0;
+
+    switch (d->kind)
+    {
+    case DIST_POWERLAW:
+    {
+        /* Inverse of the CDF of a Pareto distribution cut off at max */
+        double lo = pow(d->b, -d->a), hi = pow(d->c, -d->a);
+        x = pow(lo - u * (lo - hi), -1.0 / d->a);
+        break;
+    }
+    case DIST_BIMODAL:
+        x = u < d->c ? d->b : d->a;
+        x *= 0.75 + 0.5 * uniform();
+        break;
+    case DIST_EMPIRICAL:
+        x = (double)d->values[(size_t)(u * d->count)];
+        break;
+    case DIST_EXP:
+        x = 1.0 - d->a * log(1.0 - u);
+        break;
+    case DIST_FIXED:
+        x = d->a;
+        break;
+    }
+    return x < 1.0 ? 1.0 : x;
+}
+
+/* Min-heap of deaths */
+
+static due_t *dues;
+static int num_dues, cap_dues;
+
+static void due_push(long death, int id)
+{
+    int i = num_dues++;
+
+    if (num_dues > cap_dues)
+    {
+        cap_dues = cap_dues ? 2 * cap_dues : 1024;
+        dues = xrealloc(dues, cap_dues * sizeof(due_t));
+    }
+    while (i > 0 && dues[(i - 1) / 2].death > death)
+    {
+        dues[i] = dues[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    dues[i].death = death;
+    dues[i].id = id;
+}
+
+static due_t due_pop(void)
+{
+    due_t top = dues[0], last = dues[--num_dues];
+    int i = 0;
+
+    for (;;)
+    {
+        int c = 2 * i + 1;
+        if (c >= num_dues)
+            break;
+        if (c + 1 < num_dues && dues[c + 1].death < dues[c].death)
+            c++;
+        if (dues[c].death >= last.death)
+            break;
+        dues[i] = dues[c];
+        i = c;
+    }
+    if (num_dues > 0)
+        dues[i] = last;
+    return top;
+}
+
+/* The trace being built */
+
+static traceop_t *ops;
+static int num_ops, cap_ops;
+static block_t *blocks; /* by id */
+static int *live;       /* ids of the live blocks */
+static int num_live;
+static size_t live_bytes, peak_bytes;
+
+static void emit(int type, int id, size_t size)
+{
+    if (num_ops == cap_ops)
+    {
+        cap_ops = cap_ops ? 2 * cap_ops : 4096;
+        ops = xrealloc(ops, cap_ops * sizeof(traceop_t));
+    }
+    ops[num_ops].type = type;
+    ops[num_ops].index = id;
+    ops[num_ops].size = size;
+    num_ops++;
+}
+
+static void free_block(int id)
+{
+    block_t *b = &blocks[id];
+    int moved = live[--num_live];
+
+    live[b->pos] = moved;
+    blocks[moved].pos = b->pos;
+    b->pos = -1;
+    live_bytes -= b->size;
+    emit(FREE, id, 0);
+}
+
+/* Pops the earliest death still pending; returns its id, or -1 if none */
+static int pop_live(void)
+{
+    while (num_dues > 0)
+    {
+        due_t d = due_pop();
+        if (blocks[d.id].pos >= 0 && blocks[d.id].death == d.death)
+            return d.id;
+    }
+    return -1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *outfile = NULL;
+    const char *size_spec = "powerlaw:1:16:65536";
+    const char *life_spec = "exp:1000";
+    long target = 100000, max_live = 0, step;
+    double realloc_prob = 0.0;
+    unsigned weight = 1;
+    dist_t sizes, lifetimes;
+    trace_file_t tf;
+    int c, num_ids = 0;
+    size_t len;
+
+    rng_state = 1;
+    while ((c = getopt(argc, argv, "hn:s:S:L:l:r:w:o:")) != EOF)
+    {
+        switch (c)
+        {
+        case 'n':
+            target = atol(optarg);
+            break;
+        case 's':
+            rng_state = strtoull(optarg, NULL, 0);
+            break;
+        case 'S':
+            size_spec = optarg;
+            break;
+        case 'L':
+            life_spec = optarg;
+            break;
+        case 'l':
+            max_live = atol(optarg);
+            break;
+        case 'r':
+            realloc_prob = atof(optarg);
+            break;
+        case 'w':
+            weight = (unsigned)atoi(optarg);
+            break;
+        case 'o':
+            outfile = optarg;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (outfile == NULL || optind != argc || target < 2 || target > INT32_MAX ||
+        max_live < 0 || realloc_prob < 0 || realloc_prob >= 1 || weight > 3)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (!parse_dist(&sizes, size_spec, true))
+    {
+        fprintf(stderr, "ERROR: bad size distribution '%s'\n", size_spec);
+        exit(1);
+    }
+    if (!parse_dist(&lifetimes, life_spec, false))
+    {
+        fprintf(stderr, "ERROR: bad lifetime distribution '%s'\n", life_spec);
+        exit(1);
+    }
+    blocks = xrealloc(NULL, target * sizeof(block_t));
+    live = xrealloc(NULL, target * sizeof(int));
+
+    for (step = 0; num_ops + num_live + 2 <= target; step++)
+    {
+        /* Retire the blocks whose time has come */
+        while (num_dues > 0 && dues[0].death <= step &&
+               num_ops + num_live + 2 <= target)
+        {
+            int id = pop_live();
+            if (id >= 0)
+                free_block(id);
+        }
+        if (num_ops + num_live + 2 > target)
+            break;
+
+        if (num_live > 0 && uniform() < realloc_prob)
+        {
+            int id = live[next_rand() % num_live];
+            size_t size = (size_t)(blocks[id].size * (1.0 + uniform()));
+            live_bytes += size - blocks[id].size;
+            blocks[id].size = size;
+            emit(REALLOC, id, size);
+        }
+        else
+        {
+            block_t *b;
+            if (max_live > 0 && num_live >= max_live)
+            {
+                free_block(pop_live());
+                if (num_ops + num_live + 2 > target)
+                    break;
+            }
+            b = &blocks[num_ids];
+            b->size = (size_t)draw(&sizes);
+            b->death = step + (long)draw(&lifetimes);
+            b->pos = num_live;
+            live[num_live++] = num_ids;
+            live_bytes += b->size;
+            due_push(b->death, num_ids);
+            emit(ALLOC, num_ids++, b->size);
+        }
+        if (live_bytes > peak_bytes)
+            peak_bytes = live_bytes;
+    }
+
+    /* Free whatever is left, in order of death */
+    while (num_live > 0)
+        free_block(pop_live());
+
+    memset(&tf, 0, sizeof(tf));
+    tf.header.weight = weight;
+    tf.header.num_ids = num_ids;
+    tf.header.num_ops = num_ops;
+    tf.header.data_bytes = peak_bytes;
+    tf.ops = ops;
+    len = strlen(outfile);
+    if (len > 4 && strcmp(outfile + len - 4, ".trc") == 0)
+        trace_save(&tf, outfile);
+    else
+        trace_save_text(&tf, outfile);
+    return 0;
+}
@@ -0,0 +1,103 @@
+/*
+ * trconv - convert malloc traces between the text and binary formats
+ *
+ * usage: trconv [-t] [-o outfile] tracefile ...
+ *
+ * By default each trace is written in the binary format next to its
+ * source, with a .rep suffix replaced by .trc.  With -t the output is
+ * written in the text format instead (suffix .rep), which is handy for
+ * reading a binary trace.  -o names the output and takes one input only.
+ */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+
+#define MAXLINE 1024
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-t] [-o outfile] tracefile ...\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-o <file>  Write the (single) converted trace to <file>.\n");
+    fprintf(stderr, "\t-t         Write text (.rep) rather than binary (.trc).\n");
+}
+
+/*
+ * out_name - derive the output file name from the input file name
+ */
+static void out_name(char *buf, const char *in, bool text)
+{
+    const char *suffix = text ? ".rep" : ".trc";
+    size_t len = strlen(in);
+
+    if (len > 4 && (strcmp(in + len - 4, ".rep") == 0 ||
+                    strcmp(in + len - 4, ".trc") == 0))
+        len -= 4;
+    if (len + strlen(suffix) >= MAXLINE)
+    {
+        fprintf(stderr, "ERROR: file name too long: %s\n", in);
+        exit(1);
+    }
+    memcpy(buf, in, len);
+    strcpy(buf + len, suffix);
+}
+
+int main(int argc, char **argv)
+{
+    const char *outfile = NULL;
+    bool text = false;
+    char buf[MAXLINE];
+    trace_file_t tf;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "ho:t")) != EOF)
+    {
+        switch (c)
+        {
+        case 'o':
+            outfile = optarg;
+            break;
+        case 't':
+            text = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc || (outfile != NULL && argc - optind != 1))
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    for (i = optind; i < argc; i++)
+    {
+        const char *out = outfile;
+        if (out == NULL)
+        {
+            out_name(buf, argv[i], text);
+            out = buf;
+        }
+        if (strcmp(out, argv[i]) == 0)
+        {
+            fprintf(stderr, "ERROR: %s would overwrite itself\n", argv[i]);
+            exit(1);
+        }
+        trace_load(&tf, argv[i]);
+        if (text)
+            trace_save_text(&tf, out);
+        else
+            trace_save(&tf, out);
+        trace_unload(&tf);
+    }
+    return 0;
+}
@@ -0,0 +1,351 @@
+/*
+ * trstat - describe the workload in malloc traces
+ *
+ * usage: trstat [-c] tracefile ...
+ *
+ * For each trace, reports the requests by type, the peak and average live
+ * bytes and blocks, and the distributions of request sizes, of block
+ * lifetimes (counted in requests, from the alloc to the free of an id) and
+ * of the growth factors of reallocs.  It also gives the share of alloc and
+ * realloc requests that fall into each size class of mm.c, from the block
+ * size the allocator would use.  Sizes and lifetimes are bucketed by
+ * powers of two, with quantiles from a hist_t for finer detail.
+ *
+ * The output is JSON, an array with one object per trace, or with -c CSV
+ * rows of the form trace,metric,key,value.
+ */
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+#include "trace.h"
+
+/* Power-of-two buckets: bucket k holds values in [2^k, 2^(k+1)) */
+#define POW2_BUCKETS 64
+
+/*
+ * Block sizes of mm.c: a request takes one header word and is rounded up
+ * to a multiple of two words, at least min_block_size; find_list() then
+ * files the block under the first class whose limit exceeds its size
+ */
+#define MM_WSIZE 8
+#define MM_DSIZE 16
+#define MM_MIN_BLOCK 32
+#define MM_CLASSES 8
+static const uint64_t class_limit[MM_CLASSES - 1] = {32,  64,  128, 256,
+                                                     512, 1024, 8192};
+
+/* Realloc growth factors, new size over old, by upper bound */
+#define GROWTH_BUCKETS 8
+static const double growth_limit[GROWTH_BUCKETS - 1] = {0.5,  0.999, 1.001,
+                                                        1.25, 1.5,   2.0,
+                                                        4.0};
+static const char *growth_name[GROWTH_BUCKETS] = {
+    "<0.5", "0.5-1", "1", "1-1.25", "1.25-1.5", "1.5-2", "2-4", ">4"};
+
+typedef struct
+{
+    uint64_t counts[POW2_BUCKETS];
+    hist_t hist;
+} dist_t;
+
+typedef struct
+{
+    const char *name;
+    long allocs, frees, reallocs;
+    uint64_t peak_bytes, peak_blocks;
+    double avg_bytes, avg_blocks;
+    dist_t sizes;     /* of alloc and realloc requests */
+    dist_t lifetimes; /* of freed ids, in requests */
+    long never_freed; /* ids still live at the end */
+    uint64_t growth[GROWTH_BUCKETS];
+    uint64_t classes[MM_CLASSES];
+} trace_stats_t;
+
+/* One id of the trace while it is live */
+typedef struct
+{
+    size_t size;
+    long born;
+    bool live;
+} id_state_t;
+
+static bool csv_mode = false;
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-c] tracefile ...\n", prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-c         Write CSV (trace,metric,key,value) "
+                    "rather than JSON.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+}
+
+static void dist_record(dist_t *d, uint64_t value)
+{
+    int k = 0;
+
+    while (k + 1 < POW2_BUCKETS && (value >> (k + 1)) != 0)
+        k++;
+    d->counts[k]++;
+    hist_record(&d->hist, value);
+}
+
+static int size_class(size_t size)
+{
+    size_t asize = (size + MM_WSIZE + MM_DSIZE - 1) / MM_DSIZE * MM_DSIZE;
+    int c;
+
+    if (asize < MM_MIN_BLOCK)
+        asize = MM_MIN_BLOCK;
+    for (c = 0; c < MM_CLASSES - 1; c++)
+        if (asize < class_limit[c])
+            break;
+    return c;
+}
+
+static int growth_bucket(double factor)
+{
+    int b;
+
+    for (b = 0; b < GROWTH_BUCKETS - 1; b++)
+        if (factor < growth_limit[b])
+            break;
+    return b;
+}
+
+/*
+ * analyze - replay the requests of a trace, keeping only sizes and ages
+ */
+static void analyze(trace_stats_t *st, const trace_file_t *tf)
+{
+    int n = tf->header.num_ops, i;
+    id_state_t *ids = calloc((size_t)tf->header.num_ids + 1, sizeof(*ids));
+    uint64_t live_bytes = 0, live_blocks = 0;
+    double sum_bytes = 0.0, sum_blocks = 0.0;
+
+    if (ids == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in trstat\n");
+        exit(1);
+    }
+    for (i = 0; i < n; i++)
+    {
+        const traceop_t *op = &tf->ops[i];
+        id_state_t *id = &ids[op->index];
+
+        switch (op->type)
+        {
+        case ALLOC:
+            st->allocs++;
+            dist_record(&st->sizes, op->size);
+            st->classes[size_class(op->size)]++;
+            id->size = op->size;
+            id->born = i;
+            id->live = true;
+            live_bytes += op->size;
+            live_blocks++;
+            break;
+        case REALLOC:
+            st->reallocs++;
+            dist_record(&st->sizes, op->size);
+            st->classes[size_class(op->size)]++;
+            if (id->live && id->size > 0)
+                st->growth[growth_bucket((double)op->size / id->size)]++;
+            if (!id->live)
+            {
+                id->born = i;
+                id->live = true;
+                live_blocks++;
+            }
+            live_bytes += op->size - id->size;
+            id->size = op->size;
+            break;
+        case FREE:
+            st->frees++;
+            if (!id->live)
+                break;
+            dist_record(&st->lifetimes, (uint64_t)(i - id->born));
+            live_bytes -= id->size;
+            live_blocks--;
+            id->size = 0;
+            id->live = false;
+            break;
+        }
+        if (live_bytes > st->peak_bytes)
+            st->peak_bytes = live_bytes;
+        if (live_blocks > st->peak_blocks)
+            st->peak_blocks = live_blocks;
+        sum_bytes += (double)live_bytes;
+        sum_blocks += (double)live_blocks;
+    }
+    st->never_freed = (long)live_blocks;
+    st->avg_bytes = n > 0 ? sum_bytes / n : 0.0;
+    st->avg_blocks = n > 0 ? sum_blocks / n : 0.0;
+    free(ids);
+}
+
+/* JSON output */
+
+static void json_dist(const char *key, const dist_t *d, bool last)
+{
+    static const double qs[] = {0.5, 0.9, 0.99};
+    bool first = true;
+    int k;
+
+    printf("    \"%s\": {\n", key);
+    printf("      \"count\": %llu, \"max\": %llu,",
+           (unsigned long long)d->hist.count, (unsigned long long)d->hist.max);
+    for (k = 0; k < 3; k++)
+        printf(" \"p%g\": %llu%s", qs[k] * 100,
+               (unsigned long long)hist_quantile(&d->hist, qs[k]),
+               k < 2 ? "," : ",\n");
+    printf("      \"buckets\": [");
+    for (k = 0; k < POW2_BUCKETS; k++)
+    {
+        if (d->counts[k] == 0)
+            continue;
+        printf("%s\n        {\"lo\": %llu, \"count\": %llu}", first ? "" : ",",
+               k == 0 ? 0ULL : 1ULL << k, (unsigned long long)d->counts[k]);
+        first = false;
+    }
+    printf("%s]\n    }%s\n", first ? "" : "\n      ", last ? "" : ",");
+}
+
+static void json_trace(const trace_stats_t *st, bool last)
+{
+    uint64_t sized = (uint64_t)(st->allocs + st->reallocs);
+    int k;
+
+    printf("  {\n");
+    printf("    \"trace\": \"%s\",\n", st->name);
+    printf("    \"ops\": {\"alloc\": %ld, \"free\": %ld, \"realloc\": %ld},\n",
+           st->allocs, st->frees, st->reallocs);
+    printf("    \"live_bytes\": {\"peak\": %llu, \"average\": %.1f},\n",
+           (unsigned long long)st->peak_bytes, st->avg_bytes);
+    printf("    \"live_blocks\": {\"peak\": %llu, \"average\": %.1f, "
+           "\"at_end\": %ld},\n",
+           (unsigned long long)st->peak_blocks, st->avg_blocks,
+           st->never_freed);
+    json_dist("sizes", &st->sizes, false);
+    json_dist("lifetimes", &st->lifetimes, false);
+    printf("    \"realloc_growth\": {");
+    for (k = 0; k < GROWTH_BUCKETS; k++)
+        printf("%s\"%s\": %llu", k ? ", " : "", growth_name[k],
+               (unsigned long long)st->growth[k]);
+    printf("},\n");
+    printf("    \"size_classes\": [");
+    for (k = 0; k < MM_CLASSES; k++)
+        printf("%s\n      {\"class\": %d, \"lo\": %llu, \"fraction\": %.4f}",
+               k ? "," : "", k + 1,
+               (unsigned long long)(k == 0 ? 0 : class_limit[k - 1]),
+               sized ? (double)st->classes[k] / sized : 0.0);
+    printf("\n    ]\n  }%s\n", last ? "" : ",");
+}
+
+/* CSV output */
+
+static void csv_dist(const trace_stats_t *st, const char *metric,
+                     const dist_t *d)
+{
+    int k;
+
+    printf("%s,%s,count,%llu\n", st->name, metric,
+           (unsigned long long)d->hist.count);
+    printf("%s,%s,max,%llu\n", st->name, metric,
+           (unsigned long long)d->hist.max);
+    printf("%s,%s,p50,%llu\n", st->name, metric,
+           (unsigned long long)hist_quantile(&d->hist, 0.5));
+    printf("%s,%s,p90,%llu\n", st->name, metric,
+           (unsigned long long)hist_quantile(&d->hist, 0.9));
+    printf("%s,%s,p99,%llu\n", st->name, metric,
+           (unsigned long long)hist_quantile(&d->hist, 0.99));
+    for (k = 0; k < POW2_BUCKETS; k++)
+        if (d->counts[k] != 0)
+            printf("%s,%s_bucket,%llu,%llu\n", st->name, metric,
+                   k == 0 ? 0ULL : 1ULL << k, (unsigned long long)d->counts[k]);
+}
+
+static void csv_trace(const trace_stats_t *st)
+{
+    uint64_t sized = (uint64_t)(st->allocs + st->reallocs);
+    int k;
+
+    printf("%s,ops,alloc,%ld\n", st->name, st->allocs);
+    printf("%s,ops,free,%ld\n", st->name, st->frees);
+    printf("%s,ops,realloc,%ld\n", st->name, st->reallocs);
+    printf("%s,live_bytes,peak,%llu\n", st->name,
+           (unsigned long long)st->peak_bytes);
+    printf("%s,live_bytes,average,%.1f\n", st->name, st->avg_bytes);
+    printf("%s,live_blocks,peak,%llu\n", st->name,
+           (unsigned long long)st->peak_blocks);
+    printf("%s,live_blocks,average,%.1f\n", st->name, st->avg_blocks);
+    printf("%s,live_blocks,at_end,%ld\n", st->name, st->never_freed);
+    csv_dist(st, "size", &st->sizes);
+    csv_dist(st, "lifetime", &st->lifetimes);
+    for (k = 0; k < GROWTH_BUCKETS; k++)
+        printf("%s,realloc_growth,%s,%llu\n", st->name, growth_name[k],
+               (unsigned long long)st->growth[k]);
+    for (k = 0; k < MM_CLASSES; k++)
+        printf("%s,size_class,%d,%.4f\n", st->name, k + 1,
+               sized ? (double)st->classes[k] / sized : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    trace_stats_t *st;
+    trace_file_t tf;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "hc")) != EOF)
+    {
+        switch (c)
+        {
+        case 'c':
+            csv_mode = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (optind == argc)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+
+    /* A few kilobytes each, for the histograms */
+    if ((st = malloc(sizeof(*st))) == NULL)
+    {
+        fprintf(stderr, "ERROR: out of memory in trstat\n");
+        exit(1);
+    }
+    if (csv_mode)
+        printf("trace,metric,key,value\n");
+    else
+        printf("[\n");
+    for (i = optind; i < argc; i++)
+    {
+        memset(st, 0, sizeof(*st));
+        st->name = argv[i];
+        trace_load(&tf, argv[i]);
+        analyze(st, &tf);
+        trace_unload(&tf);
+        if (csv_mode)
+            csv_trace(st);
+        else
+            json_trace(st, i + 1 == argc);
+    }
+    if (!csv_mode)
+        printf("]\n");
+    free(st);
+    return 0;
+}